@@ -0,0 +1,171 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <set>
+#include <cctype>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "jed.h"
+
+// batch mode shared by the decoder and encoder programs
+//   each file of a directory or list is a root task of a work-stealing scheduler,
+//   whose workers each reuse their own decoder or encoder and buffers from one file to the next,
+//   and the outcome of every file is written to a summary in the output directory
+
+// outcome of one file of a batch
+struct BatchResult {
+    std::string output;
+
+    // "ok", or the stage that failed: "read", "decode", "encode" or "write"
+    const char* status = "ok";
+
+    unsigned int width = 0;
+    unsigned int height = 0;
+    double milliseconds = 0;
+};
+
+// true if the filename ends in one of the extensions, ignoring case
+inline bool hasExtension(const std::string& filename, const std::vector<std::string>& extensions) {
+    const std::size_t pos = filename.find_last_of('.');
+    if (pos == std::string::npos) {
+        return false;
+    }
+    std::string extension = filename.substr(pos + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) {
+        return (char)std::tolower(c);
+    });
+    return std::find(extensions.begin(), extensions.end(), extension) != extensions.end();
+}
+
+// list the files of a batch, in the order they are summarized
+//   a directory gives the files in it with one of the extensions, sorted by name,
+//   anything else is read as a list of paths, one per line
+inline bool listBatchFiles(const std::string& path, const std::vector<std::string>& extensions,
+                           std::vector<std::string>& files) {
+    struct stat status;
+    if (stat(path.c_str(), &status) != 0) {
+        std::cout << "Error - Batch input not found: " << path << '\n';
+        return false;
+    }
+
+    if (S_ISDIR(status.st_mode)) {
+        DIR* const dir = opendir(path.c_str());
+        if (dir == nullptr) {
+            std::cout << "Error - Error opening batch directory\n";
+            return false;
+        }
+        const std::string prefix = (path.back() == '/') ? path : (path + "/");
+        while (const dirent* const entry = readdir(dir)) {
+            const std::string filename = prefix + entry->d_name;
+            if (hasExtension(filename, extensions) && stat(filename.c_str(), &status) == 0 && S_ISREG(status.st_mode)) {
+                files.push_back(filename);
+            }
+        }
+        closedir(dir);
+        std::sort(files.begin(), files.end());
+        return true;
+    }
+
+    std::ifstream listFile(path);
+    if (!listFile.is_open()) {
+        std::cout << "Error - Error opening batch list\n";
+        return false;
+    }
+    std::string line;
+    while (std::getline(listFile, line)) {
+        // lists written on Windows end their lines in \r\n
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            files.push_back(line);
+        }
+    }
+    return true;
+}
+
+// create the output directory of a batch, unless it already exists
+inline bool makeOutputDirectory(const std::string& dir) {
+    struct stat status;
+    if (mkdir(dir.c_str(), 0777) != 0 && (stat(dir.c_str(), &status) != 0 || !S_ISDIR(status.st_mode))) {
+        std::cout << "Error - Error creating output directory: " << dir << '\n';
+        return false;
+    }
+    return true;
+}
+
+// the output path of an input file, in the output directory and with its extension replaced,
+//   and suffix appended to its name
+inline std::string batchOutputPath(const std::string& outDir, const std::string& filename, const std::string& extension,
+                                   const std::string& suffix = "") {
+    const std::size_t slash = filename.find_last_of('/');
+    const std::string name = (slash == std::string::npos) ? filename : filename.substr(slash + 1);
+    const std::size_t pos = name.find_last_of('.');
+    const std::string prefix = (outDir.back() == '/') ? outDir : (outDir + "/");
+    return prefix + ((pos == std::string::npos) ? name : name.substr(0, pos)) + suffix + "." + extension;
+}
+
+// set the output path of every file of a batch
+//   an input with the same name as an earlier one, from another directory of a list,
+//   gets _2, _3 and so on appended to its output name, so that no output overwrites another
+inline void setBatchOutputPaths(const std::string& outDir, const std::vector<std::string>& files,
+                                const std::string& extension, std::vector<BatchResult>& results) {
+    std::set<std::string> used;
+    for (std::size_t i = 0; i < files.size(); ++i) {
+        std::string path = batchOutputPath(outDir, files[i], extension);
+        for (unsigned int n = 2; !used.insert(path).second; ++n) {
+            path = batchOutputPath(outDir, files[i], extension, "_" + std::to_string(n));
+        }
+        results[i].output = path;
+    }
+}
+
+// print how busy each worker of the scheduler was, and how many of its tasks it stole
+inline void printWorkerStats(const jed::Scheduler& scheduler) {
+    std::vector<jed::WorkerStats> stats;
+    scheduler.getStats(stats);
+    for (std::size_t i = 0; i < stats.size(); ++i) {
+        const double busy = (stats[i].elapsedSeconds > 0) ? stats[i].busySeconds / stats[i].elapsedSeconds : 0;
+        std::cout << "Worker " << i << ": " << (int)(busy * 100 + 0.5) << "% busy, "
+                  << stats[i].tasks << " tasks, " << stats[i].stolen << " stolen\n";
+    }
+}
+
+// write the results of a batch as tab-separated values, one line per file after a header line
+//   and print how many files failed
+inline bool writeBatchSummary(const std::string& filename, const std::vector<std::string>& files,
+                              const std::vector<BatchResult>& results) {
+    std::ofstream outFile(filename, std::ios::out | std::ios::binary);
+    if (!outFile.is_open()) {
+        std::cout << "Error - Error opening summary file\n";
+        return false;
+    }
+
+    std::size_t failed = 0;
+    outFile << "input\toutput\tstatus\twidth\theight\tmilliseconds\n";
+    for (std::size_t i = 0; i < files.size(); ++i) {
+        const BatchResult& result = results[i];
+        outFile << files[i] << '\t' << result.output << '\t' << result.status << '\t'
+                << result.width << '\t' << result.height << '\t' << result.milliseconds << '\n';
+        if (result.status != std::string("ok")) {
+            failed += 1;
+        }
+    }
+    outFile.close();
+    if (!outFile) {
+        std::cout << "Error - Error writing summary file\n";
+        return false;
+    }
+
+    std::cout << "Processed " << files.size() << " files, " << failed << " failed, summary in " << filename << '\n';
+    return true;
+}
+
+#endif
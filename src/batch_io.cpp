@@ -0,0 +1,579 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <system_error>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define BATCH_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#include "batch_io.h"
+
+namespace {
+
+typedef unsigned char byte;
+
+// a read or write of a whole file, done in as many parts as the system needs
+struct Operation {
+    bool write = false;
+    std::size_t index = 0; // position of the input in the batch
+    std::string filename;  // output written to, for writes
+    int fd = -1;
+    std::vector<byte> buffer;
+    std::size_t done = 0;  // bytes transferred so far
+
+    // the rest of the buffer, for the part in flight
+    iovec part;
+};
+
+// the result of one part of an operation: bytes transferred, or -errno
+typedef std::pair<Operation*, long> Completion;
+
+// carries out the parts of operations, one part in flight per operation
+class IOBackend {
+public:
+    virtual ~IOBackend() {}
+
+    virtual const char* name() const = 0;
+
+    // start transferring the rest of the operation's buffer
+    virtual void submit(Operation* op) = 0;
+
+    // collect the parts that have completed, waiting for at least one
+    virtual void reap(std::vector<Completion>& completed) = 0;
+};
+
+// carries out each part as it is submitted, with a blocking call on the I/O thread
+class BlockingBackend : public IOBackend {
+private:
+    std::vector<Completion> finished;
+
+public:
+    const char* name() const override {
+        return "threads";
+    }
+
+    void submit(Operation* op) override {
+        const ssize_t result = op->write ?
+            pwrite(op->fd, op->part.iov_base, op->part.iov_len, op->done) :
+            pread(op->fd, op->part.iov_base, op->part.iov_len, op->done);
+        finished.emplace_back(op, (result < 0) ? -errno : result);
+    }
+
+    void reap(std::vector<Completion>& completed) override {
+        completed.insert(completed.end(), finished.begin(), finished.end());
+        finished.clear();
+    }
+};
+
+#if defined(BATCH_IO_URING)
+// carries out parts through an io_uring, so many are in flight with one system call to submit them all
+//   and collect those that have completed
+//   the rings are used directly through the kernel's interface, without liburing
+class UringBackend : public IOBackend {
+private:
+    int fd = -1;
+
+    // the rings shared with the kernel: one mapping when it supports that, otherwise two,
+    //   and the submission queue entries
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    std::size_t sqRingSize = 0;
+    std::size_t cqRingSize = 0;
+    io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+    std::size_t sqesSize = 0;
+
+    unsigned* sqTail = nullptr;
+    unsigned* sqMask = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned* cqMask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    // entries written but not yet passed to the kernel
+    unsigned toSubmit = 0;
+
+    // every operation with a part in flight, so they can all be failed if the ring breaks
+    std::vector<Operation*> inFlight;
+
+public:
+    // the ring has room for this many parts, more than are ever in flight
+    static const unsigned entries = 64;
+
+    ~UringBackend() {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqesSize);
+        }
+        if (cqRing != MAP_FAILED && cqRing != sqRing) {
+            munmap(cqRing, cqRingSize);
+        }
+        if (sqRing != MAP_FAILED) {
+            munmap(sqRing, sqRingSize);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // set up the ring, return false if the kernel does not allow it
+    bool start() {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0) {
+            return false;
+        }
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMap) {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) {
+            return false;
+        }
+        cqRing = singleMap ? sqRing :
+            mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) {
+            return false;
+        }
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+
+        byte* const sq = (byte*)sqRing;
+        byte* const cq = (byte*)cqRing;
+        sqTail = (unsigned*)(sq + params.sq_off.tail);
+        sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+        sqArray = (unsigned*)(sq + params.sq_off.array);
+        cqHead = (unsigned*)(cq + params.cq_off.head);
+        cqTail = (unsigned*)(cq + params.cq_off.tail);
+        cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    const char* name() const override {
+        return "io_uring";
+    }
+
+    // readv and writev with a single buffer, as they are in every kernel with io_uring
+    void submit(Operation* op) override {
+        const unsigned tail = *sqTail;
+        const unsigned slot = tail & *sqMask;
+        io_uring_sqe& sqe = sqes[slot];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe.fd = op->fd;
+        sqe.addr = (unsigned long long)&op->part;
+        sqe.len = 1;
+        sqe.off = op->done;
+        sqe.user_data = (unsigned long long)op;
+        sqArray[slot] = slot;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        toSubmit += 1;
+        inFlight.push_back(op);
+    }
+
+    void reap(std::vector<Completion>& completed) override {
+        while (true) {
+            const long entered = syscall(__NR_io_uring_enter, fd, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (entered >= 0) {
+                toSubmit -= entered;
+                break;
+            }
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                // the ring itself failed, so nothing in flight will ever complete
+                for (Operation* const op : inFlight) {
+                    completed.emplace_back(op, -EIO);
+                }
+                inFlight.clear();
+                toSubmit = 0;
+                return;
+            }
+        }
+
+        unsigned head = *cqHead;
+        const unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            const io_uring_cqe& cqe = cqes[head & *cqMask];
+            Operation* const op = (Operation*)cqe.user_data;
+            completed.emplace_back(op, cqe.res);
+            inFlight.erase(std::find(inFlight.begin(), inFlight.end(), op));
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+};
+#endif
+
+// parts in flight at once
+const unsigned int maxInFlight = 64;
+
+}
+
+// state shared by the workers and the I/O thread
+struct BatchIO::Context {
+    const std::vector<std::string> files;
+    const std::size_t prefetch;
+    const std::size_t maxBytes;
+    std::unique_ptr<IOBackend> backend;
+    std::thread thread;
+    bool threaded = false;
+
+    // guards everything below
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    // inputs read so far, each waiting to be taken by a worker
+    struct Input {
+        bool done = false;
+        bool read = false;
+        std::vector<byte> data;
+    };
+    std::vector<Input> inputs;
+    std::size_t nextRead = 0;
+    std::size_t nextTaken = 0;
+
+    // outputs queued and not yet opened
+    std::deque<Operation*> writes;
+    std::size_t pendingWrites = 0;
+    std::vector<std::size_t> failedWrites;
+
+    // bytes read and not yet taken, and written and not yet done
+    std::size_t heldBytes = 0;
+    std::size_t writeBytes = 0;
+
+    // buffers left over from earlier reads and writes, kept to be reused
+    std::vector<std::vector<byte>> spareBuffers;
+
+    bool finishing = false;
+
+    Context(const std::vector<std::string>& inputFiles, const std::size_t k, const std::size_t bytes) :
+    files(inputFiles),
+    prefetch(std::max<std::size_t>(k, 1)),
+    maxBytes(bytes),
+    inputs(inputFiles.size())
+    {}
+
+    std::vector<byte> takeSpare() {
+        std::vector<byte> buffer;
+        if (!spareBuffers.empty()) {
+            buffer.swap(spareBuffers.back());
+            spareBuffers.pop_back();
+        }
+        return buffer;
+    }
+
+    void keepSpare(std::vector<byte>& buffer) {
+        if (spareBuffers.size() < prefetch && buffer.capacity() > 0) {
+            buffer.clear();
+            spareBuffers.emplace_back();
+            spareBuffers.back().swap(buffer);
+        }
+    }
+
+    // open the file of an operation and size the buffer of a read
+    //   return false, having printed why, if that fails
+    bool open(Operation* const op) {
+        if (op->write) {
+            op->fd = ::open(op->filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            if (op->fd < 0) {
+                std::cout << "Error - Error opening output file\n";
+                return false;
+            }
+            return true;
+        }
+
+        struct stat status;
+        op->fd = ::open(files[op->index].c_str(), O_RDONLY | O_CLOEXEC);
+        if (op->fd < 0 || fstat(op->fd, &status) != 0) {
+            std::cout << "Error - Error opening input file\n";
+            return false;
+        }
+        op->buffer.resize(status.st_size);
+        return true;
+    }
+
+    // account for an operation that has finished, or failed, and free it
+    void finish(Operation* const op, bool succeeded) {
+        if (op->fd >= 0 && close(op->fd) != 0 && op->write) {
+            succeeded = false;
+        }
+        // files that could not be opened have already been reported
+        if (!succeeded && op->fd >= 0) {
+            std::cout << (op->write ? "Error - Error writing output file\n" : "Error - Error reading input file\n");
+        }
+
+        if (op->write) {
+            heldBytes -= op->buffer.size();
+            writeBytes -= op->buffer.size();
+            pendingWrites -= 1;
+            if (!succeeded) {
+                failedWrites.push_back(op->index);
+            }
+            keepSpare(op->buffer);
+        }
+        else {
+            Input& input = inputs[op->index];
+            input.done = true;
+            input.read = succeeded;
+            if (succeeded) {
+                input.data.swap(op->buffer);
+            }
+            else {
+                heldBytes -= op->buffer.size();
+                keepSpare(op->buffer);
+            }
+        }
+        changed.notify_all();
+        delete op;
+    }
+
+    // open files and keep their parts in flight until told to finish
+    //   writes are started before reads, as they free memory
+    void run() {
+        std::vector<Completion> completed;
+        std::vector<Operation*> resubmit;
+        unsigned int inFlight = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            Operation* op = nullptr;
+            if (inFlight < maxInFlight && !writes.empty()) {
+                op = writes.front();
+                writes.pop_front();
+            }
+            else if (inFlight < maxInFlight && nextRead < inputs.size() && nextRead < nextTaken + prefetch &&
+                     heldBytes < maxBytes) {
+                op = new (std::nothrow) Operation;
+                if (op == nullptr) {
+                    std::cout << "Error - Memory error\n";
+                    inputs[nextRead].done = true;
+                    nextRead += 1;
+                    changed.notify_all();
+                    continue;
+                }
+                op->index = nextRead++;
+                op->buffer = takeSpare();
+            }
+            else if (inFlight == 0) {
+                if (finishing && writes.empty()) {
+                    return;
+                }
+                changed.wait(lock);
+                continue;
+            }
+
+            // start the operation, or collect the parts that have completed
+            if (op != nullptr) {
+                lock.unlock();
+                const bool opened = open(op);
+                lock.lock();
+                if (!op->write) {
+                    heldBytes += op->buffer.size();
+                }
+                if (!opened || op->buffer.empty()) {
+                    finish(op, opened);
+                    continue;
+                }
+                lock.unlock();
+                op->part.iov_base = op->buffer.data();
+                op->part.iov_len = op->buffer.size();
+                backend->submit(op);
+                lock.lock();
+                inFlight += 1;
+                continue;
+            }
+
+            lock.unlock();
+            completed.clear();
+            backend->reap(completed);
+            lock.lock();
+            resubmit.clear();
+            for (const Completion& completion : completed) {
+                Operation* const completedOp = completion.first;
+                const long result = completion.second;
+                if (result == -EINTR || result == -EAGAIN) {
+                    resubmit.push_back(completedOp);
+                    continue;
+                }
+                // a read of 0 bytes means the file got shorter since it was opened
+                inFlight -= 1;
+                if (result <= 0) {
+                    finish(completedOp, false);
+                    continue;
+                }
+                completedOp->done += result;
+                if (completedOp->done < completedOp->buffer.size()) {
+                    resubmit.push_back(completedOp);
+                    inFlight += 1;
+                    continue;
+                }
+                finish(completedOp, true);
+            }
+            lock.unlock();
+            for (Operation* const resubmitted : resubmit) {
+                resubmitted->part.iov_base = resubmitted->buffer.data() + resubmitted->done;
+                resubmitted->part.iov_len = resubmitted->buffer.size() - resubmitted->done;
+                backend->submit(resubmitted);
+            }
+            lock.lock();
+        }
+    }
+};
+
+BatchIO::BatchIO(const std::vector<std::string>& files, const unsigned int prefetch, const std::size_t maxBytes,
+                 const bool useUring) :
+context(new Context(files, prefetch, maxBytes))
+{
+#if defined(BATCH_IO_URING)
+    if (useUring) {
+        std::unique_ptr<UringBackend> uring(new UringBackend);
+        if (uring->start()) {
+            context->backend = std::move(uring);
+        }
+    }
+#else
+    (void)useUring;
+#endif
+    if (context->backend == nullptr) {
+        context->backend.reset(new BlockingBackend);
+    }
+
+    // without the I/O thread, each read and write is done by the worker asking for it
+    try {
+        context->thread = std::thread([this]() { context->run(); });
+        context->threaded = true;
+    }
+    catch (const std::system_error&) {
+        context->threaded = false;
+    }
+}
+
+BatchIO::~BatchIO() {
+    {
+        std::lock_guard<std::mutex> lock(context->mutex);
+        context->finishing = true;
+        context->changed.notify_all();
+    }
+    if (context->threaded) {
+        context->thread.join();
+    }
+    for (Operation* const op : context->writes) {
+        delete op;
+    }
+    delete context;
+}
+
+const char* BatchIO::backend() const {
+    return context->threaded ? context->backend->name() : "none";
+}
+
+bool BatchIO::next(std::size_t& index, std::vector<unsigned char>& data) {
+    std::unique_lock<std::mutex> lock(context->mutex);
+    index = context->nextTaken++;
+    if (!context->threaded) {
+        lock.unlock();
+        std::ifstream inFile(context->files[index], std::ios::in | std::ios::binary | std::ios::ate);
+        if (!inFile.is_open()) {
+            std::cout << "Error - Error opening input file\n";
+            return false;
+        }
+        data.resize((std::size_t)inFile.tellg());
+        inFile.seekg(0);
+        inFile.read((char*)data.data(), data.size());
+        if (!inFile) {
+            std::cout << "Error - Error reading input file\n";
+            return false;
+        }
+        return true;
+    }
+
+    context->changed.notify_all();
+    Context::Input& input = context->inputs[index];
+    context->changed.wait(lock, [&]() { return input.done; });
+    if (!input.read) {
+        return false;
+    }
+    data.swap(input.data);
+    context->heldBytes -= data.size();
+    context->keepSpare(input.data);
+    context->changed.notify_all();
+    return true;
+}
+
+void BatchIO::write(const std::size_t index, const std::string& filename, std::vector<unsigned char>& contents) {
+    std::unique_lock<std::mutex> lock(context->mutex);
+    if (!context->threaded) {
+        lock.unlock();
+        std::ofstream outFile(filename, std::ios::out | std::ios::binary);
+        if (!outFile.is_open()) {
+            std::cout << "Error - Error opening output file\n";
+        }
+        else {
+            outFile.write((const char*)contents.data(), contents.size());
+            outFile.close();
+        }
+        if (!outFile) {
+            if (outFile.is_open()) {
+                std::cout << "Error - Error writing output file\n";
+            }
+            lock.lock();
+            context->failedWrites.push_back(index);
+        }
+        return;
+    }
+
+    // writes always finish, so waiting for them never holds up the reads they make room for
+    context->changed.wait(lock, [&]() {
+        return context->writeBytes == 0 || context->heldBytes + contents.size() <= context->maxBytes;
+    });
+
+    Operation* const op = new (std::nothrow) Operation;
+    if (op == nullptr) {
+        std::cout << "Error - Memory error\n";
+        context->failedWrites.push_back(index);
+        return;
+    }
+    op->write = true;
+    op->index = index;
+    op->filename = filename;
+    op->buffer.swap(contents);
+    contents = context->takeSpare();
+    context->heldBytes += op->buffer.size();
+    context->writeBytes += op->buffer.size();
+    context->pendingWrites += 1;
+    context->writes.push_back(op);
+    context->changed.notify_all();
+}
+
+void BatchIO::finish(std::vector<BatchResult>& results) {
+    std::unique_lock<std::mutex> lock(context->mutex);
+    context->changed.wait(lock, [&]() { return context->pendingWrites == 0; });
+    for (const std::size_t index : context->failedWrites) {
+        results[index].status = "write";
+    }
+}
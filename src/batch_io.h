@@ -0,0 +1,75 @@
+#ifndef BATCH_IO_H
+#define BATCH_IO_H
+
+#include <vector>
+#include <string>
+#include <chrono>
+
+#include "batch.h"
+
+// reads the inputs of a batch ahead of the workers and writes their outputs behind them
+//   one background thread opens the files and keeps their reads and writes in flight,
+//   through io_uring on Linux where the kernel allows it, otherwise with plain blocking calls
+//   inputs are read in the order of the batch, up to prefetch ahead of the workers,
+//   and reads only start while the data read and waiting, and written and pending,
+//   is below maxBytes, so at most one file more than that is held at once
+class BatchIO {
+public:
+    BatchIO(const std::vector<std::string>& files, unsigned int prefetch, std::size_t maxBytes, bool useUring);
+
+    // waits for every write to finish
+    ~BatchIO();
+
+    // "io_uring" or "threads"
+    const char* backend() const;
+
+    // wait for the next input of the batch to be read and swap its contents into data
+    //   index is the input's position in the batch
+    //   return false if it could not be read
+    bool next(std::size_t& index, std::vector<unsigned char>& data);
+
+    // queue contents to be written to filename for the input at index,
+    //   swapping in a buffer left over from earlier reads and writes for the caller to reuse
+    //   waits while too much is pending to be written
+    void write(std::size_t index, const std::string& filename, std::vector<unsigned char>& contents);
+
+    // wait for every write to finish, and mark the results of those that failed
+    void finish(std::vector<BatchResult>& results);
+
+private:
+    struct Context;
+    Context* context;
+
+    BatchIO(const BatchIO&) = delete;
+    BatchIO& operator=(const BatchIO&) = delete;
+};
+
+// process every file as a root task of the scheduler, each taking the next input io has read
+//   each worker, and the calling thread if the scheduler has none, has its own Worker
+//   holding the decoder or encoder and buffers that all the files it processes reuse
+//   process(worker, index, result) processes the input at index, which is in worker.data,
+//   and queues its output on io
+//   results has one per input, with their outputs already set for inputs that cannot be read
+template <typename Worker, typename Process>
+void runBatch(jed::Scheduler& scheduler, BatchIO& io, const std::size_t count,
+              std::vector<BatchResult>& results, const Process& process) {
+    std::vector<Worker> workers(scheduler.size() + 1);
+    for (std::size_t i = 0; i < count; ++i) {
+        scheduler.submit([&]() {
+            Worker& worker = workers[scheduler.workerIndex()];
+            std::size_t index = 0;
+            if (!io.next(index, worker.data)) {
+                results[index].status = "read";
+                return;
+            }
+            const auto start = std::chrono::steady_clock::now();
+            process(worker, index, results[index]);
+            results[index].milliseconds = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count();
+        });
+    }
+    scheduler.wait();
+    io.finish(results);
+}
+
+#endif
@@ -1,100 +1,398 @@
 #include <iostream>
-#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "jpg.h"
 
-// helper class to read bits from a file
-class BitReader {
+namespace {
+
+// the entropy-coded data of one scan with its markers and byte stuffing removed
+//   restarts holds the offset in data of the start of each restart interval,
+//   so intervals can be found, skipped, or decoded on their own
+struct EntropySegment {
+    std::vector<byte> data;
+    std::vector<std::size_t> restarts;
+};
+
+// a Huffman table as it was when the deferred scans that read it were started,
+//   kept apart from the image as a DHT marker may redefine the table before they are decoded
+struct HuffmanSnapshot {
+    HuffmanTable table;
+    HuffmanLookup lookup;
+};
+
+// the Huffman table of a component that a deferred scan does not read
+const uint noHuffmanSnapshot = (uint)-1;
+
+// a progressive scan read ahead of being decoded, so it can be decoded concurrently
+//   with the scans it does not depend on
+struct DeferredScan {
+    // the scan's header, and the restart interval in effect for it
+    byte componentsInScan = 0;
+    byte startOfSelection = 0;
+    byte endOfSelection = 0;
+    byte successiveApproximationHigh = 0;
+    byte successiveApproximationLow = 0;
+    bool usedInScan[3] = { false };
+    uint restartInterval = 0;
+
+    // the snapshots of the DC and AC table each component is decoded with
+    uint dcTables[3] = { noHuffmanSnapshot, noHuffmanSnapshot, noHuffmanSnapshot };
+    uint acTables[3] = { noHuffmanSnapshot, noHuffmanSnapshot, noHuffmanSnapshot };
+
+    // byte range of the scan's entropy-coded data in the JPG
+    std::size_t begin = 0;
+    std::size_t end = 0;
+
+    // later scans that wait for this one, and the number of earlier scans this one waits for
+    std::vector<uint> dependents;
+    uint dependencies = 0;
+};
+
+// JPGs with more scans than this are decoded one scan at a time,
+//   which also bounds the Huffman tables kept for deferred scans
+const uint maxDeferredScans = 64;
+
+// the progress of decoding a baseline image whose MCU rows are reconstructed,
+//   by other threads, while its scan is still being entropy decoded
+//   MCU rows are handed out in order, each one once it is entropy decoded,
+//   and a row's pixels are converted once it and its neighbours are transformed
+class DecodeProgress {
 private:
-    byte nextByte = 0;
-    byte nextBit = 0;
-    std::ifstream inFile;
+    std::mutex mutex;
+    std::condition_variable changed;
+    uint decodedRows = 0; // block rows entropy decoded so far
+    std::vector<bool> transformed; // MCU rows dequantized and transformed
+    uint nextTask = 0;
+    bool cancelled = false;
 
 public:
-    BitReader(const std::string& filename) {
-        inFile.open(filename, std::ios::in | std::ios::binary);
+    explicit DecodeProgress(const uint mcuRows) :
+    transformed(mcuRows, false)
+    {}
+
+    // block rows [0, rows) are entropy decoded
+    void setDecoded(const uint rows) {
+        std::lock_guard<std::mutex> lock(mutex);
+        decodedRows = std::max(decodedRows, rows);
+        changed.notify_all();
+    }
+
+    void setTransformed(const uint mcuRow) {
+        std::lock_guard<std::mutex> lock(mutex);
+        transformed[mcuRow] = true;
+        changed.notify_all();
+    }
+
+    // stop handing out work, as the image turned out invalid
+    void cancel() {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancelled = true;
+        changed.notify_all();
+    }
+
+    // take the next task, return false once there are none left or decoding was cancelled
+    bool nextTaskOf(const uint tasks, uint& task) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (cancelled || nextTask >= tasks) {
+            return false;
+        }
+        task = nextTask++;
+        return true;
+    }
+
+    // wait until block rows [0, rows) are entropy decoded, return false if cancelled
+    bool waitDecoded(const uint rows) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() { return cancelled || decodedRows >= rows; });
+        return !cancelled;
+    }
+
+    // wait until an MCU row is transformed, return false if cancelled
+    bool waitTransformed(const uint mcuRow) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() { return cancelled || transformed[mcuRow]; });
+        return !cancelled;
+    }
+};
+
+// buffers shared by all the scans of one image
+//   nonzero holds, for each component of each block of a progressive image,
+//   a mask of the AC coefficients that are nonzero so far, by zigzag position
+//   scans are deferred when a progressive image is decoded with more than one thread
+//   progress, if set, is told of each MCU row of a baseline scan as it is decoded
+struct ScanBuffers {
+    EntropySegment segment;
+    std::vector<std::uint64_t> nonzero;
+    bool deferred = false;
+    std::vector<DeferredScan> scans;
+
+    // the tables deferred scans are decoded with, each taken when a scan first reads it,
+    //   and the latest snapshot of each DC and AC table, which later scans share while it is unchanged
+    std::deque<HuffmanSnapshot> tables;
+    uint latestDCTables[4] = { noHuffmanSnapshot, noHuffmanSnapshot, noHuffmanSnapshot, noHuffmanSnapshot };
+    uint latestACTables[4] = { noHuffmanSnapshot, noHuffmanSnapshot, noHuffmanSnapshot, noHuffmanSnapshot };
+    DecodeProgress* progress = nullptr;
+};
+
+// helper class to read bytes from a JPG held in memory
+class BitReader {
+private:
+    const byte* const data;
+    const std::size_t size;
+    std::size_t position = 0;
+    bool failed = false;
+
+    // read one byte, or return EOF and fail past the end of the data
+    int get() {
+        if (position >= size) {
+            failed = true;
+            return EOF;
+        }
+        return data[position++];
+    }
+
+    // return the position of the next 0xFF at or after from, or size if there is none
+    //   entropy-coded data is searched 16 bytes at a time where SSE2 is available
+    std::size_t findFF(std::size_t from) const {
+#if defined(__SSE2__)
+        const __m128i ff = _mm_set1_epi8((char)0xFF);
+        for (; from + 16 <= size; from += 16) {
+            const __m128i bytes = _mm_loadu_si128((const __m128i*)(data + from));
+            int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, ff));
+            if (mask != 0) {
+                while ((mask & 1) == 0) {
+                    mask >>= 1;
+                    from += 1;
+                }
+                return from;
+            }
+        }
+#endif
+        while (from < size && data[from] != 0xFF) {
+            from += 1;
+        }
+        return from;
     }
 
-    ~BitReader() {
-        if (inFile.is_open()) {
-            inFile.close();
+    // on a 0xFF, skip any more 0xFF's in a row and return the byte after them,
+    //   leaving the position on the last 0xFF
+    //   return EOF and fail if the data ends first
+    int skipFillBytes() {
+        while (position + 1 < size && data[position + 1] == 0xFF) {
+            position += 1;
+        }
+        if (position + 1 >= size) {
+            position = size;
+            failed = true;
+            return EOF;
         }
+        return data[position + 1];
+    }
+
+public:
+    BitReader(const byte* const d, const std::size_t n) :
+    data(d),
+    size(n)
+    {}
+
+    // a reader of only the bytes in [begin, end), to read them again later
+    BitReader range(const std::size_t begin, const std::size_t end) const {
+        return BitReader(data + begin, end - begin);
+    }
+
+    std::size_t getPosition() const {
+        return position;
     }
 
     bool hasBits() {
-        return !!inFile;
+        return !failed;
     }
 
     byte readByte() {
-        nextBit = 0;
-        return inFile.get();
+        return get();
     }
 
     uint readWord() {
-        nextBit = 0;
-        return (inFile.get() << 8) + inFile.get();
+        return (get() << 8) + get();
     }
 
-    // read one bit (0 or 1) or return -1 if all bits have already been read
-    uint readBit() {
-        if (nextBit == 0) {
-            if (!hasBits()) {
-                return -1;
-            }
-            nextByte = inFile.get();
-            while (nextByte == 0xFF) {
-                byte marker = inFile.peek();
-                // ignore multiple 0xFF's in a row
-                while (marker == 0xFF) {
-                    inFile.get();
-                    marker = inFile.peek();
-                }
-                // literal 0xFF's are encoded in the bitstream as 0xFF00
-                if (marker == 0x00) {
-                    inFile.get();
-                    break;
-                }
-                // restart marker
-                else if (marker >= RST0 && marker <= RST7) {
-                    inFile.get();
-                    nextByte = inFile.get();
-                }
-                else {
-                    std::cout << "Error - Invalid marker: 0x" << std::hex << (uint)marker << std::dec << '\n';
-                    return -1;
-                }
+    // skip over bytes without reading them, failing past the end of the data
+    void skipBytes(const uint length) {
+        if (length > size - position) {
+            position = size;
+            failed = true;
+            return;
+        }
+        position += length;
+    }
+
+    // copy the entropy-coded data of a whole scan into segment,
+    //   removing the byte stuffing of literal 0xFF's and recording where each
+    //   restart interval starts, so it can be decoded without checking for markers
+    //   stops just before the marker that ends the scan
+    void readEntropySegment(EntropySegment& segment) {
+        segment.data.clear();
+        segment.restarts.assign(1, 0);
+        while (true) {
+            const std::size_t end = findFF(position);
+            segment.data.insert(segment.data.end(), data + position, data + end);
+            position = end;
+
+            const int marker = skipFillBytes();
+            // literal 0xFF's are encoded in the bitstream as 0xFF00
+            if (marker == 0x00) {
+                segment.data.push_back(0xFF);
+                position += 2;
+            }
+            else if (marker >= RST0 && marker <= RST7) {
+                segment.restarts.push_back(segment.data.size());
+                position += 2;
+            }
+            else {
+                return;
+            }
+        }
+    }
+
+    // skip the entropy-coded data of a whole scan without decoding or copying it
+    //   stops just before the marker that ends the scan
+    void skipScan() {
+        while (true) {
+            position = findFF(position);
+            const int marker = skipFillBytes();
+            if (marker == 0x00 || (marker >= RST0 && marker <= RST7)) {
+                position += 2;
+            }
+            else {
+                return;
+            }
+        }
+    }
+};
+
+// helper class to read bits from the entropy-coded data of a scan
+//   the data holds no markers, so bits are buffered 64 at a time
+//   and never checked for 0xFF's
+class EntropyReader {
+private:
+    const EntropySegment& segment;
+    std::size_t position = 0;
+    std::size_t nextInterval = 0;
+
+    // bits not yet read, first bit in the most significant bit
+    std::uint64_t buffer = 0;
+    uint bufferedBits = 0;
+    // zero bits buffered from past the end of the data, never read
+    uint paddingBits = 0;
+
+    void fill() {
+        while (bufferedBits <= 56) {
+            byte next = 0;
+            if (position < segment.data.size()) {
+                next = segment.data[position++];
             }
+            else {
+                paddingBits += 8;
+            }
+            buffer |= (std::uint64_t)next << (56 - bufferedBits);
+            bufferedBits += 8;
+        }
+    }
+
+public:
+    explicit EntropyReader(const EntropySegment& s) :
+    segment(s)
+    {}
+
+    // return the next bits without reading them, at most 16
+    //   bits past the end of the data are 0
+    uint peekBits(const uint length) {
+        if (bufferedBits < length) {
+            fill();
+        }
+        return (uint)(buffer >> (64 - length));
+    }
+
+    // read bits that were peeked at, or return false if the data ends first
+    bool skipBits(const uint length) {
+        if (bufferedBits < length) {
+            fill();
+        }
+        if (bufferedBits - paddingBits < length) {
+            return false;
         }
-        uint bit = (nextByte >> (7 - nextBit)) & 1;
-        nextBit = (nextBit + 1) % 8;
-        return bit;
+        buffer <<= length;
+        bufferedBits -= length;
+        return true;
     }
 
-    // read a variable number of bits
+    // read a variable number of bits, at most 16
     // first read bit is most significant bit
-    // return -1 if at any point all bits have already been read
+    // return -1 if the data ends first
     uint readBits(const uint length) {
-        uint bits = 0;
-        for (uint i = 0; i < length; ++i) {
-            uint bit = readBit();
-            if (bit == -1) {
-                bits = -1;
-                break;
-            }
-            bits = (bits << 1) | bit;
+        if (length == 0) {
+            return 0;
         }
-        return bits;
+        const uint bits = peekBits(length);
+        return skipBits(length) ? bits : -1;
+    }
+
+    // read one bit (0 or 1) or return -1 if all bits have already been read
+    uint readBit() {
+        return readBits(1);
+    }
+
+    // bits read so far, counted from the start of the data
+    std::size_t bitPosition() const {
+        return position * 8 + paddingBits - bufferedBits;
     }
 
-    // advance to the 0th bit of the next byte
-    void align() {
-        nextBit = 0;
+    // move to any bit of the data, dropping the bits buffered so far
+    //   without restart markers, this is the only way to start decoding part way through a scan
+    void seek(const std::size_t bit) {
+        position = bit / 8;
+        buffer = 0;
+        bufferedBits = 0;
+        paddingBits = 0;
+        fill();
+        buffer <<= bit % 8;
+        bufferedBits -= bit % 8;
+    }
+
+    // move to the start of the next restart interval, dropping any bits left in this one
+    //   intervals that are never read are skipped over at no cost
+    void restart() {
+        if (nextInterval < segment.restarts.size()) {
+            position = segment.restarts[nextInterval++];
+            buffer = 0;
+            bufferedBits = 0;
+            paddingBits = 0;
+            return;
+        }
+        // no RSTN marker started this interval, so it starts at the next byte
+        const uint partialBits = bufferedBits % 8;
+        buffer <<= partialBits;
+        bufferedBits -= partialBits;
     }
 };
 
 // SOF specifies frame type, dimensions, and number of color components
 void readStartOfFrame(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading SOF Marker\n";
+    if (image->verbose) {
+        std::cout << "Reading SOF Marker\n";
+    }
     if (image->numComponents != 0) {
         std::cout << "Error - Multiple SOFs detected\n";
         image->valid = false;
@@ -200,7 +498,9 @@ void readStartOfFrame(BitReader& bitReader, JPGImage* const image) {
 
 // DQT contains one or more quantization tables
 void readQuantizationTable(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading DQT Marker\n";
+    if (image->verbose) {
+        std::cout << "Reading DQT Marker\n";
+    }
     int length = bitReader.readWord();
     length -= 2;
 
@@ -251,8 +551,42 @@ void generateCodes(HuffmanTable& hTable) {
 }
 
 // DHT contains one or more Huffman tables
+// fill the lookup of a Huffman table for every value of the next huffmanLookupBits bits
+//   the magnitude bits after a code are looked up too when they fit,
+//   except after the AC symbols that code runs of zeroes rather than a coefficient
+void buildHuffmanLookup(const HuffmanTable& hTable, const bool acTable, HuffmanLookup& lookup) {
+    std::fill(lookup.entries, lookup.entries + (1 << huffmanLookupBits), HuffmanLookupEntry());
+    for (uint i = 0; i < huffmanLookupBits; ++i) {
+        const uint codeLength = i + 1;
+        const uint freeBits = huffmanLookupBits - codeLength;
+        for (uint j = hTable.offsets[i]; j < hTable.offsets[i + 1]; ++j) {
+            if (hTable.codes[j] >= (1u << codeLength)) {
+                continue;
+            }
+            const byte symbol = hTable.symbols[j];
+            const uint coeffLength = acTable ? (symbol & 0x0F) : symbol;
+            const bool coefficient = acTable ? (coeffLength != 0 && coeffLength <= 10) : (coeffLength <= 11);
+            for (uint k = 0; k < (1u << freeBits); ++k) {
+                HuffmanLookupEntry& entry = lookup.entries[(hTable.codes[j] << freeBits) | k];
+                entry.symbol = symbol;
+                entry.codeLength = codeLength;
+                if (coefficient && coeffLength <= freeBits) {
+                    int coeff = (coeffLength == 0) ? 0 : k >> (freeBits - coeffLength);
+                    if (coeffLength != 0 && coeff < (1 << (coeffLength - 1))) {
+                        coeff -= (1 << coeffLength) - 1;
+                    }
+                    entry.value = coeff;
+                    entry.totalLength = codeLength + coeffLength;
+                }
+            }
+        }
+    }
+}
+
 void readHuffmanTable(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading DHT Marker\n";
+    if (image->verbose) {
+        std::cout << "Reading DHT Marker\n";
+    }
     int length = bitReader.readWord();
     length -= 2;
 
@@ -289,6 +623,9 @@ void readHuffmanTable(BitReader& bitReader, JPGImage* const image) {
         }
 
         generateCodes(hTable);
+        buildHuffmanLookup(hTable, acTable, (acTable) ?
+            (image->huffmanACLookups[tableID]) :
+            (image->huffmanDCLookups[tableID]));
 
         length -= 17 + allSymbols;
     }
@@ -302,7 +639,9 @@ void readHuffmanTable(BitReader& bitReader, JPGImage* const image) {
 
 // SOS contains color component info for the next scan
 void readStartOfScan(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading SOS Marker\n";
+    if (image->verbose) {
+        std::cout << "Reading SOS Marker\n";
+    }
     if (image->numComponents == 0) {
         std::cout << "Error - SOS detected before SOF\n";
         image->valid = false;
@@ -310,6 +649,7 @@ void readStartOfScan(BitReader& bitReader, JPGImage* const image) {
     }
 
     uint length = bitReader.readWord();
+    image->numScans += 1;
 
     for (uint i = 0; i < image->numComponents; ++i) {
         image->colorComponents[i].usedInScan = false;
@@ -444,7 +784,9 @@ void readStartOfScan(BitReader& bitReader, JPGImage* const image) {
 
 // restart interval is needed to stay synchronized during data scans
 void readRestartInterval(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading DRI Marker\n";
+    if (image->verbose) {
+        std::cout << "Reading DRI Marker\n";
+    }
     uint length = bitReader.readWord();
 
     image->restartInterval = bitReader.readWord();
@@ -457,7 +799,9 @@ void readRestartInterval(BitReader& bitReader, JPGImage* const image) {
 
 // APPNs simply get skipped based on length
 void readAPPN(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading APPN Marker\n";
+    if (image->verbose) {
+        std::cout << "Reading APPN Marker\n";
+    }
     uint length = bitReader.readWord();
     if (length < 2) {
         std::cout << "Error - APPN invalid\n";
@@ -472,7 +816,9 @@ void readAPPN(BitReader& bitReader, JPGImage* const image) {
 
 // comments simply get skipped based on length
 void readComment(BitReader& bitReader, JPGImage* const image) {
-    std::cout << "Reading COM Marker\n";
+    if (image->verbose) {
+        std::cout << "Reading COM Marker\n";
+    }
     uint length = bitReader.readWord();
     if (length < 2) {
         std::cout << "Error - COM invalid\n";
@@ -487,7 +833,7 @@ void readComment(BitReader& bitReader, JPGImage* const image) {
 
 // print all info extracted from the JPG file
 void printFrameInfo(const JPGImage* const image) {
-    if (image == nullptr) return;
+    if (image == nullptr || !image->verbose) return;
     std::cout << "SOF=============\n";
     std::cout << "Frame Type: 0x" << std::hex << (uint)image->frameType << std::dec << '\n';
     std::cout << "Height: " << image->height << '\n';
@@ -519,7 +865,7 @@ void printFrameInfo(const JPGImage* const image) {
 
 // print info for the next scan  (progressive only)
 void printScanInfo(const JPGImage* const image) {
-    if (image == nullptr) return;
+    if (image == nullptr || !image->verbose) return;
     std::cout << "SOS=============\n";
     std::cout << "Start of Selection: " << (uint)image->startOfSelection << '\n';
     std::cout << "End of Selection: " << (uint)image->endOfSelection << '\n';
@@ -669,13 +1015,198 @@ void readFrameHeader(BitReader& bitReader, JPGImage* const image) {
     }
 }
 
-void decodeHuffmanData(BitReader& bitReader, JPGImage* const image);
+void decodeHuffmanData(BitReader& bitReader, JPGImage* const image, EntropySegment& segment,
+                       std::uint64_t* const nonzero, DecodeProgress* const progress);
+void decodeDeferredScan(BitReader& bitReader, JPGImage* const image, const DeferredScan& scan,
+                        const std::deque<HuffmanSnapshot>& tables, EntropySegment& segment,
+                        std::uint64_t* const nonzero);
+uint countScans(BitReader& bitReader, JPGImage* const image, bool* const complete = nullptr);
+
+// check whether a progressive scan has to be decoded after an earlier one
+//   scans depend on each other where they share a component and a band of coefficients,
+//   refinements of a band after its first scan and after each other
+//   AC scans of a component also share the nonzero masks of its blocks
+bool scanDependsOn(const DeferredScan& scan, const DeferredScan& earlier) {
+    for (uint i = 0; i < 3; ++i) {
+        if (!scan.usedInScan[i] || !earlier.usedInScan[i]) {
+            continue;
+        }
+        if (scan.startOfSelection <= earlier.endOfSelection && earlier.startOfSelection <= scan.endOfSelection) {
+            return true;
+        }
+        if (scan.startOfSelection != 0 && earlier.startOfSelection != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the snapshot of a Huffman table as it is now, taking a new one only if the table has changed
+//   since the latest
+uint snapshotHuffmanTable(const HuffmanTable& table, const HuffmanLookup& lookup, uint& latest,
+                          std::deque<HuffmanSnapshot>& tables) {
+    if (latest != noHuffmanSnapshot &&
+        std::equal(table.offsets, table.offsets + 17, tables[latest].table.offsets) &&
+        std::equal(table.symbols, table.symbols + 176, tables[latest].table.symbols)) {
+        return latest;
+    }
+    tables.emplace_back();
+    tables.back().table = table;
+    tables.back().lookup = lookup;
+    latest = tables.size() - 1;
+    return latest;
+}
+
+// record the header of the scan just started, the tables it reads and the scans it depends on,
+//   and skip its entropy-coded data
+void deferScan(BitReader& bitReader, JPGImage* const image, ScanBuffers& buffers) {
+    std::vector<DeferredScan>& scans = buffers.scans;
+    const uint index = scans.size();
+    scans.emplace_back();
+    DeferredScan& scan = scans.back();
+    scan.componentsInScan = image->componentsInScan;
+    scan.startOfSelection = image->startOfSelection;
+    scan.endOfSelection = image->endOfSelection;
+    scan.successiveApproximationHigh = image->successiveApproximationHigh;
+    scan.successiveApproximationLow = image->successiveApproximationLow;
+    scan.restartInterval = image->restartInterval;
+
+    // DC first scans only read DC tables, AC scans only AC tables, and DC refinements neither
+    const bool readsDC = image->startOfSelection == 0 && image->successiveApproximationHigh == 0;
+    const bool readsAC = image->startOfSelection != 0;
+    for (uint i = 0; i < image->numComponents; ++i) {
+        const ColorComponent& component = image->colorComponents[i];
+        scan.usedInScan[i] = component.usedInScan;
+        if (!component.usedInScan) {
+            continue;
+        }
+        if (readsDC) {
+            const byte id = component.huffmanDCTableID;
+            scan.dcTables[i] = snapshotHuffmanTable(image->huffmanDCTables[id], image->huffmanDCLookups[id],
+                                                    buffers.latestDCTables[id], buffers.tables);
+        }
+        if (readsAC) {
+            const byte id = component.huffmanACTableID;
+            scan.acTables[i] = snapshotHuffmanTable(image->huffmanACTables[id], image->huffmanACLookups[id],
+                                                    buffers.latestACTables[id], buffers.tables);
+        }
+    }
+
+    scan.begin = bitReader.getPosition();
+    bitReader.skipScan();
+    scan.end = bitReader.getPosition();
+
+    for (uint i = 0; i < index; ++i) {
+        if (scanDependsOn(scan, scans[i])) {
+            scans[i].dependents.push_back(index);
+            scan.dependencies += 1;
+        }
+    }
+}
+
+// decode the Huffman data of the scan just started, or defer it
+//   scans without luminance are skipped when only luminance is wanted
+void decodeScan(BitReader& bitReader, JPGImage* const image, ScanBuffers& buffers) {
+    if (image->lumaOnly && !image->colorComponents[0].usedInScan) {
+        if (image->verbose) {
+            std::cout << "Skipping scan without luminance\n";
+        }
+        bitReader.skipScan();
+        return;
+    }
+    if (buffers.deferred) {
+        deferScan(bitReader, image, buffers);
+        return;
+    }
+    decodeHuffmanData(bitReader, image, buffers.segment, buffers.nonzero.data(), buffers.progress);
+}
+
+// decode the deferred scans of an image on up to image->threads threads
+//   a scan is ready once every scan it depends on has been decoded,
+//   and ready scans are taken in the order they appear in the JPG
+//   each thread removes the byte stuffing of its scans into its own buffer
+//   once a scan turns out invalid, no more are taken and the image is invalid
+void decodeDeferredScans(const BitReader& bitReader, JPGImage* const image, ScanBuffers& buffers) {
+    std::vector<DeferredScan>& scans = buffers.scans;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<uint> ready;
+    uint remaining = scans.size();
+    bool failed = false;
+    for (uint i = 0; i < scans.size(); ++i) {
+        if (scans[i].dependencies == 0) {
+            ready.push_back(i);
+        }
+    }
+
+    auto work = [&]() {
+        EntropySegment segment;
+        // each thread puts the header of each of its scans in turn into its own copy of the image
+        JPGImage scanImage = *image;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            changed.wait(lock, [&]() { return failed || !ready.empty() || remaining == 0; });
+            if (failed || ready.empty()) {
+                return;
+            }
+            const auto next = std::min_element(ready.begin(), ready.end());
+            DeferredScan& scan = scans[*next];
+            ready.erase(next);
+            lock.unlock();
+
+            BitReader scanReader = bitReader.range(scan.begin, scan.end);
+            decodeDeferredScan(scanReader, &scanImage, scan, buffers.tables, segment, buffers.nonzero.data());
+
+            lock.lock();
+            if (!scanImage.valid) {
+                failed = true;
+                changed.notify_all();
+                return;
+            }
+            remaining -= 1;
+            for (const uint dependent : scan.dependents) {
+                scans[dependent].dependencies -= 1;
+                if (scans[dependent].dependencies == 0) {
+                    ready.push_back(dependent);
+                }
+            }
+            changed.notify_all();
+        }
+    };
+
+    // the calling thread works too, and can decode every scan alone
+    //   if no helper starts
+    Helpers helpers(image->scheduler);
+    helpers.start(std::min<std::size_t>(image->threads, scans.size()) - 1, work);
+    work();
+    helpers.wait();
+    if (failed) {
+        image->valid = false;
+    }
+}
+
+// read and decode the scans of a JPG whose first SOS marker has just been read
+//   progress, if set, is told of each MCU row of a baseline scan as it is decoded
+void readScans(BitReader& bitReader, JPGImage* const image, DecodeProgress* const progress) {
+    // the entropy-coded data of each scan reuses one buffer
+    ScanBuffers buffers;
+    buffers.progress = progress;
+    if (image->frameType == SOF2) {
+        buffers.nonzero.assign(image->blockHeightReal * image->blockWidthReal * 3, 0);
+
+        // with more than one thread, every scan is read before any is decoded,
+        //   unless the JPG ends before its EOI marker, so its scans fail just as they do on one thread
+        if (image->threads > 1) {
+            BitReader scanCounter = bitReader;
+            bool complete = false;
+            buffers.deferred = countScans(scanCounter, image, &complete) <= maxDeferredScans && complete;
+        }
+    }
 
-void readScans(BitReader& bitReader, JPGImage* const image) {
     // decode first scan
     readStartOfScan(bitReader, image);
     printScanInfo(image);
-    decodeHuffmanData(bitReader, image);
+    decodeScan(bitReader, image, buffers);
 
     byte last = bitReader.readByte();
     byte current = bitReader.readByte();
@@ -705,7 +1236,7 @@ void readScans(BitReader& bitReader, JPGImage* const image) {
         else if (current == SOS && image->frameType == SOF2) {
             readStartOfScan(bitReader, image);
             printScanInfo(image);
-            decodeHuffmanData(bitReader, image);
+            decodeScan(bitReader, image, buffers);
         }
         // new restart interval (progressive only)
         else if (current == DRI && image->frameType == SOF2) {
@@ -728,48 +1259,154 @@ void readScans(BitReader& bitReader, JPGImage* const image) {
         last = bitReader.readByte();
         current = bitReader.readByte();
     }
+
+    if (image->valid && buffers.deferred) {
+        decodeDeferredScans(bitReader, image, buffers);
+    }
 }
 
-JPGImage* readJPG(const std::string& filename) {
-    // open file
-    std::cout << "Reading " << filename << "...\n";
-    BitReader bitReader(filename);
-    if (!bitReader.hasBits()) {
-        std::cout << "Error - Error opening input file\n";
-        return nullptr;
+// number of components that are dequantized, transformed and output
+uint decodedComponents(const JPGImage* const image) {
+    return image->lumaOnly ? 1 : image->numComponents;
+}
+
+// clamp the crop region to the image and find the MCU-aligned blocks covering it
+void setCropRegion(JPGImage* const image, const Region& crop) {
+    image->crop.x = crop.x;
+    image->crop.y = crop.y;
+    image->crop.width = (crop.width == 0) ? image->width : crop.width;
+    image->crop.height = (crop.height == 0) ? image->height : crop.height;
+    if (image->crop.x >= image->width || image->crop.y >= image->height) {
+        std::cout << "Error - Crop region outside of image\n";
+        image->valid = false;
+        return;
+    }
+    image->crop.width = std::min(image->crop.width, image->width - image->crop.x);
+    image->crop.height = std::min(image->crop.height, image->height - image->crop.y);
+
+    const uint mcuHeight = image->verticalSamplingFactor;
+    const uint mcuWidth = image->horizontalSamplingFactor;
+    image->cropBlockTop = image->crop.y / 8 / mcuHeight * mcuHeight;
+    image->cropBlockLeft = image->crop.x / 8 / mcuWidth * mcuWidth;
+    image->cropBlockBottom = ((image->crop.y + image->crop.height + 7) / 8 + mcuHeight - 1) / mcuHeight * mcuHeight;
+    image->cropBlockRight = ((image->crop.x + image->crop.width + 7) / 8 + mcuWidth - 1) / mcuWidth * mcuWidth;
+
+    // fancy upsampling blends in chroma from the neighbouring MCUs
+    if (image->upsampling == UPSAMPLE_FANCY && decodedComponents(image) == 3) {
+        if (mcuHeight == 2) {
+            image->cropBlockTop -= std::min(image->cropBlockTop, mcuHeight);
+            image->cropBlockBottom = std::min(image->cropBlockBottom + mcuHeight, image->blockHeightReal);
+        }
+        if (mcuWidth == 2) {
+            image->cropBlockLeft -= std::min(image->cropBlockLeft, mcuWidth);
+            image->cropBlockRight = std::min(image->cropBlockRight + mcuWidth, image->blockWidthReal);
+        }
     }
+}
 
-    JPGImage* image = new (std::nothrow) JPGImage;
-    if (image == nullptr) {
-        std::cout << "Error - Memory error\n";
-        return nullptr;
+// read the frame header of a JPG and apply the decoding options
+bool readHeader(BitReader& bitReader, JPGImage* const image, const DecodeOptions& options) {
+    if (!bitReader.hasBits()) {
+        std::cout << "Error - Empty input\n";
+        image->valid = false;
+        return false;
     }
 
+    image->verbose = options.verbose;
     readFrameHeader(bitReader, image);
     printFrameInfo(image);
 
     if (!image->valid) {
-        return image;
+        return false;
+    }
+
+    image->dctMethod = options.dctMethod;
+    image->scale = options.scale;
+    image->upsampling = options.upsampling;
+    image->lumaOnly = options.lumaOnly;
+    image->scheduler = options.scheduler;
+    image->threads = options.threads;
+    if (image->threads == 0) {
+        image->threads = (options.scheduler != nullptr) ? std::max(options.scheduler->size(), 1u) :
+                                                          std::max(std::thread::hardware_concurrency(), 1u);
     }
+    setCropRegion(image, options.crop);
+    return image->valid;
+}
 
-    image->blocks = new (std::nothrow) Block[image->blockHeightReal * image->blockWidthReal];
+// read the scans of a JPG whose header has been read into blocks taken from the buffer
+bool readBlocks(BitReader& bitReader, JPGImage* const image, BlockBuffer& buffer) {
+    image->blocks = buffer.get(image->blockHeightReal * image->blockWidthReal);
     if (image->blocks == nullptr) {
         std::cout << "Error - Memory error\n";
         image->valid = false;
-        return image;
+        return false;
     }
 
-    readScans(bitReader, image);
+    readScans(bitReader, image, nullptr);
+
+    return image->valid;
+}
+
+// count the scans of a JPG whose first SOS marker has just been read
+//   the entropy-coded data of progressive scans is searched for the markers
+//   between them, but never decoded
+//   complete, if set, is whether the markers run on to an EOI marker
+uint countScans(BitReader& bitReader, JPGImage* const image, bool* const complete) {
+    if (image->frameType != SOF2) {
+        return 1;
+    }
 
-    return image;
+    uint numScans = 0;
+    byte last = 0xFF;
+    byte current = SOS;
+    while (bitReader.hasBits() && last == 0xFF && current != EOI) {
+        if (current == SOS) {
+            numScans += 1;
+            const uint length = bitReader.readWord();
+            bitReader.skipBytes(std::max(length, 2u) - 2);
+            bitReader.skipScan();
+        }
+        // ignore multiple 0xFF's in a row
+        else if (current == 0xFF) {
+            current = bitReader.readByte();
+            continue;
+        }
+        // tables and restart intervals between scans
+        else if (current < RST0 || current > RST7) {
+            const uint length = bitReader.readWord();
+            bitReader.skipBytes(std::max(length, 2u) - 2);
+        }
+        last = bitReader.readByte();
+        current = bitReader.readByte();
+    }
+    if (complete != nullptr) {
+        *complete = bitReader.hasBits() && last == 0xFF && current == EOI;
+    }
+    return numScans;
 }
 
+// a color component of the scan just started, with its Huffman tables
+struct ScanComponent {
+    uint index = 0;
+    const HuffmanTable* dcTable = nullptr;
+    const HuffmanTable* acTable = nullptr;
+    const HuffmanLookup* dcLookup = nullptr;
+    const HuffmanLookup* acLookup = nullptr;
+};
+
 // return the symbol from the Huffman table that corresponds to
-//   the next Huffman code read from the BitReader
-byte getNextSymbol(BitReader& bitReader, const HuffmanTable& hTable) {
+//   the next Huffman code read from the EntropyReader
+//   codes up to huffmanLookupBits long are found with one lookup
+byte getNextSymbol(EntropyReader& reader, const HuffmanTable& hTable, const HuffmanLookup& lookup) {
+    const HuffmanLookupEntry& entry = lookup.entries[reader.peekBits(huffmanLookupBits)];
+    if (entry.codeLength != 0) {
+        return reader.skipBits(entry.codeLength) ? entry.symbol : -1;
+    }
+
     uint currentCode = 0;
     for (uint i = 0; i < 16; ++i) {
-        int bit = bitReader.readBit();
+        int bit = reader.readBit();
         if (bit == -1) {
             return -1;
         }
@@ -783,69 +1420,238 @@ byte getNextSymbol(BitReader& bitReader, const HuffmanTable& hTable) {
     return -1;
 }
 
+// the kinds of scan, each with its own way of coding a block component
+enum ScanKind {
+    SCAN_BASELINE,      // all 64 coefficients at once
+    SCAN_DC_FIRST,      // progressive, high bits of the DC coefficient
+    SCAN_DC_REFINEMENT, // progressive, one more bit of the DC coefficient
+    SCAN_AC_FIRST,      // progressive, high bits of a band of AC coefficients
+    SCAN_AC_REFINEMENT  // progressive, one more bit of a band of AC coefficients
+};
+
+// find the kind of the scan just started
+ScanKind scanKind(const JPGImage* const image) {
+    if (image->frameType == SOF0) {
+        return SCAN_BASELINE;
+    }
+    if (image->startOfSelection == 0) {
+        return (image->successiveApproximationHigh == 0) ? SCAN_DC_FIRST : SCAN_DC_REFINEMENT;
+    }
+    return (image->successiveApproximationHigh == 0) ? SCAN_AC_FIRST : SCAN_AC_REFINEMENT;
+}
+
+// read the difference of a DC coefficient from the previous block component
+//   short codes are read together with their magnitude bits in one lookup
+bool decodeDCDifference(EntropyReader& reader, const ScanComponent& tables, int& difference) {
+    const HuffmanLookupEntry& entry = tables.dcLookup->entries[reader.peekBits(huffmanLookupBits)];
+    if (entry.totalLength != 0 && reader.skipBits(entry.totalLength)) {
+        difference = entry.value;
+        return true;
+    }
+
+    byte length = getNextSymbol(reader, *tables.dcTable, *tables.dcLookup);
+    if (length == (byte)-1) {
+        std::cout << "Error - Invalid DC value\n";
+        return false;
+    }
+    if (length > 11) {
+        std::cout << "Error - DC coefficient length greater than 11\n";
+        return false;
+    }
+
+    int coeff = reader.readBits(length);
+    if (coeff == -1) {
+        std::cout << "Error - Invalid DC value\n";
+        return false;
+    }
+    if (length != 0 && coeff < (1 << (length - 1))) {
+        coeff -= (1 << length) - 1;
+    }
+    difference = coeff;
+    return true;
+}
+
 // fill the coefficients of a block component based on Huffman codes
-//   read from the BitReader
+//   read from the EntropyReader
+//   specialized for each kind of scan, so no block checks what kind it is in
+//   progressive AC scans keep a mask of the coefficients already nonzero, by zigzag position,
+//   so refinement scans can jump between them instead of checking every coefficient
+template <ScanKind kind>
 bool decodeBlockComponent(
     const JPGImage* const image,
-    BitReader& bitReader,
+    EntropyReader& reader,
     int* const component,
+    std::uint64_t* const nonzero,
     int& previousDC,
     uint& skips,
-    const HuffmanTable& dcTable,
-    const HuffmanTable& acTable
+    const ScanComponent& tables
+);
+
+template <>
+bool decodeBlockComponent<SCAN_BASELINE>(
+    const JPGImage* const,
+    EntropyReader& reader,
+    int* const component,
+    std::uint64_t* const,
+    int& previousDC,
+    uint&,
+    const ScanComponent& tables
 ) {
-    if (image->frameType == SOF0) {
-        // get the DC value for this block component
-        byte length = getNextSymbol(bitReader, dcTable);
-        if (length == (byte)-1) {
-            std::cout << "Error - Invalid DC value\n";
+    // get the DC value for this block component
+    int coeff = 0;
+    if (!decodeDCDifference(reader, tables, coeff)) {
+        return false;
+    }
+    component[0] = coeff + previousDC;
+    previousDC = component[0];
+
+    // get the AC values for this block component
+    for (uint i = 1; i < 64; ++i) {
+        // short codes are read together with the coefficient that follows them
+        const HuffmanLookupEntry& entry = tables.acLookup->entries[reader.peekBits(huffmanLookupBits)];
+        if (entry.totalLength != 0 && reader.skipBits(entry.totalLength)) {
+            const uint numZeroes = entry.symbol >> 4;
+            if (i + numZeroes >= 64) {
+                std::cout << "Error - Zero run-length exceeded block component\n";
+                return false;
+            }
+            i += numZeroes;
+            component[i] = entry.value;
+            continue;
+        }
+
+        byte symbol = getNextSymbol(reader, *tables.acTable, *tables.acLookup);
+        if (symbol == (byte)-1) {
+            std::cout << "Error - Invalid AC value\n";
             return false;
         }
-        if (length > 11) {
-            std::cout << "Error - DC coefficient length greater than 11\n";
+
+        // symbol 0x00 means fill remainder of component with 0
+        if (symbol == 0x00) {
+            return true;
+        }
+
+        // otherwise, read next component coefficient
+        byte numZeroes = symbol >> 4;
+        byte coeffLength = symbol & 0x0F;
+        coeff = 0;
+
+        if (i + numZeroes >= 64) {
+            std::cout << "Error - Zero run-length exceeded block component\n";
             return false;
         }
+        i += numZeroes;
 
-        int coeff = bitReader.readBits(length);
+        if (coeffLength > 10) {
+            std::cout << "Error - AC coefficient length greater than 10\n";
+            return false;
+        }
+        coeff = reader.readBits(coeffLength);
         if (coeff == -1) {
-            std::cout << "Error - Invalid DC value\n";
+            std::cout << "Error - Invalid AC value\n";
             return false;
         }
-        if (length != 0 && coeff < (1 << (length - 1))) {
-            coeff -= (1 << length) - 1;
+        if (coeff < (1 << (coeffLength - 1))) {
+            coeff -= (1 << coeffLength) - 1;
         }
-        component[0] = coeff + previousDC;
-        previousDC = component[0];
+        component[i] = coeff;
+    }
+    return true;
+}
 
-        // get the AC values for this block component
-        for (uint i = 1; i < 64; ++i) {
-            byte symbol = getNextSymbol(bitReader, acTable);
-            if (symbol == (byte)-1) {
-                std::cout << "Error - Invalid AC value\n";
+template <>
+bool decodeBlockComponent<SCAN_DC_FIRST>(
+    const JPGImage* const image,
+    EntropyReader& reader,
+    int* const component,
+    std::uint64_t* const,
+    int& previousDC,
+    uint&,
+    const ScanComponent& tables
+) {
+    int coeff = 0;
+    if (!decodeDCDifference(reader, tables, coeff)) {
+        return false;
+    }
+    coeff += previousDC;
+    previousDC = coeff;
+    component[0] = coeff << image->successiveApproximationLow;
+    return true;
+}
+
+template <>
+bool decodeBlockComponent<SCAN_DC_REFINEMENT>(
+    const JPGImage* const image,
+    EntropyReader& reader,
+    int* const component,
+    std::uint64_t* const,
+    int&,
+    uint&,
+    const ScanComponent&
+) {
+    int bit = reader.readBit();
+    if (bit == -1) {
+        std::cout << "Error - Invalid DC value\n";
+        return false;
+    }
+    component[0] |= bit << image->successiveApproximationLow;
+    return true;
+}
+
+template <>
+bool decodeBlockComponent<SCAN_AC_FIRST>(
+    const JPGImage* const image,
+    EntropyReader& reader,
+    int* const component,
+    std::uint64_t* const nonzero,
+    int&,
+    uint& skips,
+    const ScanComponent& tables
+) {
+    if (skips > 0) {
+        skips -= 1;
+        return true;
+    }
+    for (uint i = image->startOfSelection; i <= image->endOfSelection; ++i) {
+        // short codes are read together with the coefficient that follows them
+        const HuffmanLookupEntry& entry = tables.acLookup->entries[reader.peekBits(huffmanLookupBits)];
+        if (entry.totalLength != 0 && reader.skipBits(entry.totalLength)) {
+            const uint numZeroes = entry.symbol >> 4;
+            if (i + numZeroes > image->endOfSelection) {
+                std::cout << "Error - Zero run-length exceeded spectral selection\n";
                 return false;
             }
-
-            // symbol 0x00 means fill remainder of component with 0
-            if (symbol == 0x00) {
-                return true;
+            for (uint j = 0; j < numZeroes; ++j, ++i) {
+                component[i] = 0;
             }
+            component[i] = entry.value << image->successiveApproximationLow;
+            *nonzero |= 1ull << i;
+            continue;
+        }
 
-            // otherwise, read next component coefficient
-            byte numZeroes = symbol >> 4;
-            byte coeffLength = symbol & 0x0F;
-            coeff = 0;
-
-            if (i + numZeroes >= 64) {
-                std::cout << "Error - Zero run-length exceeded block component\n";
+        byte symbol = getNextSymbol(reader, *tables.acTable, *tables.acLookup);
+        if (symbol == (byte)-1) {
+            std::cout << "Error - Invalid AC value\n";
+            return false;
+        }
+
+        byte numZeroes = symbol >> 4;
+        byte coeffLength = symbol & 0x0F;
+
+        if (coeffLength != 0) {
+            if (i + numZeroes > image->endOfSelection) {
+                std::cout << "Error - Zero run-length exceeded spectral selection\n";
                 return false;
             }
-            i += numZeroes;
-
+            for (uint j = 0; j < numZeroes; ++j, ++i) {
+                component[i] = 0;
+            }
             if (coeffLength > 10) {
                 std::cout << "Error - AC coefficient length greater than 10\n";
                 return false;
             }
-            coeff = bitReader.readBits(coeffLength);
+
+            int coeff = reader.readBits(coeffLength);
             if (coeff == -1) {
                 std::cout << "Error - Invalid AC value\n";
                 return false;
@@ -853,261 +1659,524 @@ bool decodeBlockComponent(
             if (coeff < (1 << (coeffLength - 1))) {
                 coeff -= (1 << coeffLength) - 1;
             }
-            component[zigZagMap[i]] = coeff;
+            component[i] = coeff << image->successiveApproximationLow;
+            *nonzero |= 1ull << i;
         }
-        return true;
-    }
-    else { // image->frameType == SOF2
-        if (image->startOfSelection == 0 && image->successiveApproximationHigh == 0) {
-            // DC first visit
-            byte length = getNextSymbol(bitReader, dcTable);
-            if (length == (byte)-1) {
-                std::cout << "Error - Invalid DC value\n";
-                return false;
+        else {
+            if (numZeroes == 15) {
+                if (i + numZeroes > image->endOfSelection) {
+                    std::cout << "Error - Zero run-length exceeded spectral selection\n";
+                    return false;
+                }
+                for (uint j = 0; j < numZeroes; ++j, ++i) {
+                    component[i] = 0;
+                }
             }
-            if (length > 11) {
-                std::cout << "Error - DC coefficient length greater than 11\n";
-                return false;
+            else {
+                skips = (1 << numZeroes) - 1;
+                uint extraSkips = reader.readBits(numZeroes);
+                if (extraSkips == (uint)-1) {
+                    std::cout << "Error - Invalid AC value\n";
+                    return false;
+                }
+                skips += extraSkips;
+                break;
             }
+        }
+    }
+    return true;
+}
 
-            int coeff = bitReader.readBits(length);
-            if (coeff == -1) {
-                std::cout << "Error - Invalid DC value\n";
-                return false;
-            }
-            if (length != 0 && coeff < (1 << (length - 1))) {
-                coeff -= (1 << length) - 1;
-            }
-            coeff += previousDC;
-            previousDC = coeff;
-            component[0] = coeff << image->successiveApproximationLow;
-            return true;
+// index of the lowest set bit of a nonzero mask
+inline uint lowestBit(std::uint64_t mask) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(mask);
+#else
+    uint i = 0;
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        i += 1;
+    }
+    return i;
+#endif
+}
+
+// number of set bits of a mask
+inline uint countBits(std::uint64_t mask) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(mask);
+#else
+    uint count = 0;
+    for (; mask != 0; mask &= mask - 1) {
+        count += 1;
+    }
+    return count;
+#endif
+}
+
+// mask of the zigzag positions from start to end, inclusive
+inline std::uint64_t bandMask(const uint start, const uint end) {
+    return (~0ull << start) & (~0ull >> (63 - end));
+}
+
+// read a correction bit for each coefficient of the mask that is already nonzero,
+//   in zigzag order, and add it to any whose bit is not yet set
+//   the bits are read up to 16 at a time
+inline bool refineCoefficients(EntropyReader& reader, int* const component, std::uint64_t history,
+                               const int positive, const int negative) {
+    while (history != 0) {
+        const uint count = std::min(countBits(history), 16u);
+        const uint bits = reader.readBits(count);
+        if (bits == (uint)-1) {
+            std::cout << "Error - Invalid AC value\n";
+            return false;
         }
-        else if (image->startOfSelection == 0 && image->successiveApproximationHigh != 0) {
-            // DC refinement
-            int bit = bitReader.readBit();
-            if (bit == -1) {
-                std::cout << "Error - Invalid DC value\n";
-                return false;
+        for (uint k = count; k-- > 0;) {
+            int& coeff = component[lowestBit(history)];
+            history &= history - 1;
+            if (((bits >> k) & 1) != 0 && (coeff & positive) == 0) {
+                if (coeff >= 0) {
+                    coeff += positive;
+                }
+                else {
+                    coeff += negative;
+                }
             }
-            component[0] |= bit << image->successiveApproximationLow;
-            return true;
         }
-        else if (image->startOfSelection != 0 && image->successiveApproximationHigh == 0) {
-            // AC first visit
-            if (skips > 0) {
-                skips -= 1;
-                return true;
+    }
+    return true;
+}
+
+template <>
+bool decodeBlockComponent<SCAN_AC_REFINEMENT>(
+    const JPGImage* const image,
+    EntropyReader& reader,
+    int* const component,
+    std::uint64_t* const nonzero,
+    int&,
+    uint& skips,
+    const ScanComponent& tables
+) {
+    int positive = 1 << image->successiveApproximationLow;
+    int negative = ((unsigned)-1) << image->successiveApproximationLow;
+    uint i = image->startOfSelection;
+    const uint end = image->endOfSelection;
+
+    // the coefficients of the band that were nonzero before this scan
+    //   each needs a correction bit, the others are the zeroes that runs count
+    const std::uint64_t history = *nonzero & bandMask(i, end);
+
+    if (skips == 0) {
+        while (i <= end) {
+            byte symbol = getNextSymbol(reader, *tables.acTable, *tables.acLookup);
+            if (symbol == (byte)-1) {
+                std::cout << "Error - Invalid AC value\n";
+                return false;
             }
-            for (uint i = image->startOfSelection; i <= image->endOfSelection; ++i) {
-                byte symbol = getNextSymbol(bitReader, acTable);
-                if (symbol == (byte)-1) {
+
+            byte numZeroes = symbol >> 4;
+            byte coeffLength = symbol & 0x0F;
+            int coeff = 0;
+
+            if (coeffLength != 0) {
+                if (coeffLength != 1) {
                     std::cout << "Error - Invalid AC value\n";
                     return false;
                 }
-
-                byte numZeroes = symbol >> 4;
-                byte coeffLength = symbol & 0x0F;
-
-                if (coeffLength != 0) {
-                    if (i + numZeroes > image->endOfSelection) {
-                        std::cout << "Error - Zero run-length exceeded spectral selection\n";
-                        return false;
-                    }
-                    for (uint j = 0; j < numZeroes; ++j, ++i) {
-                        component[zigZagMap[i]] = 0;
-                    }
-                    if (coeffLength > 10) {
-                        std::cout << "Error - AC coefficient length greater than 10\n";
-                        return false;
-                    }
-
-                    int coeff = bitReader.readBits(coeffLength);
-                    if (coeff == -1) {
+                switch (reader.readBit()) {
+                case 1:
+                    coeff = positive;
+                    break;
+                case 0:
+                    coeff = negative;
+                    break;
+                default: // -1, data stream is empty
+                    std::cout << "Error - Invalid AC value\n";
+                    return false;
+                }
+            }
+            else {
+                if (numZeroes != 15) {
+                    skips = 1 << numZeroes;
+                    uint extraSkips = reader.readBits(numZeroes);
+                    if (extraSkips == (uint)-1) {
                         std::cout << "Error - Invalid AC value\n";
                         return false;
                     }
-                    if (coeff < (1 << (coeffLength - 1))) {
-                        coeff -= (1 << coeffLength) - 1;
-                    }
-                    component[zigZagMap[i]] = coeff << image->successiveApproximationLow;
-                }
-                else {
-                    if (numZeroes == 15) {
-                        if (i + numZeroes > image->endOfSelection) {
-                            std::cout << "Error - Zero run-length exceeded spectral selection\n";
-                            return false;
-                        }
-                        for (uint j = 0; j < numZeroes; ++j, ++i) {
-                            component[zigZagMap[i]] = 0;
-                        }
-                    }
-                    else {
-                        skips = (1 << numZeroes) - 1;
-                        uint extraSkips = bitReader.readBits(numZeroes);
-                        if (extraSkips == (uint)-1) {
-                            std::cout << "Error - Invalid AC value\n";
-                            return false;
-                        }
-                        skips += extraSkips;
-                        break;
-                    }
+                    skips += extraSkips;
+                    break;
                 }
             }
+
+            // skip numZeroes coefficients that are still zero, refining those
+            //   already nonzero on the way, and stop on the next zero after them
+            std::uint64_t zeroes = ~history & bandMask(i, end);
+            for (uint j = 0; j < numZeroes && zeroes != 0; ++j) {
+                zeroes &= zeroes - 1;
+            }
+            const uint next = (zeroes != 0) ? lowestBit(zeroes) : end + 1;
+            if (!refineCoefficients(reader, component, history & bandMask(i, next - 1), positive, negative)) {
+                return false;
+            }
+            if (coeff != 0 && next <= end) {
+                component[next] = coeff;
+                *nonzero |= 1ull << next;
+            }
+            i = next + 1;
+        }
+    }
+
+    if (skips > 0) {
+        if (i <= end && !refineCoefficients(reader, component, history & bandMask(i, end), positive, negative)) {
+            return false;
+        }
+        skips -= 1;
+    }
+    return true;
+}
+
+// check whether any MCU of a restart interval overlaps the crop region
+//   MCUs are numbered in scan order, each one step x step blocks in size
+bool restartIntervalInCrop(const JPGImage* const image, const uint firstMCU, const uint yStep, const uint xStep) {
+    const uint mcusPerRow = (image->blockWidth + xStep - 1) / xStep;
+    for (uint i = firstMCU; i < firstMCU + image->restartInterval; ++i) {
+        const uint y = i / mcusPerRow * yStep;
+        const uint x = i % mcusPerRow * xStep;
+        if (y < image->cropBlockBottom && y + yStep > image->cropBlockTop &&
+            x < image->cropBlockRight && x + xStep > image->cropBlockLeft) {
             return true;
         }
-        else { // image->startOfSelection != 0 && image->successiveApproximationHigh != 0
-            // AC refinement
-            int positive = 1 << image->successiveApproximationLow;
-            int negative = ((unsigned)-1) << image->successiveApproximationLow;
-            int i = image->startOfSelection;
-            if (skips == 0) {
-                for (; i <= image->endOfSelection; ++i) {
-                    byte symbol = getNextSymbol(bitReader, acTable);
-                    if (symbol == (byte)-1) {
-                        std::cout << "Error - Invalid AC value\n";
-                        return false;
-                    }
+    }
+    return false;
+}
 
-                    byte numZeroes = symbol >> 4;
-                    byte coeffLength = symbol & 0x0F;
-                    int coeff = 0;
-
-                    if (coeffLength != 0) {
-                        if (coeffLength != 1) {
-                            std::cout << "Error - Invalid AC value\n";
-                            return false;
-                        }
-                        switch (bitReader.readBit()) {
-                        case 1:
-                            coeff = positive;
-                            break;
-                        case 0:
-                            coeff = negative;
-                            break;
-                        default: // -1, data stream is empty
-                            std::cout << "Error - Invalid AC value\n";
-                            return false;
-                        }
-                    }
-                    else {
-                        if (numZeroes != 15) {
-                            skips = 1 << numZeroes;
-                            uint extraSkips = bitReader.readBits(numZeroes);
-                            if (extraSkips == (uint)-1) {
-                                std::cout << "Error - Invalid AC value\n";
-                                return false;
-                            }
-                            skips += extraSkips;
-                            break;
-                        }
-                    }
+struct ScanState;
 
-                    do {
-                        if (component[zigZagMap[i]] != 0) {
-                            switch (bitReader.readBit()) {
-                            case 1:
-                                if ((component[zigZagMap[i]] & positive) == 0) {
-                                    if (component[zigZagMap[i]] >= 0) {
-                                        component[zigZagMap[i]] += positive;
-                                    }
-                                    else {
-                                        component[zigZagMap[i]] += negative;
-                                    }
-                                }
-                                break;
-                            case 0:
-                                // do nothing
-                                break;
-                            default: // -1, data stream is empty
-                                std::cout << "Error - Invalid AC value\n";
-                                return false;
-                            }
-                        }
-                        else {
-                            if (numZeroes == 0) {
-                                break;
-                            }
-                            numZeroes -= 1;
-                        }
-
-                        i += 1;
-                    } while (i <= image->endOfSelection);
-
-                    if (coeff != 0 && i <= image->endOfSelection) {
-                        component[zigZagMap[i]] = coeff;
-                    }
-                }
+typedef bool (*MCURowDecoder)(EntropyReader&, JPGImage* const, ScanState&, const uint, Block* const);
+
+// entropy decoding state of a scan
+//   the layout of its MCUs is resolved once when the scan starts,
+//   the rest is carried from one MCU row of the scan to the next
+struct ScanState {
+    ScanComponent components[3];
+    uint numComponents = 0;
+
+    // MCU size in blocks, also the step between MCU rows
+    uint yStep = 1;
+    uint xStep = 1;
+    bool cropped = false;
+    MCURowDecoder decodeRow = nullptr;
+
+    // the nonzero masks of the image's blocks, only needed by progressive AC scans
+    std::uint64_t* nonzero = nullptr;
+
+    int previousDCs[3] = { 0 };
+    uint skips = 0;
+    uint mcu = 0;
+    uint mcusToRestart = 0;
+    bool skipInterval = false;
+};
+
+// decode the Huffman data of one row of MCUs, starting at block row y
+//   blocks points to the storage of block row y
+//   specialized for each kind of scan and each MCU size,
+//   an MCU has yStep x xStep luminance blocks and one block of each chroma component,
+//   so a scan of only chroma has one block per MCU
+template <ScanKind kind, uint yStep, uint xStep>
+bool decodeMCURow(EntropyReader& reader, JPGImage* const image, ScanState& state, const uint y, Block* const blocks) {
+    for (uint x = 0; x < image->blockWidth; x += xStep, ++state.mcu) {
+        if (image->restartInterval != 0) {
+            if (state.mcusToRestart == 0) {
+                state.previousDCs[0] = 0;
+                state.previousDCs[1] = 0;
+                state.previousDCs[2] = 0;
+                state.skips = 0;
+                state.mcusToRestart = image->restartInterval;
+                reader.restart();
+
+                // intervals entirely outside of the crop region need not be decoded
+                state.skipInterval = state.cropped && !restartIntervalInCrop(image, state.mcu, yStep, xStep);
+            }
+            state.mcusToRestart -= 1;
+            if (state.skipInterval) {
+                continue;
             }
+        }
 
-            if (skips > 0) {
-                for (; i <= image->endOfSelection; ++i) {
-                    if (component[zigZagMap[i]] != 0) {
-                        switch (bitReader.readBit()) {
-                        case 1:
-                            if ((component[zigZagMap[i]] & positive) == 0) {
-                                if (component[zigZagMap[i]] >= 0) {
-                                    component[zigZagMap[i]] += positive;
-                                }
-                                else {
-                                    component[zigZagMap[i]] += negative;
-                                }
-                            }
-                            break;
-                        case 0:
-                            // do nothing
-                            break;
-                        default: // -1, data stream is empty
-                            std::cout << "Error - Invalid AC value\n";
-                            return false;
-                        }
+        for (uint i = 0; i < state.numComponents; ++i) {
+            const ScanComponent& component = state.components[i];
+            const uint vMax = (component.index == 0) ? yStep : 1;
+            const uint hMax = (component.index == 0) ? xStep : 1;
+            for (uint v = 0; v < vMax; ++v) {
+                for (uint h = 0; h < hMax; ++h) {
+                    std::uint64_t* const nonzero = (kind == SCAN_AC_FIRST || kind == SCAN_AC_REFINEMENT) ?
+                        state.nonzero + ((y + v) * image->blockWidthReal + (x + h)) * 3 + component.index :
+                        nullptr;
+                    if (!decodeBlockComponent<kind>(
+                            image,
+                            reader,
+                            blocks[v * image->blockWidthReal + (x + h)][component.index],
+                            nonzero,
+                            state.previousDCs[component.index],
+                            state.skips,
+                            component)) {
+                        return false;
                     }
                 }
-                skips -= 1;
             }
+        }
+    }
+    return true;
+}
+
+// pick the MCU row decoder of a kind of scan for its MCU size
+template <ScanKind kind>
+MCURowDecoder mcuRowDecoder(const uint yStep, const uint xStep) {
+    if (yStep == 1) {
+        return (xStep == 1) ? decodeMCURow<kind, 1, 1> : decodeMCURow<kind, 1, 2>;
+    }
+    return (xStep == 1) ? decodeMCURow<kind, 2, 1> : decodeMCURow<kind, 2, 2>;
+}
+
+// resolve the layout of the scan just started
+//   a scan of only luminance is not interleaved and has MCUs of one block,
+//   otherwise MCUs are the size set by the luminance sampling factors
+ScanState startScan(const JPGImage* const image) {
+    ScanState state;
+    for (uint i = 0; i < image->numComponents; ++i) {
+        const ColorComponent& component = image->colorComponents[i];
+        if (component.usedInScan) {
+            ScanComponent& scanComponent = state.components[state.numComponents++];
+            scanComponent.index = i;
+            scanComponent.dcTable = &image->huffmanDCTables[component.huffmanDCTableID];
+            scanComponent.acTable = &image->huffmanACTables[component.huffmanACTableID];
+            scanComponent.dcLookup = &image->huffmanDCLookups[component.huffmanDCTableID];
+            scanComponent.acLookup = &image->huffmanACLookups[component.huffmanACTableID];
+        }
+    }
+
+    const bool luminanceOnly = image->componentsInScan == 1 && image->colorComponents[0].usedInScan;
+    state.yStep = luminanceOnly ? 1 : image->verticalSamplingFactor;
+    state.xStep = luminanceOnly ? 1 : image->horizontalSamplingFactor;
+    state.cropped =
+        image->cropBlockTop != 0 || image->cropBlockLeft != 0 ||
+        image->cropBlockBottom < image->blockHeight || image->cropBlockRight < image->blockWidth;
+
+    switch (scanKind(image)) {
+        case SCAN_BASELINE:
+            state.decodeRow = mcuRowDecoder<SCAN_BASELINE>(state.yStep, state.xStep);
+            break;
+        case SCAN_DC_FIRST:
+            state.decodeRow = mcuRowDecoder<SCAN_DC_FIRST>(state.yStep, state.xStep);
+            break;
+        case SCAN_DC_REFINEMENT:
+            state.decodeRow = mcuRowDecoder<SCAN_DC_REFINEMENT>(state.yStep, state.xStep);
+            break;
+        case SCAN_AC_FIRST:
+            state.decodeRow = mcuRowDecoder<SCAN_AC_FIRST>(state.yStep, state.xStep);
+            break;
+        case SCAN_AC_REFINEMENT:
+            state.decodeRow = mcuRowDecoder<SCAN_AC_REFINEMENT>(state.yStep, state.xStep);
+            break;
+    }
+    return state;
+}
+
+// decode the Huffman data of one row of MCUs with the decoder chosen for the scan
+bool decodeMCURow(EntropyReader& reader, JPGImage* const image, ScanState& state, const uint y, Block* const blocks) {
+    return state.decodeRow(reader, image, state, y, blocks);
+}
+
+// read past the Huffman codes of a baseline block component without storing it
+//   reads exactly what decodeBlockComponent<SCAN_BASELINE> does, and fails where it would,
+//   but silently, as most bits this reads past are not where a block truly starts
+bool skipBlockComponent(EntropyReader& reader, const ScanComponent& tables) {
+    const HuffmanLookupEntry& dcEntry = tables.dcLookup->entries[reader.peekBits(huffmanLookupBits)];
+    if (dcEntry.totalLength == 0 || !reader.skipBits(dcEntry.totalLength)) {
+        const byte length = getNextSymbol(reader, *tables.dcTable, *tables.dcLookup);
+        if (length > 11 || (int)reader.readBits(length) == -1) {
+            return false;
+        }
+    }
+
+    for (uint i = 1; i < 64; ++i) {
+        const HuffmanLookupEntry& entry = tables.acLookup->entries[reader.peekBits(huffmanLookupBits)];
+        if (entry.totalLength != 0 && reader.skipBits(entry.totalLength)) {
+            i += entry.symbol >> 4;
+            if (i >= 64) {
+                return false;
+            }
+            continue;
+        }
+
+        const byte symbol = getNextSymbol(reader, *tables.acTable, *tables.acLookup);
+        if (symbol == (byte)-1) {
+            return false;
+        }
+        if (symbol == 0x00) {
             return true;
         }
+        const uint coeffLength = symbol & 0x0F;
+        i += symbol >> 4;
+        if (i >= 64 || coeffLength > 10 || (int)reader.readBits(coeffLength) == -1) {
+            return false;
+        }
     }
+    return true;
 }
 
-// decode all the Huffman data and fill all MCUs
-void decodeHuffmanData(BitReader& bitReader, JPGImage* const image) {
+// read past one MCU of a baseline scan without storing it, silently failing where decoding would
+bool skipMCU(EntropyReader& reader, const ScanState& state) {
+    for (uint i = 0; i < state.numComponents; ++i) {
+        const ScanComponent& component = state.components[i];
+        const uint blocks = (component.index == 0) ? state.yStep * state.xStep : 1;
+        for (uint j = 0; j < blocks; ++j) {
+            if (!skipBlockComponent(reader, component)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// baseline scans without restart markers are split into chunks of at least this many bytes
+//   of entropy-coded data, each decoded on its own thread
+const std::size_t speculativeChunkSize = 64 * 1024;
+
+// a chunk of the entropy-coded data of a baseline scan without restart markers
+struct SpeculativeChunk {
+    // bit the chunk's data starts at
+    std::size_t begin = 0;
+
+    // where MCUs start when the data is read from begin as if an MCU started there,
+    //   a run of them begins again further on each time the data could not be an MCU
+    //   runStarts holds the index in mcuStarts of each run's first MCU
+    std::vector<std::size_t> mcuStarts;
+    std::vector<std::size_t> runStarts;
+
+    // the MCU rows [top, bottom) that truly start in the chunk, and the bit the first starts at
+    uint top = 0;
+    uint bottom = 0;
+    std::size_t start = 0;
+
+    // DC values at the end of the chunk, decoded as if each component's were 0 at its start
     int previousDCs[3] = { 0 };
-    uint skips = 0;
+    bool decoded = false;
+    bool valid = true;
+};
 
-    const bool luminanceOnly = image->componentsInScan == 1 && image->colorComponents[0].usedInScan;
-    const uint yStep = luminanceOnly ? 1 : image->verticalSamplingFactor;
-    const uint xStep = luminanceOnly ? 1 : image->horizontalSamplingFactor;
-    const uint restartInterval = image->restartInterval * xStep * yStep;
+// read a chunk as if an MCU started at its first bit, recording where each MCU starts,
+//   until a whole MCU row's worth of MCUs have started past its end, or the data ends
+//   Huffman codes are self-synchronizing, so reading from a wrong guess soon falls in step
+//   with the true MCUs, after which the recorded starts are the true ones
+void speculateChunk(const EntropySegment& segment, const ScanState& state, const uint mcusPerRow,
+                    const std::size_t end, SpeculativeChunk& chunk) {
+    EntropyReader reader(segment);
+    const std::size_t dataBits = segment.data.size() * 8;
+    std::size_t position = chunk.begin;
+    uint startsPastEnd = 0;
+    while (position < dataBits && startsPastEnd <= mcusPerRow) {
+        chunk.runStarts.push_back(chunk.mcuStarts.size());
+        reader.seek(position);
+        while (startsPastEnd <= mcusPerRow) {
+            chunk.mcuStarts.push_back(reader.bitPosition());
+            if (chunk.mcuStarts.back() >= end) {
+                startsPastEnd += 1;
+            }
+            if (!skipMCU(reader, state)) {
+                break;
+            }
+        }
+        // guess again just past where the data stopped making sense
+        position = std::max(reader.bitPosition(), chunk.mcuStarts.back() + 1);
+    }
+}
 
-    for (uint y = 0; y < image->blockHeight; y += yStep) {
-        for (uint x = 0; x < image->blockWidth; x += xStep) {
-            if (restartInterval != 0 && (y * image->blockWidthReal + x) % restartInterval == 0) {
-                previousDCs[0] = 0;
-                previousDCs[1] = 0;
-                previousDCs[2] = 0;
-                skips = 0;
-                bitReader.align();
+// find the true start of each chunk's first whole MCU row, in order, from the true start of the chunk before it,
+//   and follow the last chunk to the end of the scan
+//   where a true MCU start is one the speculative reading of the chunk recorded,
+//   the MCUs after it are the recorded ones, up to the end of that run,
+//   anywhere else MCUs are read past one at a time
+//   so every MCU of the scan is known to decode before any is decoded
+//   return the index of the chunk the data turns out invalid in, or the number of chunks if it never does
+uint findChunkStarts(const EntropySegment& segment, const ScanState& state, const uint mcusPerRow, const uint mcuRows,
+                     std::vector<SpeculativeChunk>& chunks) {
+    EntropyReader reader(segment);
+    const std::size_t numMCUs = (std::size_t)mcuRows * mcusPerRow;
+    std::size_t position = 0;
+    std::size_t mcu = 0;
+    for (uint c = 0; c < chunks.size(); ++c) {
+        const SpeculativeChunk& chunk = chunks[c];
+        const bool last = c + 1 == chunks.size();
+        const std::size_t end = last ? (std::size_t)-1 : chunks[c + 1].begin;
+        std::size_t recorded = chunk.mcuStarts.size(); // index of position in mcuStarts, if it is there
+        while (mcu < numMCUs && (mcu % mcusPerRow != 0 || position < end)) {
+            if (recorded == chunk.mcuStarts.size()) {
+                const auto found = std::lower_bound(chunk.mcuStarts.begin(), chunk.mcuStarts.end(), position);
+                if (found != chunk.mcuStarts.end() && *found == position) {
+                    recorded = found - chunk.mcuStarts.begin();
+                }
+            }
+            if (recorded + 1 < chunk.mcuStarts.size() &&
+                !std::binary_search(chunk.runStarts.begin(), chunk.runStarts.end(), recorded + 1)) {
+                recorded += 1;
+                position = chunk.mcuStarts[recorded];
+                mcu += 1;
+                continue;
             }
 
-            for (uint i = 0; i < image->numComponents; ++i) {
-                const ColorComponent& component = image->colorComponents[i];
-                if (component.usedInScan) {
-                    const uint vMax = luminanceOnly ? 1 : component.verticalSamplingFactor;
-                    const uint hMax = luminanceOnly ? 1 : component.horizontalSamplingFactor;
-                    for (uint v = 0; v < vMax; ++v) {
-                        for (uint h = 0; h < hMax; ++h) {
-                            if (!decodeBlockComponent(
-                                    image,
-                                    bitReader,
-                                    image->blocks[(y + v) * image->blockWidthReal + (x + h)][i],
-                                    previousDCs[i],
-                                    skips,
-                                    image->huffmanDCTables[component.huffmanDCTableID],
-                                    image->huffmanACTables[component.huffmanACTableID])) {
-                                return;
-                            }
-                        }
+            recorded = chunk.mcuStarts.size();
+            if (reader.bitPosition() != position) {
+                reader.seek(position);
+            }
+            if (!skipMCU(reader, state)) {
+                return c;
+            }
+            position = reader.bitPosition();
+            mcu += 1;
+        }
+        chunks[c].bottom = mcu / mcusPerRow;
+        if (!last) {
+            chunks[c + 1].top = chunks[c].bottom;
+            chunks[c + 1].start = position;
+        }
+    }
+    return chunks.size();
+}
+
+// decode the MCU rows of a chunk from its true start
+//   DC values are decoded as if each component's were previousDCs at the start of the chunk
+void decodeChunk(const EntropySegment& segment, JPGImage* const image, const ScanState& scanState,
+                 SpeculativeChunk& chunk, const int (&previousDCs)[3]) {
+    EntropyReader reader(segment);
+    reader.seek(chunk.start);
+    ScanState state = scanState;
+    std::copy(previousDCs, previousDCs + 3, state.previousDCs);
+    const uint mcusPerRow = (image->blockWidth + state.xStep - 1) / state.xStep;
+    state.mcu = chunk.top * mcusPerRow;
+    for (uint row = chunk.top; row < chunk.bottom; ++row) {
+        const uint y = row * state.yStep;
+        if (!decodeMCURow(reader, image, state, y, image->blocks + y * image->blockWidthReal)) {
+            chunk.valid = false;
+            break;
+        }
+    }
+    std::copy(state.previousDCs, state.previousDCs + 3, chunk.previousDCs);
+}
+
+// add the true DC values at the start of a chunk to the DC values of its blocks
+void offsetChunkDCs(JPGImage* const image, const ScanState& state, const SpeculativeChunk& chunk,
+                    const int (&offsets)[3]) {
+    for (uint row = chunk.top; row < chunk.bottom; ++row) {
+        const uint y = row * state.yStep;
+        for (uint x = 0; x < image->blockWidth; x += state.xStep) {
+            for (uint i = 0; i < state.numComponents; ++i) {
+                const uint index = state.components[i].index;
+                const uint vMax = (index == 0) ? state.yStep : 1;
+                const uint hMax = (index == 0) ? state.xStep : 1;
+                for (uint v = 0; v < vMax; ++v) {
+                    for (uint h = 0; h < hMax; ++h) {
+                        image->blocks[(y + v) * image->blockWidthReal + (x + h)][index][0] += offsets[index];
                     }
                 }
             }
@@ -1115,23 +2184,234 @@ void decodeHuffmanData(BitReader& bitReader, JPGImage* const image) {
     }
 }
 
-// dequantize a block component based on a quantization table
-void dequantizeBlockComponent(const QuantizationTable& qTable, int* const component) {
-    for (uint i = 0; i < 64; ++i) {
+// decode a baseline scan without restart markers on up to image->threads threads
+//   the data is split into chunks, and each is first read speculatively,
+//   from its first bit, to record where MCUs would start
+//   the calling thread then follows the true MCU starts from chunk to chunk,
+//   which mostly means finding where they fall in step with the recorded ones,
+//   and every chunk's whole MCU rows are decoded at once, each with DC values starting from 0
+//   in order, the calling thread adds the true DC values at the start of each chunk
+//   to its blocks and tells progress, if set, that the chunk's rows are decoded
+//   the chunk the data turns out invalid in is decoded last, by the calling thread alone,
+//   so the blocks are just as the single-threaded decoder leaves them
+void decodeHuffmanDataSpeculatively(JPGImage* const image, const EntropySegment& segment, const ScanState& state,
+                                    const uint numChunks, DecodeProgress* const progress) {
+    const uint mcusPerRow = (image->blockWidth + state.xStep - 1) / state.xStep;
+    const uint mcuRows = (image->blockHeight + state.yStep - 1) / state.yStep;
+    std::vector<SpeculativeChunk> chunks(numChunks);
+    for (uint c = 0; c < numChunks; ++c) {
+        chunks[c].begin = segment.data.size() * c / numChunks * 8;
+    }
+
+    // tasks [0, numChunks) speculatively read the chunks,
+    //   tasks [numChunks, 2 * numChunks) decode them, once the true starts are found
+    const uint speculateTasks = numChunks;
+    const uint numTasks = speculateTasks + numChunks;
+    std::mutex mutex;
+    std::condition_variable changed;
+    uint nextTask = 0;
+    uint speculated = 0;
+    bool startsFound = false;
+    uint invalidChunk = numChunks;
+
+    auto runTask = [&](const uint task) {
+        if (task < speculateTasks) {
+            const std::size_t end = (task + 1 < numChunks) ? chunks[task + 1].begin : segment.data.size() * 8;
+            speculateChunk(segment, state, mcusPerRow, end, chunks[task]);
+        }
+        else if (task - speculateTasks < invalidChunk) {
+            const int zeroDCs[3] = { 0 };
+            decodeChunk(segment, image, state, chunks[task - speculateTasks], zeroDCs);
+        }
+    };
+
+    // take tasks before lastTask until there are none left, or just one task
+    auto work = [&](const uint lastTask, const bool once) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (nextTask < lastTask) {
+            const uint task = nextTask++;
+            changed.wait(lock, [&]() { return task < speculateTasks || startsFound; });
+            lock.unlock();
+            runTask(task);
+            lock.lock();
+            if (task < speculateTasks) {
+                speculated += 1;
+            }
+            else {
+                chunks[task - speculateTasks].decoded = true;
+            }
+            changed.notify_all();
+            if (once) {
+                return;
+            }
+        }
+    };
+
+    Helpers helpers(image->scheduler);
+    helpers.start(image->threads - 1, [&]() { work(numTasks, false); });
+
+    work(speculateTasks, false);
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() { return speculated == speculateTasks; });
+    }
+    const uint found = findChunkStarts(segment, state, mcusPerRow, mcuRows, chunks);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        invalidChunk = found;
+        startsFound = true;
+        changed.notify_all();
+    }
+
+    // decode chunks alongside the other threads, and put the finished ones in order
+    int offsets[3] = { 0 };
+    for (uint c = 0; c < numChunks && c <= invalidChunk; ++c) {
+        SpeculativeChunk& chunk = chunks[c];
+        if (c == invalidChunk) {
+            chunk.bottom = mcuRows;
+            decodeChunk(segment, image, state, chunk, offsets);
+            image->valid = chunk.valid;
+            break;
+        }
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (chunk.decoded || nextTask >= numTasks) {
+                    changed.wait(lock, [&]() { return chunk.decoded; });
+                    break;
+                }
+            }
+            work(numTasks, true);
+        }
+        if (!chunk.valid) {
+            image->valid = false;
+            break;
+        }
+        if (c > 0) {
+            offsetChunkDCs(image, state, chunk, offsets);
+        }
+        for (uint i = 0; i < 3; ++i) {
+            offsets[i] += chunk.previousDCs[i];
+        }
+        if (progress != nullptr) {
+            progress->setDecoded(chunk.bottom * state.yStep);
+        }
+    }
+
+    helpers.wait();
+}
+
+// decode the MCU rows of a scan from the start, marking the image invalid if the data is
+//   progress, if set, is told of each MCU row as it is decoded
+void decodeMCURows(EntropyReader& reader, JPGImage* const image, ScanState& state, DecodeProgress* const progress) {
+    for (uint y = 0; y < image->blockHeight; y += state.yStep) {
+        if (!decodeMCURow(reader, image, state, y, image->blocks + y * image->blockWidthReal)) {
+            image->valid = false;
+            return;
+        }
+        if (progress != nullptr) {
+            progress->setDecoded(y + state.yStep);
+        }
+    }
+}
+
+// decode all the Huffman data and fill all MCUs
+//   segment holds the scan's entropy-coded data once it has been read
+//   progress, if set, is told of each MCU row as it is decoded
+void decodeHuffmanData(BitReader& bitReader, JPGImage* const image, EntropySegment& segment,
+                       std::uint64_t* const nonzero, DecodeProgress* const progress) {
+    bitReader.readEntropySegment(segment);
+    EntropyReader reader(segment);
+
+    ScanState state = startScan(image);
+    state.nonzero = nonzero;
+
+    // baseline scans without restart markers can only be split up by guessing where MCUs start
+    const std::size_t numChunks = std::min<std::size_t>(image->threads, segment.data.size() / speculativeChunkSize);
+    if (scanKind(image) == SCAN_BASELINE && image->restartInterval == 0 && numChunks > 1) {
+        decodeHuffmanDataSpeculatively(image, segment, state, numChunks, progress);
+        return;
+    }
+
+    decodeMCURows(reader, image, state, progress);
+}
+
+// decode the Huffman data of a deferred scan, with its header put into the image
+//   and the tables it was started with
+void decodeDeferredScan(BitReader& bitReader, JPGImage* const image, const DeferredScan& scan,
+                        const std::deque<HuffmanSnapshot>& tables, EntropySegment& segment,
+                        std::uint64_t* const nonzero) {
+    image->componentsInScan = scan.componentsInScan;
+    image->startOfSelection = scan.startOfSelection;
+    image->endOfSelection = scan.endOfSelection;
+    image->successiveApproximationHigh = scan.successiveApproximationHigh;
+    image->successiveApproximationLow = scan.successiveApproximationLow;
+    image->restartInterval = scan.restartInterval;
+    for (uint i = 0; i < image->numComponents; ++i) {
+        image->colorComponents[i].usedInScan = scan.usedInScan[i];
+    }
+
+    bitReader.readEntropySegment(segment);
+    EntropyReader reader(segment);
+
+    ScanState state = startScan(image);
+    state.nonzero = nonzero;
+    for (uint i = 0; i < state.numComponents; ++i) {
+        ScanComponent& component = state.components[i];
+        const uint dcTable = scan.dcTables[component.index];
+        const uint acTable = scan.acTables[component.index];
+        if (dcTable != noHuffmanSnapshot) {
+            component.dcTable = &tables[dcTable].table;
+            component.dcLookup = &tables[dcTable].lookup;
+        }
+        if (acTable != noHuffmanSnapshot) {
+            component.acTable = &tables[acTable].table;
+            component.acLookup = &tables[acTable].lookup;
+        }
+    }
+
+    decodeMCURows(reader, image, state, nullptr);
+}
+
+// dequantize the first count coefficients of a block component,
+//   both the table and the coefficients in zigzag order
+void dequantizeBlockComponent(const QuantizationTable& qTable, int* const component, const uint count) {
+    for (uint i = 0; i < count; ++i) {
         component[i] *= qTable.table[i];
     }
 }
 
-// dequantize all MCUs
-void dequantize(const JPGImage* const image) {
-    for (uint y = 0; y < image->blockHeight; y += image->verticalSamplingFactor) {
-        for (uint x = 0; x < image->blockWidth; x += image->horizontalSamplingFactor) {
-            for (uint i = 0; i < image->numComponents; ++i) {
+// dequantize all MCUs in block rows [top, bottom)
+//   blocks points to the storage of block row top
+void dequantize(const JPGImage* const image, Block* const blocks, const uint top, const uint bottom) {
+    // the tables are put in zigzag order to match the coefficients,
+    //   and the fast integer IDCT expects its AAN scale factors
+    //   to be folded into them
+    QuantizationTable qTables[4];
+    for (uint i = 0; i < 4; ++i) {
+        for (uint j = 0; j < 64; ++j) {
+            qTables[i].table[j] = image->quantizationTables[i].table[zigZagMap[j]];
+            if (image->dctMethod == DCT_FAST && image->scale == 1) {
+                const uint shift = aanScaleBits - dctFastPass1Bits;
+                qTables[i].table[j] = (qTables[i].table[j] * aanScales[zigZagMap[j]] + (1 << (shift - 1))) >> shift;
+            }
+        }
+    }
+
+    // reduced size IDCTs only read the top-left blockSize x blockSize coefficients,
+    //   which all come before the bottom-right one in zigzag order
+    const uint blockSize = 8 / image->scale;
+    const uint count = inverseZigZagMap[(blockSize - 1) * 8 + (blockSize - 1)] + 1;
+    const uint first = std::max(top, image->cropBlockTop);
+    const uint last = std::min(bottom, image->cropBlockBottom);
+    for (uint y = first; y < last; y += image->verticalSamplingFactor) {
+        for (uint x = image->cropBlockLeft; x < image->cropBlockRight; x += image->horizontalSamplingFactor) {
+            for (uint i = 0; i < decodedComponents(image); ++i) {
                 const ColorComponent& component = image->colorComponents[i];
                 for (uint v = 0; v < component.verticalSamplingFactor; ++v) {
                     for (uint h = 0; h < component.horizontalSamplingFactor; ++h) {
-                        dequantizeBlockComponent(image->quantizationTables[component.quantizationTableID],
-                            image->blocks[(y + v) * image->blockWidthReal + (x + h)][i]);
+                        dequantizeBlockComponent(qTables[component.quantizationTableID],
+                            blocks[(y - top + v) * image->blockWidthReal + (x + h)][i], count);
                     }
                 }
             }
@@ -1139,21 +2419,28 @@ void dequantize(const JPGImage* const image) {
     }
 }
 
+// dequantize all MCUs
+void dequantize(const JPGImage* const image) {
+    dequantize(image, image->blocks, 0, image->blockHeightReal);
+}
+
 // perform 1-D IDCT on all columns and rows of a block component
-//   resulting in 2-D IDCT
-void inverseDCTBlockComponent(int* const component) {
+//   in single precision, resulting in 2-D IDCT with the samples rounded to nearest
+//   the coefficients are read in zigzag order and the samples written in natural order,
+//   the same holds for every IDCT below
+void inverseDCTBlockComponentFloat(int* const component) {
 
     float intermediate[64];
 
     for (uint i = 0; i < 8; ++i) {
-        const float g0 = component[0 * 8 + i] * s0;
-        const float g1 = component[4 * 8 + i] * s4;
-        const float g2 = component[2 * 8 + i] * s2;
-        const float g3 = component[6 * 8 + i] * s6;
-        const float g4 = component[5 * 8 + i] * s5;
-        const float g5 = component[1 * 8 + i] * s1;
-        const float g6 = component[7 * 8 + i] * s7;
-        const float g7 = component[3 * 8 + i] * s3;
+        const float g0 = component[inverseZigZagMap[0 * 8 + i]] * s0;
+        const float g1 = component[inverseZigZagMap[4 * 8 + i]] * s4;
+        const float g2 = component[inverseZigZagMap[2 * 8 + i]] * s2;
+        const float g3 = component[inverseZigZagMap[6 * 8 + i]] * s6;
+        const float g4 = component[inverseZigZagMap[5 * 8 + i]] * s5;
+        const float g5 = component[inverseZigZagMap[1 * 8 + i]] * s1;
+        const float g6 = component[inverseZigZagMap[7 * 8 + i]] * s7;
+        const float g7 = component[inverseZigZagMap[3 * 8 + i]] * s3;
 
         const float f0 = g0;
         const float f1 = g1;
@@ -1270,26 +2557,373 @@ void inverseDCTBlockComponent(int* const component) {
         const float b6 = c6 - c7;
         const float b7 = c7;
 
-        component[i * 8 + 0] = b0 + b7 + 0.5f;
-        component[i * 8 + 1] = b1 + b6 + 0.5f;
-        component[i * 8 + 2] = b2 + b5 + 0.5f;
-        component[i * 8 + 3] = b3 + b4 + 0.5f;
-        component[i * 8 + 4] = b3 - b4 + 0.5f;
-        component[i * 8 + 5] = b2 - b5 + 0.5f;
-        component[i * 8 + 6] = b1 - b6 + 0.5f;
-        component[i * 8 + 7] = b0 - b7 + 0.5f;
+        component[i * 8 + 0] = roundDCTOutput(b0 + b7);
+        component[i * 8 + 1] = roundDCTOutput(b1 + b6);
+        component[i * 8 + 2] = roundDCTOutput(b2 + b5);
+        component[i * 8 + 3] = roundDCTOutput(b3 + b4);
+        component[i * 8 + 4] = roundDCTOutput(b3 - b4);
+        component[i * 8 + 5] = roundDCTOutput(b2 - b5);
+        component[i * 8 + 6] = roundDCTOutput(b1 - b6);
+        component[i * 8 + 7] = roundDCTOutput(b0 - b7);
     }
 }
 
-// perform IDCT on all MCUs
-void inverseDCT(const JPGImage* const image) {
-    for (uint y = 0; y < image->blockHeight; y += image->verticalSamplingFactor) {
-        for (uint x = 0; x < image->blockWidth; x += image->horizontalSamplingFactor) {
-            for (uint i = 0; i < image->numComponents; ++i) {
-                const ColorComponent& component = image->colorComponents[i];
-                for (uint v = 0; v < component.verticalSamplingFactor; ++v) {
-                    for (uint h = 0; h < component.horizontalSamplingFactor; ++h) {
-                        inverseDCTBlockComponent(image->blocks[(y + v) * image->blockWidthReal + (x + h)][i]);
+// shift right with rounding
+inline int descale(const int x, const uint n) {
+    return (x + (1 << (n - 1))) >> n;
+}
+
+// perform 1-D IDCT on all columns and rows of a block component
+//   using 32-bit integer math with 13-bit constants (LL&M)
+//   resulting in 2-D IDCT
+void inverseDCTBlockComponentAccurate(int* const component) {
+    const uint pass1Shift = dctAccurateConstBits - dctAccuratePass1Bits;
+    const uint pass2Shift = dctAccurateConstBits + dctAccuratePass1Bits + 3;
+
+    int intermediate[64];
+
+    for (uint i = 0; i < 8; ++i) {
+        // columns with no AC coefficients are common and have a flat output
+        if (component[inverseZigZagMap[1 * 8 + i]] == 0 && component[inverseZigZagMap[2 * 8 + i]] == 0 &&
+            component[inverseZigZagMap[3 * 8 + i]] == 0 && component[inverseZigZagMap[4 * 8 + i]] == 0 &&
+            component[inverseZigZagMap[5 * 8 + i]] == 0 && component[inverseZigZagMap[6 * 8 + i]] == 0 &&
+            component[inverseZigZagMap[7 * 8 + i]] == 0) {
+            const int dc = component[inverseZigZagMap[0 * 8 + i]] * (1 << dctAccuratePass1Bits);
+            for (uint j = 0; j < 8; ++j) {
+                intermediate[j * 8 + i] = dc;
+            }
+            continue;
+        }
+
+        // even part
+        int z2 = component[inverseZigZagMap[2 * 8 + i]];
+        int z3 = component[inverseZigZagMap[6 * 8 + i]];
+        int z1 = (z2 + z3) * FIX_0_541196100;
+        int tmp2 = z1 - z3 * FIX_1_847759065;
+        int tmp3 = z1 + z2 * FIX_0_765366865;
+
+        z2 = component[inverseZigZagMap[0 * 8 + i]];
+        z3 = component[inverseZigZagMap[4 * 8 + i]];
+        int tmp0 = (z2 + z3) * (1 << dctAccurateConstBits);
+        int tmp1 = (z2 - z3) * (1 << dctAccurateConstBits);
+
+        const int tmp10 = tmp0 + tmp3;
+        const int tmp13 = tmp0 - tmp3;
+        const int tmp11 = tmp1 + tmp2;
+        const int tmp12 = tmp1 - tmp2;
+
+        // odd part
+        tmp0 = component[inverseZigZagMap[7 * 8 + i]];
+        tmp1 = component[inverseZigZagMap[5 * 8 + i]];
+        tmp2 = component[inverseZigZagMap[3 * 8 + i]];
+        tmp3 = component[inverseZigZagMap[1 * 8 + i]];
+
+        z1 = tmp0 + tmp3;
+        z2 = tmp1 + tmp2;
+        z3 = tmp0 + tmp2;
+        int z4 = tmp1 + tmp3;
+        const int z5 = (z3 + z4) * FIX_1_175875602;
+
+        tmp0 *= FIX_0_298631336;
+        tmp1 *= FIX_2_053119869;
+        tmp2 *= FIX_3_072711026;
+        tmp3 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 *= -FIX_1_961570560;
+        z4 *= -FIX_0_390180644;
+
+        z3 += z5;
+        z4 += z5;
+
+        tmp0 += z1 + z3;
+        tmp1 += z2 + z4;
+        tmp2 += z2 + z3;
+        tmp3 += z1 + z4;
+
+        intermediate[0 * 8 + i] = descale(tmp10 + tmp3, pass1Shift);
+        intermediate[7 * 8 + i] = descale(tmp10 - tmp3, pass1Shift);
+        intermediate[1 * 8 + i] = descale(tmp11 + tmp2, pass1Shift);
+        intermediate[6 * 8 + i] = descale(tmp11 - tmp2, pass1Shift);
+        intermediate[2 * 8 + i] = descale(tmp12 + tmp1, pass1Shift);
+        intermediate[5 * 8 + i] = descale(tmp12 - tmp1, pass1Shift);
+        intermediate[3 * 8 + i] = descale(tmp13 + tmp0, pass1Shift);
+        intermediate[4 * 8 + i] = descale(tmp13 - tmp0, pass1Shift);
+    }
+    for (uint i = 0; i < 8; ++i) {
+        const int* const row = intermediate + i * 8;
+
+        // even part
+        int z2 = row[2];
+        int z3 = row[6];
+        int z1 = (z2 + z3) * FIX_0_541196100;
+        int tmp2 = z1 - z3 * FIX_1_847759065;
+        int tmp3 = z1 + z2 * FIX_0_765366865;
+
+        int tmp0 = (row[0] + row[4]) * (1 << dctAccurateConstBits);
+        int tmp1 = (row[0] - row[4]) * (1 << dctAccurateConstBits);
+
+        const int tmp10 = tmp0 + tmp3;
+        const int tmp13 = tmp0 - tmp3;
+        const int tmp11 = tmp1 + tmp2;
+        const int tmp12 = tmp1 - tmp2;
+
+        // odd part
+        tmp0 = row[7];
+        tmp1 = row[5];
+        tmp2 = row[3];
+        tmp3 = row[1];
+
+        z1 = tmp0 + tmp3;
+        z2 = tmp1 + tmp2;
+        z3 = tmp0 + tmp2;
+        int z4 = tmp1 + tmp3;
+        const int z5 = (z3 + z4) * FIX_1_175875602;
+
+        tmp0 *= FIX_0_298631336;
+        tmp1 *= FIX_2_053119869;
+        tmp2 *= FIX_3_072711026;
+        tmp3 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 *= -FIX_1_961570560;
+        z4 *= -FIX_0_390180644;
+
+        z3 += z5;
+        z4 += z5;
+
+        tmp0 += z1 + z3;
+        tmp1 += z2 + z4;
+        tmp2 += z2 + z3;
+        tmp3 += z1 + z4;
+
+        component[i * 8 + 0] = descale(tmp10 + tmp3, pass2Shift);
+        component[i * 8 + 7] = descale(tmp10 - tmp3, pass2Shift);
+        component[i * 8 + 1] = descale(tmp11 + tmp2, pass2Shift);
+        component[i * 8 + 6] = descale(tmp11 - tmp2, pass2Shift);
+        component[i * 8 + 2] = descale(tmp12 + tmp1, pass2Shift);
+        component[i * 8 + 5] = descale(tmp12 - tmp1, pass2Shift);
+        component[i * 8 + 3] = descale(tmp13 + tmp0, pass2Shift);
+        component[i * 8 + 4] = descale(tmp13 - tmp0, pass2Shift);
+    }
+}
+
+// multiply by an 8-bit fixed point constant, truncating
+inline int multiplyFast(const int x, const int c) {
+    return (x * c) >> dctFastConstBits;
+}
+
+// perform 1-D IDCT on all columns and rows of a block component
+//   using integer math with 8-bit constants (AAN)
+//   the coefficients must have been dequantized with AAN-scaled tables
+//   resulting in 2-D IDCT
+void inverseDCTBlockComponentFast(int* const component) {
+    const uint pass2Shift = dctFastPass1Bits + 3;
+
+    int intermediate[64];
+
+    for (uint i = 0; i < 8; ++i) {
+        // columns with no AC coefficients are common and have a flat output
+        if (component[inverseZigZagMap[1 * 8 + i]] == 0 && component[inverseZigZagMap[2 * 8 + i]] == 0 &&
+            component[inverseZigZagMap[3 * 8 + i]] == 0 && component[inverseZigZagMap[4 * 8 + i]] == 0 &&
+            component[inverseZigZagMap[5 * 8 + i]] == 0 && component[inverseZigZagMap[6 * 8 + i]] == 0 &&
+            component[inverseZigZagMap[7 * 8 + i]] == 0) {
+            const int dc = component[inverseZigZagMap[0 * 8 + i]];
+            for (uint j = 0; j < 8; ++j) {
+                intermediate[j * 8 + i] = dc;
+            }
+            continue;
+        }
+
+        // even part
+        int tmp0 = component[inverseZigZagMap[0 * 8 + i]];
+        int tmp1 = component[inverseZigZagMap[2 * 8 + i]];
+        int tmp2 = component[inverseZigZagMap[4 * 8 + i]];
+        int tmp3 = component[inverseZigZagMap[6 * 8 + i]];
+
+        int tmp10 = tmp0 + tmp2;
+        int tmp11 = tmp0 - tmp2;
+        int tmp13 = tmp1 + tmp3;
+        int tmp12 = multiplyFast(tmp1 - tmp3, FAST_1_414213562) - tmp13;
+
+        tmp0 = tmp10 + tmp13;
+        tmp3 = tmp10 - tmp13;
+        tmp1 = tmp11 + tmp12;
+        tmp2 = tmp11 - tmp12;
+
+        // odd part
+        int tmp4 = component[inverseZigZagMap[1 * 8 + i]];
+        int tmp5 = component[inverseZigZagMap[3 * 8 + i]];
+        int tmp6 = component[inverseZigZagMap[5 * 8 + i]];
+        int tmp7 = component[inverseZigZagMap[7 * 8 + i]];
+
+        const int z13 = tmp6 + tmp5;
+        const int z10 = tmp6 - tmp5;
+        const int z11 = tmp4 + tmp7;
+        const int z12 = tmp4 - tmp7;
+
+        tmp7 = z11 + z13;
+        tmp11 = multiplyFast(z11 - z13, FAST_1_414213562);
+
+        const int z5 = multiplyFast(z10 + z12, FAST_1_847759065);
+        tmp10 = multiplyFast(z12, FAST_1_082392200) - z5;
+        tmp12 = multiplyFast(z10, -FAST_2_613125930) + z5;
+
+        tmp6 = tmp12 - tmp7;
+        tmp5 = tmp11 - tmp6;
+        tmp4 = tmp10 + tmp5;
+
+        intermediate[0 * 8 + i] = tmp0 + tmp7;
+        intermediate[7 * 8 + i] = tmp0 - tmp7;
+        intermediate[1 * 8 + i] = tmp1 + tmp6;
+        intermediate[6 * 8 + i] = tmp1 - tmp6;
+        intermediate[2 * 8 + i] = tmp2 + tmp5;
+        intermediate[5 * 8 + i] = tmp2 - tmp5;
+        intermediate[4 * 8 + i] = tmp3 + tmp4;
+        intermediate[3 * 8 + i] = tmp3 - tmp4;
+    }
+    for (uint i = 0; i < 8; ++i) {
+        int* const row = intermediate + i * 8;
+        // the DC term reaches every output of the row, so adding the
+        //   rounding constant to it rounds all eight outputs
+        row[0] += 1 << (pass2Shift - 1);
+
+        // even part
+        int tmp10 = row[0] + row[4];
+        int tmp11 = row[0] - row[4];
+        int tmp13 = row[2] + row[6];
+        int tmp12 = multiplyFast(row[2] - row[6], FAST_1_414213562) - tmp13;
+
+        const int tmp0 = tmp10 + tmp13;
+        const int tmp3 = tmp10 - tmp13;
+        const int tmp1 = tmp11 + tmp12;
+        const int tmp2 = tmp11 - tmp12;
+
+        // odd part
+        const int z13 = row[5] + row[3];
+        const int z10 = row[5] - row[3];
+        const int z11 = row[1] + row[7];
+        const int z12 = row[1] - row[7];
+
+        const int tmp7 = z11 + z13;
+        tmp11 = multiplyFast(z11 - z13, FAST_1_414213562);
+
+        const int z5 = multiplyFast(z10 + z12, FAST_1_847759065);
+        tmp10 = multiplyFast(z12, FAST_1_082392200) - z5;
+        tmp12 = multiplyFast(z10, -FAST_2_613125930) + z5;
+
+        const int tmp6 = tmp12 - tmp7;
+        const int tmp5 = tmp11 - tmp6;
+        const int tmp4 = tmp10 + tmp5;
+
+        component[i * 8 + 0] = (tmp0 + tmp7) >> pass2Shift;
+        component[i * 8 + 7] = (tmp0 - tmp7) >> pass2Shift;
+        component[i * 8 + 1] = (tmp1 + tmp6) >> pass2Shift;
+        component[i * 8 + 6] = (tmp1 - tmp6) >> pass2Shift;
+        component[i * 8 + 2] = (tmp2 + tmp5) >> pass2Shift;
+        component[i * 8 + 5] = (tmp2 - tmp5) >> pass2Shift;
+        component[i * 8 + 4] = (tmp3 + tmp4) >> pass2Shift;
+        component[i * 8 + 3] = (tmp3 - tmp4) >> pass2Shift;
+    }
+}
+
+// perform 1-D 4-point IDCT on the first 4 columns and rows of a block component
+//   using the low frequency 4x4 coefficients, resulting in a 4x4 2-D IDCT
+//   whose output fills the top-left corner of the block component
+void inverseDCTBlockComponent4x4(int* const component) {
+    const uint pass1Shift = dctAccurateConstBits - dctAccuratePass1Bits;
+    const uint pass2Shift = dctAccurateConstBits + dctAccuratePass1Bits + 3;
+
+    int intermediate[16];
+
+    for (uint i = 0; i < 4; ++i) {
+        // even part
+        const int z0 = component[inverseZigZagMap[0 * 8 + i]];
+        const int z4 = component[inverseZigZagMap[2 * 8 + i]];
+        const int tmp10 = (z0 + z4) * (1 << dctAccuratePass1Bits);
+        const int tmp12 = (z0 - z4) * (1 << dctAccuratePass1Bits);
+
+        // odd part, same rotation as the even part of the 8x8 IDCT
+        const int z2 = component[inverseZigZagMap[1 * 8 + i]];
+        const int z3 = component[inverseZigZagMap[3 * 8 + i]];
+        const int z1 = (z2 + z3) * FIX_0_541196100;
+        const int tmp0 = descale(z1 + z2 * FIX_0_765366865, pass1Shift);
+        const int tmp2 = descale(z1 - z3 * FIX_1_847759065, pass1Shift);
+
+        intermediate[0 * 4 + i] = tmp10 + tmp0;
+        intermediate[3 * 4 + i] = tmp10 - tmp0;
+        intermediate[1 * 4 + i] = tmp12 + tmp2;
+        intermediate[2 * 4 + i] = tmp12 - tmp2;
+    }
+    for (uint i = 0; i < 4; ++i) {
+        const int* const row = intermediate + i * 4;
+
+        // even part
+        const int tmp10 = (row[0] + row[2]) * (1 << dctAccurateConstBits);
+        const int tmp12 = (row[0] - row[2]) * (1 << dctAccurateConstBits);
+
+        // odd part
+        const int z1 = (row[1] + row[3]) * FIX_0_541196100;
+        const int tmp0 = z1 + row[1] * FIX_0_765366865;
+        const int tmp2 = z1 - row[3] * FIX_1_847759065;
+
+        component[i * 8 + 0] = descale(tmp10 + tmp0, pass2Shift);
+        component[i * 8 + 3] = descale(tmp10 - tmp0, pass2Shift);
+        component[i * 8 + 1] = descale(tmp12 + tmp2, pass2Shift);
+        component[i * 8 + 2] = descale(tmp12 - tmp2, pass2Shift);
+    }
+}
+
+// perform 2-D 2x2 IDCT on the low frequency 2x2 coefficients of a block component
+//   whose output fills the top-left corner of the block component
+void inverseDCTBlockComponent2x2(int* const component) {
+    // columns, the 2x2 coefficients are the first 5 in zigzag order
+    const int tmp0 = component[0] + component[2];
+    const int tmp2 = component[0] - component[2];
+    const int tmp1 = component[1] + component[4];
+    const int tmp3 = component[1] - component[4];
+
+    // rows
+    component[0 * 8 + 0] = descale(tmp0 + tmp1, 3);
+    component[0 * 8 + 1] = descale(tmp0 - tmp1, 3);
+    component[1 * 8 + 0] = descale(tmp2 + tmp3, 3);
+    component[1 * 8 + 1] = descale(tmp2 - tmp3, 3);
+}
+
+// a 1x1 IDCT is simply the DC coefficient, scaled down
+void inverseDCTBlockComponent1x1(int* const component) {
+    component[0] = descale(component[0], 3);
+}
+
+// perform IDCT on all MCUs in block rows [top, bottom)
+//   blocks points to the storage of block row top
+void inverseDCT(const JPGImage* const image, Block* const blocks, const uint top, const uint bottom) {
+    void (*inverseDCTBlockComponent)(int* const) = inverseDCTBlockComponentFloat;
+    if (image->scale == 2) {
+        inverseDCTBlockComponent = inverseDCTBlockComponent4x4;
+    }
+    else if (image->scale == 4) {
+        inverseDCTBlockComponent = inverseDCTBlockComponent2x2;
+    }
+    else if (image->scale == 8) {
+        inverseDCTBlockComponent = inverseDCTBlockComponent1x1;
+    }
+    else if (image->dctMethod == DCT_FAST) {
+        inverseDCTBlockComponent = inverseDCTBlockComponentFast;
+    }
+    else if (image->dctMethod == DCT_ACCURATE) {
+        inverseDCTBlockComponent = inverseDCTBlockComponentAccurate;
+    }
+
+    const uint first = std::max(top, image->cropBlockTop);
+    const uint last = std::min(bottom, image->cropBlockBottom);
+    for (uint y = first; y < last; y += image->verticalSamplingFactor) {
+        for (uint x = image->cropBlockLeft; x < image->cropBlockRight; x += image->horizontalSamplingFactor) {
+            for (uint i = 0; i < decodedComponents(image); ++i) {
+                const ColorComponent& component = image->colorComponents[i];
+                for (uint v = 0; v < component.verticalSamplingFactor; ++v) {
+                    for (uint h = 0; h < component.horizontalSamplingFactor; ++h) {
+                        inverseDCTBlockComponent(blocks[(y - top + v) * image->blockWidthReal + (x + h)][i]);
                     }
                 }
             }
@@ -1297,160 +2931,985 @@ void inverseDCT(const JPGImage* const image) {
     }
 }
 
-// convert all pixels in a block from YCbCr color space to RGB
-void YCbCrToRGBBlock(Block& yBlock, const Block& cbcrBlock, const uint vSamp, const uint hSamp, const uint v, const uint h) {
-    for (uint y = 7; y < 8; --y) {
-        for (uint x = 7; x < 8; --x) {
-            const uint pixel = y * 8 + x;
-            const uint cbcrPixelRow = y / vSamp + 4 * v;
-            const uint cbcrPixelColumn = x / hSamp + 4 * h;
-            const uint cbcrPixel = cbcrPixelRow * 8 + cbcrPixelColumn;
-            int r = yBlock.y[pixel]                                    + 1.402f * cbcrBlock.cr[cbcrPixel] + 128;
-            int g = yBlock.y[pixel] - 0.344f * cbcrBlock.cb[cbcrPixel] - 0.714f * cbcrBlock.cr[cbcrPixel] + 128;
-            int b = yBlock.y[pixel] + 1.772f * cbcrBlock.cb[cbcrPixel]                                    + 128;
-            if (r < 0)   r = 0;
-            if (r > 255) r = 255;
-            if (g < 0)   g = 0;
-            if (g > 255) g = 255;
-            if (b < 0)   b = 0;
-            if (b > 255) b = 255;
-            yBlock.r[pixel] = r;
-            yBlock.g[pixel] = g;
-            yBlock.b[pixel] = b;
-        }
-    }
-}
-
-// convert all pixels from YCbCr color space to RGB
-void YCbCrToRGB(const JPGImage* const image) {
-    const uint vSamp = image->verticalSamplingFactor;
-    const uint hSamp = image->horizontalSamplingFactor;
-    for (uint y = 0; y < image->blockHeight; y += vSamp) {
-        for (uint x = 0; x < image->blockWidth; x += hSamp) {
-            const Block& cbcrBlock = image->blocks[y * image->blockWidthReal + x];
-            for (uint v = vSamp - 1; v < vSamp; --v) {
-                for (uint h = hSamp - 1; h < hSamp; --h) {
-                    Block& yBlock = image->blocks[(y + v) * image->blockWidthReal + (x + h)];
-                    YCbCrToRGBBlock(yBlock, cbcrBlock, vSamp, hSamp, v, h);
+// perform IDCT on all MCUs
+void inverseDCT(const JPGImage* const image) {
+    inverseDCT(image, image->blocks, 0, image->blockHeightReal);
+}
+
+// perform a direct 2-D IDCT in double precision on a block component
+//   whose coefficients are in zigzag order
+//   used as the reference when measuring the accuracy of the other methods
+void inverseDCTBlockComponentReference(int* const component) {
+    // filled in once, even when several threads get here at the same time
+    static const struct Cosines {
+        double values[8][8];
+        Cosines() {
+            for (uint x = 0; x < 8; ++x) {
+                for (uint u = 0; u < 8; ++u) {
+                    const double scale = (u == 0) ? (1.0 / std::sqrt(2.0)) : 1.0;
+                    values[x][u] = scale * std::cos((2.0 * x + 1.0) * u * M_PI / 16.0) / 2.0;
                 }
             }
         }
+    } cosines;
+
+    double intermediate[64];
+    for (uint v = 0; v < 8; ++v) {
+        for (uint x = 0; x < 8; ++x) {
+            double sum = 0.0;
+            for (uint u = 0; u < 8; ++u) {
+                sum += cosines.values[x][u] * component[inverseZigZagMap[v * 8 + u]];
+            }
+            intermediate[v * 8 + x] = sum;
+        }
+    }
+    for (uint y = 0; y < 8; ++y) {
+        for (uint x = 0; x < 8; ++x) {
+            double sum = 0.0;
+            for (uint v = 0; v < 8; ++v) {
+                sum += cosines.values[y][v] * intermediate[v * 8 + x];
+            }
+            component[y * 8 + x] = (int)std::floor(sum + 0.5);
+        }
+    }
+}
+
+// peak signal-to-noise ratio between two sets of decoded samples
+//   samples are clamped to their displayable range first
+double samplePSNR(const JPGImage* const image, const Block* const a, const Block* const b) {
+    const uint numBlocks = image->blockHeightReal * image->blockWidthReal;
+    double squaredError = 0.0;
+    for (uint i = 0; i < numBlocks; ++i) {
+        for (uint j = 0; j < image->numComponents; ++j) {
+            const int* const componentA = a[i][j];
+            const int* const componentB = b[i][j];
+            for (uint k = 0; k < 64; ++k) {
+                const int sampleA = std::min(std::max(componentA[k], -128), 127);
+                const int sampleB = std::min(std::max(componentB[k], -128), 127);
+                squaredError += (sampleA - sampleB) * (sampleA - sampleB);
+            }
+        }
+    }
+    const double mse = squaredError / (numBlocks * image->numComponents * 64.0);
+    if (mse == 0.0) {
+        return INFINITY;
+    }
+    return 10.0 * std::log10(255.0 * 255.0 / mse);
+}
+
+// time dequantization and IDCT with every DCT method and measure
+//   the accuracy of each against a double precision IDCT
+void benchmarkDCT(JPGImage* const image) {
+    const uint numBlocks = image->blockHeightReal * image->blockWidthReal;
+    Block* const coefficients = image->blocks;
+    Block* const reference = new (std::nothrow) Block[numBlocks];
+    Block* const output = new (std::nothrow) Block[numBlocks];
+    if (reference == nullptr || output == nullptr) {
+        std::cout << "Error - Memory error\n";
+        delete[] reference;
+        delete[] output;
+        return;
+    }
+
+    const DCTMethod dctMethod = image->dctMethod;
+
+    std::copy(coefficients, coefficients + numBlocks, reference);
+    image->blocks = reference;
+    image->dctMethod = DCT_FLOAT;
+    dequantize(image);
+    for (uint i = 0; i < numBlocks; ++i) {
+        for (uint j = 0; j < image->numComponents; ++j) {
+            inverseDCTBlockComponentReference(reference[i][j]);
+        }
+    }
+
+    const uint iterations = 5;
+    const DCTMethod methods[] = { DCT_FAST, DCT_ACCURATE, DCT_FLOAT };
+    const char* const names[] = { "fast", "accurate", "float" };
+
+    std::cout << "DCT benchmark (dequantize + IDCT, best of " << iterations << " runs)\n";
+    for (uint m = 0; m < 3; ++m) {
+        image->blocks = output;
+        image->dctMethod = methods[m];
+        double best = INFINITY;
+        for (uint i = 0; i < iterations; ++i) {
+            std::copy(coefficients, coefficients + numBlocks, output);
+            const auto start = std::chrono::steady_clock::now();
+            dequantize(image);
+            inverseDCT(image);
+            const auto end = std::chrono::steady_clock::now();
+            best = std::min(best, std::chrono::duration<double, std::milli>(end - start).count());
+        }
+        std::cout << names[m] << ":\t" << best << " ms\tPSNR " << samplePSNR(image, output, reference) << " dB\n";
     }
+
+    image->blocks = coefficients;
+    image->dctMethod = dctMethod;
+    delete[] reference;
+    delete[] output;
 }
 
-// helper function to write a 4-byte integer in little-endian
-void putInt(byte*& bufferPos, const uint v) {
-    *bufferPos++ = v >>  0;
-    *bufferPos++ = v >>  8;
-    *bufferPos++ = v >> 16;
-    *bufferPos++ = v >> 24;
+// clamp a color value to the 8-bit sample range
+inline byte clampSample(const int x) {
+    return x < 0 ? 0 : (x > 255 ? 255 : x);
 }
 
-// helper function to write a 2-byte short integer in little-endian
-void putShort(byte*& bufferPos, const uint v) {
-    *bufferPos++ = v >> 0;
-    *bufferPos++ = v >> 8;
+// limit an IDCT output sample to the level shifted range -128..127
+inline int clampCentred(const int x) {
+    return x < -128 ? -128 : (x > 127 ? 127 : x);
 }
 
-// write all the pixels in the MCUs to a BMP file
-void writeBMP(const JPGImage* const image, const std::string& filename) {
-    // open file
-    std::cout << "Writing " << filename << "...\n";
-    std::ofstream outFile(filename, std::ios::out | std::ios::binary);
-    if (!outFile.is_open()) {
-        std::cout << "Error - Error opening output file\n";
+#if defined(__SSE2__)
+// write 16 pixels, given 16 bytes of each channel, in the byte order of a color PixelFormat
+//   the channels are interleaved into 4-byte pixels with unpacks,
+//   and for 3-byte pixels the fourth byte of each is then shifted out
+inline void storePixels(byte* const out, const __m128i r, const __m128i g, const __m128i b,
+                        const uint pixelSize, const bool bgr) {
+    const __m128i alpha = _mm_set1_epi8((pixelSize == 4) ? (char)0xFF : 0);
+    const __m128i lowPairs = _mm_unpacklo_epi8(bgr ? b : r, g);
+    const __m128i highPairs = _mm_unpackhi_epi8(bgr ? b : r, g);
+    const __m128i lowEnds = _mm_unpacklo_epi8(bgr ? r : b, alpha);
+    const __m128i highEnds = _mm_unpackhi_epi8(bgr ? r : b, alpha);
+    __m128i pixels[4] = {
+        _mm_unpacklo_epi16(lowPairs, lowEnds), _mm_unpackhi_epi16(lowPairs, lowEnds),
+        _mm_unpacklo_epi16(highPairs, highEnds), _mm_unpackhi_epi16(highPairs, highEnds)
+    };
+    if (pixelSize == 4) {
+        for (uint i = 0; i < 4; ++i) {
+            _mm_storeu_si128((__m128i*)(out + i * 16), pixels[i]);
+        }
         return;
     }
 
-    const uint paddingSize = image->width % 4;
-    const uint size = 14 + 12 + image->height * image->width * 3 + paddingSize * image->height; // 14 -header1 size 12 header2 size 3 - color comp
+    // close the gaps within each 64-bit lane, then between the two lanes,
+    //   leaving 4 pixels in the low 12 bytes of each vector
+    const __m128i low32 = _mm_set_epi32(0, -1, 0, -1);
+    const __m128i low64 = _mm_set_epi32(0, 0, -1, -1);
+    for (uint i = 0; i < 4; ++i) {
+        const __m128i pairs = _mm_or_si128(_mm_and_si128(pixels[i], low32),
+                                           _mm_srli_epi64(_mm_andnot_si128(low32, pixels[i]), 8));
+        pixels[i] = _mm_or_si128(_mm_and_si128(pairs, low64), _mm_srli_si128(_mm_andnot_si128(low64, pairs), 2));
+    }
+    _mm_storeu_si128((__m128i*)out, _mm_or_si128(pixels[0], _mm_slli_si128(pixels[1], 12)));
+    _mm_storeu_si128((__m128i*)(out + 16), _mm_or_si128(_mm_srli_si128(pixels[1], 4), _mm_slli_si128(pixels[2], 8)));
+    _mm_storeu_si128((__m128i*)(out + 32), _mm_or_si128(_mm_srli_si128(pixels[2], 8), _mm_slli_si128(pixels[3], 4)));
+}
+
+// convert 8 pixels of level shifted YCbCr samples to 16-bit RGB
+//   _mm_madd_epi16 multiplies pairs of lanes and adds each pair into a 32-bit lane,
+//   so cb and cr are paired with each other, or with 1 to add the rounding term
+inline void YCbCrToRGB8(const int16_t* const yRow, const int16_t* const cbRow, const int16_t* const crRow,
+                        __m128i& r, __m128i& g, __m128i& b) {
+    const int half = 1 << (colorConstBits - 1);
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i rounding = _mm_set1_epi32(half);
+    const __m128i crToRLanes = _mm_setr_epi16(
+        FIX_CR_TO_R, half, FIX_CR_TO_R, half, FIX_CR_TO_R, half, FIX_CR_TO_R, half);
+    const __m128i cbcrToGLanes = _mm_setr_epi16(
+        -FIX_CB_TO_G, -FIX_CR_TO_G, -FIX_CB_TO_G, -FIX_CR_TO_G, -FIX_CB_TO_G, -FIX_CR_TO_G, -FIX_CB_TO_G, -FIX_CR_TO_G);
+    const __m128i cbToBLanes = _mm_setr_epi16(
+        FIX_CB_TO_B, half, FIX_CB_TO_B, half, FIX_CB_TO_B, half, FIX_CB_TO_B, half);
+
+    const __m128i y = _mm_adds_epi16(_mm_set1_epi16(128), _mm_loadu_si128((const __m128i*)yRow));
+    const __m128i cb = _mm_loadu_si128((const __m128i*)cbRow);
+    const __m128i cr = _mm_loadu_si128((const __m128i*)crRow);
+
+    const __m128i rLow = _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(cr, one), crToRLanes), colorConstBits);
+    const __m128i rHigh = _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(cr, one), crToRLanes), colorConstBits);
+    const __m128i gLow = _mm_srai_epi32(_mm_add_epi32(
+        _mm_madd_epi16(_mm_unpacklo_epi16(cb, cr), cbcrToGLanes), rounding), colorConstBits);
+    const __m128i gHigh = _mm_srai_epi32(_mm_add_epi32(
+        _mm_madd_epi16(_mm_unpackhi_epi16(cb, cr), cbcrToGLanes), rounding), colorConstBits);
+    const __m128i bLow = _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(cb, one), cbToBLanes), colorConstBits);
+    const __m128i bHigh = _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(cb, one), cbToBLanes), colorConstBits);
+
+    r = _mm_adds_epi16(y, _mm_packs_epi32(rLow, rHigh));
+    g = _mm_adds_epi16(y, _mm_packs_epi32(gLow, gHigh));
+    b = _mm_adds_epi16(y, _mm_packs_epi32(bLow, bHigh));
+}
+#endif
+
+// convert a row of YCbCr samples to packed 8-bit pixels of any color PixelFormat
+//   the samples are level shifted, so within -128..127
+//   the SIMD path multiplies, 16 pixels at a time, the scalar path uses the tables from jpg.h,
+//   and both give identical results
+void YCbCrToRGBRow(const int16_t* const yRow, const int16_t* const cbRow, const int16_t* const crRow,
+                   const uint width, byte* const out, const PixelFormat format) {
+    const bool bgr = format == PIXEL_BGR || format == PIXEL_BGRA;
+    const uint rOffset = bgr ? 2 : 0;
+    const uint bOffset = bgr ? 0 : 2;
+    const uint pixelSize = pixelSizes[format];
+    uint x = 0;
+#if defined(__SSE2__)
+    for (; x + 16 <= width; x += 16) {
+        __m128i r[2];
+        __m128i g[2];
+        __m128i b[2];
+        YCbCrToRGB8(yRow + x, cbRow + x, crRow + x, r[0], g[0], b[0]);
+        YCbCrToRGB8(yRow + x + 8, cbRow + x + 8, crRow + x + 8, r[1], g[1], b[1]);
+        // saturating packs clamp to 0..255
+        storePixels(out + x * pixelSize, _mm_packus_epi16(r[0], r[1]), _mm_packus_epi16(g[0], g[1]),
+                    _mm_packus_epi16(b[0], b[1]), pixelSize, bgr);
+    }
+#endif
+    for (; x < width; ++x) {
+        const int y = yRow[x] + 128;
+        const uint cb = cbRow[x] + 128;
+        const uint cr = crRow[x] + 128;
+        byte* const outPos = out + x * pixelSize;
+        outPos[rOffset] = clampSample(y + crToR[cr]);
+        outPos[1] = clampSample(y + ((cbToG[cb] + crToG[cr]) >> colorConstBits));
+        outPos[bOffset] = clampSample(y + cbToB[cb]);
+        if (pixelSize == 4) {
+            outPos[3] = 255;
+        }
+    }
+}
+
+// convert a row of level shifted luma samples to 8-bit gray, or to pixels of a color PixelFormat
+void lumaToRow(const int16_t* const yRow, const uint width, byte* const out, const PixelFormat format) {
+    const uint pixelSize = pixelSizes[format];
+    uint x = 0;
+#if defined(__SSE2__)
+    const __m128i centre = _mm_set1_epi16(128);
+    for (; x + 16 <= width; x += 16) {
+        const __m128i gray = _mm_packus_epi16(
+            _mm_adds_epi16(centre, _mm_loadu_si128((const __m128i*)(yRow + x))),
+            _mm_adds_epi16(centre, _mm_loadu_si128((const __m128i*)(yRow + x + 8))));
+        if (pixelSize == 1) {
+            _mm_storeu_si128((__m128i*)(out + x), gray);
+        }
+        else {
+            storePixels(out + x * pixelSize, gray, gray, gray, pixelSize, false);
+        }
+    }
+#endif
+    for (; x < width; ++x) {
+        byte* const outPos = out + x * pixelSize;
+        for (uint i = 0; i < std::min(pixelSize, 3u); ++i) {
+            outPos[i] = yRow[x] + 128;
+        }
+        if (pixelSize == 4) {
+            outPos[3] = 255;
+        }
+    }
+}
+
+// the output pixels after cropping and scaling, in scaled pixel units
+Region outputRegion(const JPGImage* const image) {
+    Region region;
+    region.y = image->crop.y / image->scale;
+    region.x = image->crop.x / image->scale;
+    region.height = (image->crop.y + image->crop.height + image->scale - 1) / image->scale - region.y;
+    region.width = (image->crop.x + image->crop.width + image->scale - 1) / image->scale - region.x;
+    return region;
+}
+
+// produces rows of output pixels straight from the IDCT output
+//   each row of samples is first copied out of the blocks it crosses into a contiguous row,
+//   8 samples per load where the blocks are not scaled, then chroma is upsampled a vector at a time
+//   and converted and interleaved with the luma into the output
+//   block row r is read from blocks + (r % windowRows) * blockWidthReal,
+//   so a rolling window of MCU rows can be used instead of the whole image
+class ColorConverter {
+private:
+    const JPGImage* const image;
+    const Block* const blocks;
+    const uint windowRows;
+    const Region region;
+    const uint vSamp;
+    const uint hSamp;
+    uint blockShift = 3; // log2 of the scaled block size
+
+    // chroma samples that may be read, inclusive
+    //   beyond these the edge samples are repeated
+    int chromaTop = 0;
+    int chromaBottom = 0;
+    int chromaLeft = 0;
+    int chromaRight = 0;
+
+    // the chroma columns the output region covers, inclusive
+    uint chromaFirst = 0;
+    uint chromaLast = 0;
+    // the chroma column held by index 0 of the chroma rows,
+    //   which start one column before the first block they need, for the repeated left edge
+    int chromaBase = 0;
+
+    // rows of clamped samples copied out of the blocks
+    //   luma from the left edge of the block holding region.x,
+    //   chroma from chromaBase, and its upsampled rows from column chromaFirst * hSamp
+    std::vector<int16_t> yRow;
+    std::vector<int16_t> nearerRows[2];
+    std::vector<int16_t> fartherRows[2];
+    std::vector<int16_t> upsampledRows[2];
+
+    const Block& blockAt(const uint blockRow, const uint blockColumn) const {
+        return blocks[(blockRow % windowRows) * image->blockWidthReal + blockColumn];
+    }
+
+    uint clampChromaRow(const int y) const {
+        return std::min(std::max(y, chromaTop), chromaBottom);
+    }
+
+    uint clampChromaColumn(const int x) const {
+        return std::min(std::max(x, chromaLeft), chromaRight);
+    }
+
+    // copy row y of a component's samples in the blocks firstColumn to lastColumn,
+    //   in that component's block units, clamped to -128..127
+    //   the chroma of an MCU is stored in its top-left block
+    void gatherRow(const uint component, const uint y, const uint firstColumn, const uint lastColumn,
+                   int16_t* out) const {
+        const uint blockSize = 1 << blockShift;
+        const uint blockRow = (y >> blockShift) * ((component == 0) ? 1 : vSamp);
+        const uint columnStep = (component == 0) ? 1 : hSamp;
+        const uint offset = (y & (blockSize - 1)) * 8;
+        for (uint column = firstColumn; column <= lastColumn; ++column, out += blockSize) {
+            const int* const samples = blockAt(blockRow, column * columnStep)[component] + offset;
+#if defined(__SSE2__)
+            if (blockSize == 8) {
+                const __m128i packed = _mm_packs_epi32(_mm_loadu_si128((const __m128i*)samples),
+                                                       _mm_loadu_si128((const __m128i*)(samples + 4)));
+                _mm_storeu_si128((__m128i*)out,
+                                 _mm_min_epi16(_mm_max_epi16(packed, _mm_set1_epi16(-128)), _mm_set1_epi16(127)));
+                continue;
+            }
+#endif
+            for (uint i = 0; i < blockSize; ++i) {
+                out[i] = clampCentred(samples[i]);
+            }
+        }
+    }
+
+    // the luma of row y, starting at region.x
+    const int16_t* readLuma(const uint y) {
+        gatherRow(0, y, region.x >> blockShift, (region.x + region.width - 1) >> blockShift, yRow.data());
+        return yRow.data() + (region.x & ((1 << blockShift) - 1));
+    }
+
+    // the chroma of row chromaY, from one column before the region to one after it, repeating the edges
+    void readChroma(const uint chromaY, std::vector<int16_t> (&rows)[2]) {
+        const uint first = clampChromaColumn((int)chromaFirst - 1);
+        const uint last = clampChromaColumn(chromaLast + 1);
+        for (uint i = 0; i < 2; ++i) {
+            int16_t* const row = rows[i].data();
+            gatherRow(i + 1, chromaY, first >> blockShift, last >> blockShift, row + 1);
+            row[chromaFirst - 1 - chromaBase] = row[first - chromaBase];
+            row[chromaLast + 1 - chromaBase] = row[last - chromaBase];
+        }
+    }
+
+    // replicate each chroma sample over the pixels it covers
+    void upsampleNearest() {
+        const uint count = chromaLast - chromaFirst + 1;
+        for (uint i = 0; i < 2; ++i) {
+            const int16_t* const nearer = nearerRows[i].data() + (chromaFirst - chromaBase);
+            int16_t* const out = upsampledRows[i].data();
+            uint x = 0;
+#if defined(__SSE2__)
+            for (; x + 8 <= count; x += 8) {
+                const __m128i samples = _mm_loadu_si128((const __m128i*)(nearer + x));
+                _mm_storeu_si128((__m128i*)(out + x * 2), _mm_unpacklo_epi16(samples, samples));
+                _mm_storeu_si128((__m128i*)(out + x * 2 + 8), _mm_unpackhi_epi16(samples, samples));
+            }
+#endif
+            for (; x < count; ++x) {
+                out[x * 2] = nearer[x];
+                out[x * 2 + 1] = nearer[x];
+            }
+        }
+    }
+
+    // triangular upsampling as in libjpeg
+    //   each output sample is 3/4 of the nearest chroma sample and 1/4 of the next nearest,
+    //   in each subsampled direction
+    //   the vertical sums, 3 * nearer + farther, are 4 times the chroma samples
+    void upsampleFancy(const bool upper) {
+        const uint count = chromaLast - chromaFirst + 1;
+        const std::vector<int16_t> (&farthers)[2] = (vSamp == 2) ? fartherRows : nearerRows;
+        const int leftBias = (vSamp == 2) ? 8 : 4;
+        const int rightBias = (vSamp == 2) ? 7 : 8;
+        const int verticalBias = upper ? 1 : 2;
+        for (uint i = 0; i < 2; ++i) {
+            const int16_t* const nearer = nearerRows[i].data() + (chromaFirst - chromaBase);
+            const int16_t* const farther = farthers[i].data() + (chromaFirst - chromaBase);
+            int16_t* const out = upsampledRows[i].data();
+            uint x = 0;
+#if defined(__SSE2__)
+            const auto sums = [&](const int offset) {
+                const __m128i nearerSamples = _mm_loadu_si128((const __m128i*)(&nearer[x] + offset));
+                const __m128i fartherSamples = _mm_loadu_si128((const __m128i*)(&farther[x] + offset));
+                return _mm_add_epi16(_mm_add_epi16(nearerSamples, _mm_add_epi16(nearerSamples, nearerSamples)),
+                                     fartherSamples);
+            };
+            if (hSamp == 2) {
+                for (; x + 8 <= count; x += 8) {
+                    const __m128i centre = sums(0);
+                    const __m128i triple = _mm_add_epi16(centre, _mm_add_epi16(centre, centre));
+                    const __m128i left = _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(triple, sums(-1)),
+                                                                      _mm_set1_epi16(leftBias)), 4);
+                    const __m128i right = _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(triple, sums(1)),
+                                                                       _mm_set1_epi16(rightBias)), 4);
+                    _mm_storeu_si128((__m128i*)(out + x * 2), _mm_unpacklo_epi16(left, right));
+                    _mm_storeu_si128((__m128i*)(out + x * 2 + 8), _mm_unpackhi_epi16(left, right));
+                }
+            }
+            else {
+                for (; x + 8 <= count; x += 8) {
+                    _mm_storeu_si128((__m128i*)(out + x),
+                                     _mm_srai_epi16(_mm_add_epi16(sums(0), _mm_set1_epi16(verticalBias)), 2));
+                }
+            }
+#endif
+            for (; x < count; ++x) {
+                const int16_t* const nearerSample = nearer + x;
+                const int16_t* const fartherSample = farther + x;
+                const int centre = 3 * nearerSample[0] + fartherSample[0];
+                if (hSamp == 2) {
+                    out[x * 2] = (3 * centre + 3 * nearerSample[-1] + fartherSample[-1] + leftBias) >> 4;
+                    out[x * 2 + 1] = (3 * centre + 3 * nearerSample[1] + fartherSample[1] + rightBias) >> 4;
+                }
+                else {
+                    out[x] = (centre + verticalBias) >> 2;
+                }
+            }
+        }
+    }
 
-    byte* buffer = new (std::nothrow) byte[size];
-    if (buffer == nullptr) {
+public:
+    ColorConverter(const JPGImage* const jpgImage, const Block* const blockWindow, const uint rows) :
+    image(jpgImage),
+    blocks(blockWindow),
+    windowRows(rows),
+    region(outputRegion(jpgImage)),
+    vSamp(jpgImage->verticalSamplingFactor),
+    hSamp(jpgImage->horizontalSamplingFactor)
+    {
+        for (uint scale = image->scale; scale > 1; scale >>= 1) {
+            --blockShift;
+        }
+        const uint scaledHeight = (image->height + image->scale - 1) / image->scale;
+        const uint scaledWidth = (image->width + image->scale - 1) / image->scale;
+        chromaTop = (image->cropBlockTop << blockShift) / vSamp;
+        chromaLeft = (image->cropBlockLeft << blockShift) / hSamp;
+        chromaBottom = std::min((image->cropBlockBottom << blockShift) / vSamp, (scaledHeight + vSamp - 1) / vSamp) - 1;
+        chromaRight = std::min((image->cropBlockRight << blockShift) / hSamp, (scaledWidth + hSamp - 1) / hSamp) - 1;
+        chromaFirst = region.x / hSamp;
+        chromaLast = (region.x + region.width - 1) / hSamp;
+        chromaBase = (int)((clampChromaColumn((int)chromaFirst - 1) >> blockShift) << blockShift) - 1;
+
+        // room for whole blocks at either end, and the repeated edges
+        yRow.resize(region.width + 16);
+        const std::size_t chromaSize = chromaLast - chromaBase + 16;
+        for (uint i = 0; i < 2; ++i) {
+            nearerRows[i].resize(chromaSize);
+            fartherRows[i].resize(chromaSize);
+            upsampledRows[i].resize(region.width + 16);
+        }
+    }
+
+    // convert pixel row y, in scaled pixels, to packed pixels
+    void convertRow(const uint y, byte* const out, const PixelFormat format) {
+        const int16_t* const luma = readLuma(y);
+        // luma needs no conversion
+        if (format == PIXEL_GRAY || decodedComponents(image) == 1) {
+            lumaToRow(luma, region.width, out, format);
+            return;
+        }
+
+        const uint chromaY = y / vSamp;
+        readChroma(chromaY, nearerRows);
+        const int16_t* cb = nearerRows[0].data() + (chromaFirst - chromaBase);
+        const int16_t* cr = nearerRows[1].data() + (chromaFirst - chromaBase);
+        if (vSamp == 2 || hSamp == 2) {
+            if (image->upsampling == UPSAMPLE_FANCY) {
+                const bool upper = y % vSamp == 0;
+                if (vSamp == 2) {
+                    readChroma(clampChromaRow(upper ? (int)chromaY - 1 : chromaY + 1), fartherRows);
+                }
+                upsampleFancy(upper);
+                cb = upsampledRows[0].data() + (region.x - chromaFirst * hSamp);
+                cr = upsampledRows[1].data() + (region.x - chromaFirst * hSamp);
+            }
+            else if (hSamp == 2) {
+                upsampleNearest();
+                cb = upsampledRows[0].data() + (region.x - chromaFirst * hSamp);
+                cr = upsampledRows[1].data() + (region.x - chromaFirst * hSamp);
+            }
+        }
+        YCbCrToRGBRow(luma, cb, cr, region.width, out, format);
+    }
+};
+
+// convert the output rows of pixels in [first, last) and pass them to the sink
+//   rows are in scaled pixel units and are limited to the output region
+bool emitScanlines(const JPGImage* const image, ColorConverter& converter, const uint first, const uint last,
+                   ScanlineSink& sink, byte* const line) {
+    const Region region = outputRegion(image);
+    const uint top = std::max(first, region.y);
+    const uint bottom = std::min(last, region.y + region.height);
+    for (uint y = top; y < bottom; ++y) {
+        converter.convertRow(y, line, sink.pixelFormat());
+        if (!sink.writeScanline(y - region.y, line)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// decode the rest of a JPG whose header has been read
+//   and pass its pixels to the sink one row at a time
+//   baseline JPGs are decoded one MCU row at a time, from entropy decoding
+//   to color conversion, so only one MCU row of blocks is ever held in memory
+//   progressive JPGs need all their scans first, so they are fully decoded
+//   before any rows are passed on
+bool readJPGScanlines(BitReader& bitReader, JPGImage& image, ScanlineSink& sink, BlockBuffer& buffer) {
+    const Region region = outputRegion(&image);
+    const uint blockSize = 8 / image.scale;
+    if (!sink.begin(region.width, region.height, decodedComponents(&image) == 1)) {
+        return false;
+    }
+    byte* const line = new (std::nothrow) byte[region.width * pixelSizes[sink.pixelFormat()]];
+    if (line == nullptr) {
         std::cout << "Error - Memory error\n";
-        outFile.close();
-        return;
+        return false;
     }
-    byte* bufferPos = buffer;
-
-    // header
-    *bufferPos++ = 'B';
-    *bufferPos++ = 'M';
-    putInt(bufferPos, size);
-    putInt(bufferPos, 0);
-    putInt(bufferPos, 0x1A);
-    putInt(bufferPos, 12);
-    putShort(bufferPos, image->width);
-    putShort(bufferPos, image->height);
-    putShort(bufferPos, 1);
-    putShort(bufferPos, 24);
-
-    for (uint y = image->height - 1; y < image->height; --y) {
-        const uint blockRow = y / 8;
-        const uint pixelRow = y % 8;
-        for (uint x = 0; x < image->width; ++x) {
-            const uint blockColumn = x / 8;
-            const uint pixelColumn = x % 8;
-            const uint blockIndex = blockRow * image->blockWidthReal + blockColumn;
-            const uint pixelIndex = pixelRow * 8 + pixelColumn;
-            *bufferPos++ = image->blocks[blockIndex].b[pixelIndex];
-            *bufferPos++ = image->blocks[blockIndex].g[pixelIndex];
-            *bufferPos++ = image->blocks[blockIndex].r[pixelIndex];
-        }
-        for (uint i = 0; i < paddingSize; ++i) {
-            *bufferPos++ = 0;
-        }
-    }
-
-    outFile.write((char*)buffer, size);
-    outFile.close();
-    delete[] buffer;
-}
-
-int main(int argc, char** argv) {
-    // validate arguments
-    if (argc < 2) {
-        std::cout << "Error - Invalid arguments\n";
-        return 1;
+
+    if (image.frameType != SOF0) {
+        image.blocks = buffer.get(image.blockHeightReal * image.blockWidthReal);
+        if (image.blocks == nullptr) {
+            std::cout << "Error - Memory error\n";
+            delete[] line;
+            return false;
+        }
+        readScans(bitReader, &image, nullptr);
+        if (image.valid) {
+            dequantize(&image);
+            inverseDCT(&image);
+            ColorConverter converter(&image, image.blocks, image.blockHeightReal);
+            image.valid = emitScanlines(&image, converter, 0, image.blockHeightReal * blockSize, sink, line);
+        }
+        delete[] line;
+        return image.valid;
     }
 
-    for (int i = 1; i < argc; ++i) {
-        const std::string filename(argv[i]);
+    // fancy upsampling of the bottom pixel row of an MCU row
+    //   needs the top chroma row of the next MCU row,
+    //   so that pixel row is held back and two MCU rows are kept
+    const uint mcuHeight = image.verticalSamplingFactor;
+    const bool holdBackRow = image.upsampling == UPSAMPLE_FANCY && decodedComponents(&image) == 3 && mcuHeight == 2;
+    const uint windowRows = holdBackRow ? 2 * mcuHeight : mcuHeight;
+    const uint rowSize = mcuHeight * image.blockWidthReal;
+    Block* const blocks = buffer.get(windowRows * image.blockWidthReal);
+    if (blocks == nullptr) {
+        std::cout << "Error - Memory error\n";
+        delete[] line;
+        return false;
+    }
+    ColorConverter converter(&image, blocks, windowRows);
+
+    readStartOfScan(bitReader, &image);
+    printScanInfo(&image);
+
+    EntropySegment segment;
+    bitReader.readEntropySegment(segment);
+    EntropyReader reader(segment);
+
+    ScanState state = startScan(&image);
+    uint nextRow = 0;
+    for (uint y = 0; y < image.blockHeight && image.valid; y += mcuHeight) {
+        Block* const mcuRow = blocks + (y % windowRows) * image.blockWidthReal;
+        std::fill(mcuRow, mcuRow + rowSize, Block());
+        for (uint v = 0; v < mcuHeight && y + v < image.blockHeight; v += state.yStep) {
+            if (!decodeMCURow(reader, &image, state, y + v, mcuRow + v * image.blockWidthReal)) {
+                image.valid = false;
+                break;
+            }
+        }
+        if (!image.valid) {
+            break;
+        }
+        dequantize(&image, mcuRow, y, y + mcuHeight);
+        inverseDCT(&image, mcuRow, y, y + mcuHeight);
 
-        // read image
-        JPGImage* image = readJPG(filename);
-        // validate image
-        if (image == nullptr) {
-            continue;
+        const bool lastMCURow = y + mcuHeight >= image.blockHeight;
+        const uint endRow = (y + mcuHeight) * blockSize - ((holdBackRow && !lastMCURow) ? 1 : 0);
+        image.valid = emitScanlines(&image, converter, nextRow, endRow, sink, line);
+        nextRow = endRow;
+    }
+
+    delete[] line;
+    return image.valid;
+}
+
+// write the decoded pixels of the output region straight into a caller's buffer
+//   rows start stride bytes apart, a negative stride stores the rows bottom-up
+void writePixels(const JPGImage* const image, byte* const destination, const int stride, const PixelFormat format) {
+    const Region region = outputRegion(image);
+    ColorConverter converter(image, image->blocks, image->blockHeightReal);
+    for (uint y = 0; y < region.height; ++y) {
+        converter.convertRow(region.y + y, destination + (std::ptrdiff_t)y * stride, format);
+    }
+}
+
+// the samples of one component that cover the output region,
+//   in units of that component's own, possibly subsampled, resolution
+Region planeRegion(const JPGImage* const image, const uint component) {
+    Region region = outputRegion(image);
+    if (component != 0) {
+        const uint vSamp = image->verticalSamplingFactor;
+        const uint hSamp = image->horizontalSamplingFactor;
+        region.height = (region.y + region.height + vSamp - 1) / vSamp - region.y / vSamp;
+        region.width = (region.x + region.width + hSamp - 1) / hSamp - region.x / hSamp;
+        region.y /= vSamp;
+        region.x /= hSamp;
+    }
+    return region;
+}
+
+// write one component of the output region straight from the IDCT output
+//   into a caller's plane of 8-bit samples, without any color conversion or upsampling
+//   rows start stride bytes apart
+void writePlane(const JPGImage* const image, const uint component, byte* const destination, const int stride) {
+    const Region region = planeRegion(image, component);
+    // the chroma of an MCU is stored in its top-left block
+    const uint vSamp = (component == 0) ? 1 : image->verticalSamplingFactor;
+    const uint hSamp = (component == 0) ? 1 : image->horizontalSamplingFactor;
+    uint blockShift = 3;
+    for (uint scale = image->scale; scale > 1; scale >>= 1) {
+        --blockShift;
+    }
+    const uint mask = (1 << blockShift) - 1;
+
+    for (uint i = 0; i < region.height; ++i) {
+        const uint y = region.y + i;
+        const Block* const blockRow = image->blocks + (y >> blockShift) * vSamp * image->blockWidthReal;
+        byte* const out = destination + (std::ptrdiff_t)i * stride;
+        for (uint j = 0; j < region.width; ++j) {
+            const uint x = region.x + j;
+            const Block& block = blockRow[(x >> blockShift) * hSamp];
+            out[j] = clampCentred(block[component][(y & mask) * 8 + (x & mask)]) + 128;
         }
-        if (image->blocks == nullptr) {
-            delete image;
-            continue;
+    }
+}
+
+
+// fill in the layout of the decoded output from the frame header
+void getImageInfo(const JPGImage* const image, ImageInfo& info) {
+    const Region region = outputRegion(image);
+    info = ImageInfo();
+    info.width = region.width;
+    info.height = region.height;
+    info.frameWidth = image->width;
+    info.frameHeight = image->height;
+    info.frameType = image->frameType;
+    info.frameComponents = image->numComponents;
+    info.restartInterval = image->restartInterval;
+    info.numScans = image->numScans;
+    info.numComponents = decodedComponents(image);
+    info.horizontalSamplingFactor = image->horizontalSamplingFactor;
+    info.verticalSamplingFactor = image->verticalSamplingFactor;
+    for (uint i = 0; i < info.numComponents; ++i) {
+        const Region plane = planeRegion(image, i);
+        info.planeWidths[i] = plane.width;
+        info.planeHeights[i] = plane.height;
+    }
+}
+
+// check that the caller's memory was allocated for the layout being decoded
+bool matchesLayout(const ImageInfo& actual, const ImageInfo& expected) {
+    if (actual.width != expected.width || actual.height != expected.height ||
+        actual.numComponents != expected.numComponents) {
+        std::cout << "Error - Output layout does not match the image\n";
+        return false;
+    }
+    for (uint i = 0; i < actual.numComponents; ++i) {
+        if (actual.planeWidths[i] != expected.planeWidths[i] || actual.planeHeights[i] != expected.planeHeights[i]) {
+            std::cout << "Error - Output layout does not match the image\n";
+            return false;
         }
-        if (image->valid == false) {
-            delete[] image->blocks;
-            delete image;
-            continue;
+    }
+    return true;
+}
+
+// reconstruct the MCU rows of a baseline image as its scan is entropy decoded
+//   and write packed pixels of the output region into the caller's memory
+//   the calling thread entropy decodes while up to image->threads - 1 others
+//   dequantize, transform and color convert each MCU row as soon as it is decoded,
+//   then takes the rows still left itself
+//   task r transforms MCU row r and then converts the pixels of MCU row r - 1,
+//   whose chroma may be upsampled from the rows on either side,
+//   so a task only ever waits for rows handed out before it
+bool decodeToPixelsPipelined(BitReader& bitReader, JPGImage* const image, BlockBuffer& buffer,
+                             const PixelFormat format, byte* const pixels, const int stride) {
+    const Region region = outputRegion(image);
+    const uint mcuHeight = image->verticalSamplingFactor;
+    const uint mcuRows = image->blockHeightReal / mcuHeight;
+    const uint pixelRowsPerMCU = mcuHeight * 8 / image->scale;
+    DecodeProgress progress(mcuRows);
+
+    auto work = [&]() {
+        ColorConverter converter(image, image->blocks, image->blockHeightReal);
+        uint task = 0;
+        while (progress.nextTaskOf(mcuRows + 1, task)) {
+            if (task < mcuRows) {
+                const uint top = task * mcuHeight;
+                if (!progress.waitDecoded(std::min(top + mcuHeight, image->blockHeight))) {
+                    return;
+                }
+                Block* const mcuRow = image->blocks + top * image->blockWidthReal;
+                dequantize(image, mcuRow, top, top + mcuHeight);
+                inverseDCT(image, mcuRow, top, top + mcuHeight);
+                progress.setTransformed(task);
+            }
+            if (task == 0) {
+                continue;
+            }
+
+            const uint row = task - 1;
+            if ((row > 0 && !progress.waitTransformed(row - 1)) || !progress.waitTransformed(row)) {
+                return;
+            }
+            const uint first = std::max(row * pixelRowsPerMCU, region.y);
+            const uint last = std::min((row + 1) * pixelRowsPerMCU, region.y + region.height);
+            for (uint y = first; y < last; ++y) {
+                converter.convertRow(y, pixels + (std::ptrdiff_t)(y - region.y) * stride, format);
+            }
         }
+    };
 
-        // dequantize DCT coefficients
-        dequantize(image);
+    // blocks are taken before any thread starts, as they all read image->blocks
+    image->blocks = buffer.get(image->blockHeightReal * image->blockWidthReal);
+    if (image->blocks == nullptr) {
+        std::cout << "Error - Memory error\n";
+        image->valid = false;
+        return false;
+    }
+
+    Helpers helpers(image->scheduler);
+    helpers.start(image->threads - 1, work);
+
+    readScans(bitReader, image, &progress);
+    if (image->valid) {
+        // block rows past those the scan covers stay as they are, zeroed
+        progress.setDecoded(image->blockHeightReal);
+    }
+    else {
+        progress.cancel();
+    }
+
+    // the calling thread then takes rows too, and finishes them itself if no helper started
+    work();
+    helpers.wait();
+    return image->valid;
+}
+
+// decode the scans of a JPG whose header has been read
+//   and write packed pixels of the output region into the caller's memory
+bool decodeToPixels(BitReader& bitReader, JPGImage* const image, BlockBuffer& buffer,
+                    const PixelFormat format, byte* const pixels, const int stride) {
+    const Region region = outputRegion(image);
+    if ((uint)std::abs(stride) < region.width * pixelSizes[format]) {
+        std::cout << "Error - Row stride smaller than a row of pixels\n";
+        return false;
+    }
+    if (image->frameType == SOF0 && image->threads > 1) {
+        return decodeToPixelsPipelined(bitReader, image, buffer, format, pixels, stride);
+    }
+    if (!readBlocks(bitReader, image, buffer)) {
+        return false;
+    }
+
+    // dequantize DCT coefficients
+    dequantize(image);
+
+    // Inverse Discrete Cosine Transform
+    inverseDCT(image);
+
+    // upsample and color convert straight into the caller's pixels
+    writePixels(image, pixels, stride, format);
+    return true;
+}
+
+// decode the scans of a JPG whose header has been read
+//   and write each component into the caller's planes
+bool decodeToPlanes(BitReader& bitReader, JPGImage* const image, BlockBuffer& buffer,
+                    byte* const planes[3], const int strides[3]) {
+    for (uint i = 0; i < decodedComponents(image); ++i) {
+        if ((uint)std::abs(strides[i]) < planeRegion(image, i).width) {
+            std::cout << "Error - Row stride smaller than a row of samples\n";
+            return false;
+        }
+    }
+    if (!readBlocks(bitReader, image, buffer)) {
+        return false;
+    }
+
+    dequantize(image);
+    inverseDCT(image);
+
+    // planar output skips upsampling and color conversion
+    for (uint i = 0; i < decodedComponents(image); ++i) {
+        writePlane(image, i, planes[i], strides[i]);
+    }
+    return true;
+}
+
+}
+
+// state kept by a Decoder between images
+struct jed::Decoder::Context {
+    JPGImage image;
+    BlockBuffer blocks;
+
+    // start a new image, keeping the tables of the previous one
+    JPGImage* start() {
+        JPGImage next;
+        std::copy(image.quantizationTables, image.quantizationTables + 4, next.quantizationTables);
+        std::copy(image.huffmanDCTables, image.huffmanDCTables + 4, next.huffmanDCTables);
+        std::copy(image.huffmanACTables, image.huffmanACTables + 4, next.huffmanACTables);
+        std::copy(image.huffmanDCLookups, image.huffmanDCLookups + 4, next.huffmanDCLookups);
+        std::copy(image.huffmanACLookups, image.huffmanACLookups + 4, next.huffmanACLookups);
+        image = next;
+        return &image;
+    }
+};
+
+jed::Decoder::Decoder() :
+context(new (std::nothrow) Context)
+{}
+
+jed::Decoder::~Decoder() {
+    delete context;
+}
 
-        // Inverse Discrete Cosine Transform
-        inverseDCT(image);
+bool jed::Decoder::probe(const byte* data, std::size_t size, const DecodeOptions& options, ImageInfo& info) {
+    if (context == nullptr) {
+        std::cout << "Error - Memory error\n";
+        return false;
+    }
+    BitReader bitReader(data, size);
+    JPGImage* const image = context->start();
+    if (!readHeader(bitReader, image, options)) {
+        return false;
+    }
+    image->numScans = countScans(bitReader, image);
+    getImageInfo(image, info);
+    return true;
+}
+
+bool jed::Decoder::decode(const byte* data, std::size_t size, const DecodeOptions& options, PixelFormat format,
+                          const ImageInfo& info, byte* pixels, int stride) {
+    if (context == nullptr) {
+        std::cout << "Error - Memory error\n";
+        return false;
+    }
+    BitReader bitReader(data, size);
+    JPGImage* const image = context->start();
+    if (!readHeader(bitReader, image, options)) {
+        return false;
+    }
+    ImageInfo actual;
+    getImageInfo(image, actual);
+    if (!matchesLayout(actual, info)) {
+        return false;
+    }
+    return decodeToPixels(bitReader, image, context->blocks, format, pixels, stride);
+}
+
+bool jed::Decoder::decode(const byte* data, std::size_t size, const DecodeOptions& options, PixelFormat format,
+                          std::vector<byte>& pixels, ImageInfo& info) {
+    if (context == nullptr) {
+        std::cout << "Error - Memory error\n";
+        return false;
+    }
+    BitReader bitReader(data, size);
+    JPGImage* const image = context->start();
+    if (!readHeader(bitReader, image, options)) {
+        return false;
+    }
+    getImageInfo(image, info);
+    const uint rowSize = info.width * pixelSizes[format];
+    pixels.resize((std::size_t)info.height * rowSize);
+    if (!decodeToPixels(bitReader, image, context->blocks, format, pixels.data(), rowSize)) {
+        return false;
+    }
+    info.numScans = image->numScans;
+    return true;
+}
+
+bool jed::Decoder::decodePlanes(const byte* data, std::size_t size, const DecodeOptions& options,
+                                const ImageInfo& info, byte* const planes[3], const int strides[3]) {
+    if (context == nullptr) {
+        std::cout << "Error - Memory error\n";
+        return false;
+    }
+    BitReader bitReader(data, size);
+    JPGImage* const image = context->start();
+    if (!readHeader(bitReader, image, options)) {
+        return false;
+    }
+    ImageInfo actual;
+    getImageInfo(image, actual);
+    if (!matchesLayout(actual, info)) {
+        return false;
+    }
+    return decodeToPlanes(bitReader, image, context->blocks, planes, strides);
+}
 
-        // color conversion
-        YCbCrToRGB(image);
+bool jed::Decoder::decodePlanes(const byte* data, std::size_t size, const DecodeOptions& options,
+                                std::vector<byte> (&planes)[3], ImageInfo& info) {
+    if (context == nullptr) {
+        std::cout << "Error - Memory error\n";
+        return false;
+    }
+    BitReader bitReader(data, size);
+    JPGImage* const image = context->start();
+    if (!readHeader(bitReader, image, options)) {
+        return false;
+    }
+    getImageInfo(image, info);
+    byte* planeData[3] = { nullptr };
+    int strides[3] = { 0 };
+    for (uint i = 0; i < 3; ++i) {
+        planes[i].resize((std::size_t)info.planeHeights[i] * info.planeWidths[i]);
+        planeData[i] = planes[i].data();
+        strides[i] = info.planeWidths[i];
+    }
+    if (!decodeToPlanes(bitReader, image, context->blocks, planeData, strides)) {
+        return false;
+    }
+    info.numScans = image->numScans;
+    return true;
+}
 
-        // write BMP file
-        const std::size_t pos = filename.find_last_of('.');
-        const std::string outFilename = (pos == std::string::npos) ?
-            (filename + ".bmp") :
-            (filename.substr(0, pos) + ".bmp");
-        writeBMP(image, outFilename);
+bool jed::Decoder::decodeScanlines(const byte* data, std::size_t size, const DecodeOptions& options, ScanlineSink& sink) {
+    if (context == nullptr) {
+        std::cout << "Error - Memory error\n";
+        return false;
+    }
+    BitReader bitReader(data, size);
+    JPGImage* const image = context->start();
+    if (!readHeader(bitReader, image, options)) {
+        return false;
+    }
+    return readJPGScanlines(bitReader, *image, sink, context->blocks);
+}
 
-        delete[] image->blocks;
-        delete image;
+bool jed::Decoder::benchmark(const byte* data, std::size_t size, const DecodeOptions& options) {
+    if (context == nullptr) {
+        std::cout << "Error - Memory error\n";
+        return false;
+    }
+    // the whole image is decoded at full size, whatever the options
+    DecodeOptions fullSize;
+    fullSize.verbose = options.verbose;
+    BitReader bitReader(data, size);
+    JPGImage* const image = context->start();
+    if (!readHeader(bitReader, image, fullSize) || !readBlocks(bitReader, image, context->blocks)) {
+        return false;
     }
-    return 0;
+    image->dctMethod = options.dctMethod;
+    benchmarkDCT(image);
+    return true;
 }
@@ -0,0 +1,672 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <new>
+#include <cstdio>
+
+#include "jed.h"
+#include "batch.h"
+#include "batch_io.h"
+
+using namespace jed;
+
+// read a whole file into memory
+bool readFile(const std::string& filename, std::vector<byte>& data, const bool log) {
+    if (log) {
+        std::cout << "Reading " << filename << "...\n";
+    }
+    std::ifstream inFile(filename, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!inFile.is_open()) {
+        std::cout << "Error - Error opening input file\n";
+        return false;
+    }
+    data.resize((std::size_t)inFile.tellg());
+    inFile.seekg(0);
+    inFile.read((char*)data.data(), data.size());
+    if (!inFile) {
+        std::cout << "Error - Error reading input file\n";
+        return false;
+    }
+    inFile.close();
+    return true;
+}
+
+// write a file held in memory, the pixels of a headerless file or a whole BMP
+bool writeFile(const std::vector<byte>& contents, const std::string& filename, const bool log) {
+    if (log) {
+        std::cout << "Writing " << filename << "...\n";
+    }
+    std::ofstream outFile(filename, std::ios::out | std::ios::binary);
+    if (!outFile.is_open()) {
+        std::cout << "Error - Error opening output file\n";
+        return false;
+    }
+    outFile.write((const char*)contents.data(), contents.size());
+    outFile.close();
+    if (!outFile) {
+        std::cout << "Error - Error writing output file\n";
+        return false;
+    }
+    return true;
+}
+
+// put the components in a file held in memory as planes, Y then Cb then Cr, at their native subsampling
+//   either raw or as a single frame YUV4MPEG2 (Y4M) stream
+bool putYUV(const std::vector<byte> (&planes)[3], const ImageInfo& info, const bool y4m, std::vector<byte>& file) {
+    const uint vSamp = info.verticalSamplingFactor;
+    const uint hSamp = info.horizontalSamplingFactor;
+    const char* chroma = nullptr;
+    if (info.numComponents == 1) {
+        chroma = "mono";
+    }
+    else if (vSamp == 1 && hSamp == 1) {
+        chroma = "444";
+    }
+    else if (vSamp == 1 && hSamp == 2) {
+        chroma = "422";
+    }
+    else if (vSamp == 2 && hSamp == 2) {
+        chroma = "420jpeg";
+    }
+    if (y4m && chroma == nullptr) {
+        std::cout << "Error - Chroma subsampling not supported by Y4M\n";
+        return false;
+    }
+
+    file.clear();
+    if (y4m) {
+        const std::string header = "YUV4MPEG2 W" + std::to_string(info.width) + " H" + std::to_string(info.height) +
+                                   " F1:1 Ip A1:1 C" + chroma + "\nFRAME\n";
+        file.insert(file.end(), header.begin(), header.end());
+    }
+
+    for (uint i = 0; i < info.numComponents; ++i) {
+        file.insert(file.end(), planes[i].begin(), planes[i].end());
+    }
+    return true;
+}
+
+// helper function to write a 4-byte integer in little-endian
+void putInt(byte*& bufferPos, const uint v) {
+    *bufferPos++ = v >>  0;
+    *bufferPos++ = v >>  8;
+    *bufferPos++ = v >> 16;
+    *bufferPos++ = v >> 24;
+}
+
+// helper function to write a 2-byte short integer in little-endian
+void putShort(byte*& bufferPos, const uint v) {
+    *bufferPos++ = v >> 0;
+    *bufferPos++ = v >> 8;
+}
+
+// size of a BMP header, including the palette of an 8-bit gray BMP
+uint bmpHeaderSize(const bool gray) {
+    return 14 + 12 + (gray ? 256 * 3 : 0);
+}
+
+// write the header of a 24-bit color or 8-bit gray BMP
+//   8-bit BMPs are paletted, so gray ones get a palette mapping each value to itself
+void putBMPHeader(byte*& bufferPos, const uint width, const uint height, const bool gray) {
+    const uint rowSize = (width * (gray ? 1 : 3) + 3) / 4 * 4;
+    *bufferPos++ = 'B';
+    *bufferPos++ = 'M';
+    putInt(bufferPos, bmpHeaderSize(gray) + height * rowSize);
+    putInt(bufferPos, 0);
+    putInt(bufferPos, bmpHeaderSize(gray));
+    putInt(bufferPos, 12);
+    putShort(bufferPos, width);
+    putShort(bufferPos, height);
+    putShort(bufferPos, 1);
+    putShort(bufferPos, gray ? 8 : 24);
+    if (gray) {
+        for (uint i = 0; i < 256; ++i) {
+            *bufferPos++ = i;
+            *bufferPos++ = i;
+            *bufferPos++ = i;
+        }
+    }
+}
+
+// decode straight into the pixels of a BMP file held in memory
+//   the headers are probed first to size the file
+//   images with only luminance are written as 8-bit gray
+bool decodeBMP(Decoder& decoder, const std::vector<byte>& data, const DecodeOptions& options,
+               std::vector<byte>& bmp, ImageInfo& info) {
+    if (!decoder.probe(data.data(), data.size(), options, info)) {
+        return false;
+    }
+
+    const uint height = info.height;
+    const uint width = info.width;
+    const bool gray = info.numComponents == 1;
+    const uint rowSize = (width * (gray ? 1 : 3) + 3) / 4 * 4;
+    const uint size = bmpHeaderSize(gray) + height * rowSize;
+
+    // the buffer is kept from one image to the next, but cleared so the row padding is zero
+    bmp.assign(size, 0);
+    byte* bufferPos = bmp.data();
+    putBMPHeader(bufferPos, width, height, gray);
+
+    // BMP rows are stored bottom-up
+    return decoder.decode(data.data(), data.size(), options, gray ? PIXEL_GRAY : PIXEL_BGR, info,
+                          bufferPos + (height - 1) * rowSize, -(int)rowSize);
+}
+
+// print the layout of a JPG without decoding it
+//   return false if its headers could not be read
+bool printProbe(Decoder& decoder, const std::vector<byte>& data, const DecodeOptions& options) {
+    ImageInfo info;
+    if (!decoder.probe(data.data(), data.size(), options, info)) {
+        return false;
+    }
+    std::cout << "PROBE===========\n";
+    std::cout << "Frame Type: 0x" << std::hex << (uint)info.frameType << std::dec << '\n';
+    std::cout << "Frame Size: " << info.frameWidth << 'x' << info.frameHeight << '\n';
+    std::cout << "Components: " << info.frameComponents << '\n';
+    std::cout << "Sampling Factors: " << (uint)info.horizontalSamplingFactor << 'x' << (uint)info.verticalSamplingFactor << '\n';
+    std::cout << "Restart Interval: " << info.restartInterval << '\n';
+    std::cout << "Scans: " << info.numScans << '\n';
+    std::cout << "Output Size: " << info.width << 'x' << info.height << '\n';
+    for (uint i = 0; i < info.numComponents; ++i) {
+        std::cout << "Plane " << i << ": " << info.planeWidths[i] << 'x' << info.planeHeights[i] << '\n';
+    }
+    std::cout << "================\n";
+    return true;
+}
+
+// writes a BMP file one scanline at a time as rows arrive top to bottom
+//   BMP rows are stored bottom-up, so the file is sized up front
+//   and each row is written at its own offset
+class BMPScanlineWriter : public ScanlineSink {
+private:
+    std::ofstream outFile;
+    const std::string filename;
+    uint height = 0;
+    uint width = 0;
+    uint rowSize = 0;
+    bool gray = false;
+    const bool log;
+    bool failed = false;
+
+public:
+    BMPScanlineWriter(const std::string& name, const bool logWrites) :
+    filename(name),
+    log(logWrites)
+    {}
+
+    bool begin(const uint w, const uint h, const bool g) override {
+        if (log) {
+            std::cout << "Writing " << filename << "...\n";
+        }
+        outFile.open(filename, std::ios::out | std::ios::binary);
+        if (!outFile.is_open()) {
+            std::cout << "Error - Error opening output file\n";
+            failed = true;
+            return false;
+        }
+        width = w;
+        height = h;
+        gray = g;
+        rowSize = (width * (gray ? 1 : 3) + 3) / 4 * 4;
+
+        std::vector<byte> header(bmpHeaderSize(gray));
+        byte* headerPos = header.data();
+        putBMPHeader(headerPos, width, height, gray);
+        outFile.write((char*)header.data(), header.size());
+
+        // extend the file to its full size so rows can be written in any order
+        //   this also zeroes the row padding
+        outFile.seekp(header.size() + height * rowSize - 1);
+        outFile.put(0);
+        failed = !outFile;
+        return !failed;
+    }
+
+    bool writeScanline(const uint y, const byte* const pixels) override {
+        outFile.seekp(bmpHeaderSize(gray) + (std::streamoff)(height - 1 - y) * rowSize);
+        outFile.write((const char*)pixels, width * (gray ? 1 : 3));
+        if (!outFile) {
+            std::cout << "Error - Error writing output file\n";
+            failed = true;
+            return false;
+        }
+        return true;
+    }
+
+    PixelFormat pixelFormat() const override {
+        return gray ? PIXEL_GRAY : PIXEL_BGR;
+    }
+
+    // true if decoding stopped because the file could not be written
+    bool writeFailed() const {
+        return failed;
+    }
+};
+
+// writes a headerless file of packed pixels one scanline at a time
+class RawScanlineWriter : public ScanlineSink {
+private:
+    std::ofstream outFile;
+    const std::string filename;
+    const PixelFormat format;
+    uint width = 0;
+    const bool log;
+    bool failed = false;
+
+public:
+    RawScanlineWriter(const std::string& name, const PixelFormat pixelFormat, const bool logWrites) :
+    filename(name),
+    format(pixelFormat),
+    log(logWrites)
+    {}
+
+    bool begin(const uint w, const uint, const bool) override {
+        if (log) {
+            std::cout << "Writing " << filename << "...\n";
+        }
+        outFile.open(filename, std::ios::out | std::ios::binary);
+        if (!outFile.is_open()) {
+            std::cout << "Error - Error opening output file\n";
+            failed = true;
+            return false;
+        }
+        width = w;
+        return true;
+    }
+
+    bool writeScanline(const uint, const byte* const pixels) override {
+        outFile.write((const char*)pixels, width * pixelSizes[format]);
+        if (!outFile) {
+            std::cout << "Error - Error writing output file\n";
+            failed = true;
+            return false;
+        }
+        return true;
+    }
+
+    PixelFormat pixelFormat() const override {
+        return format;
+    }
+
+    // true if decoding stopped because the file could not be written
+    bool writeFailed() const {
+        return failed;
+    }
+};
+
+// parse a --dct= option value
+bool parseDCTMethod(const std::string& value, DCTMethod& dctMethod) {
+    if (value == "fast") {
+        dctMethod = DCT_FAST;
+    }
+    else if (value == "accurate") {
+        dctMethod = DCT_ACCURATE;
+    }
+    else if (value == "float") {
+        dctMethod = DCT_FLOAT;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+// parse an --upsample= option value
+bool parseUpsampling(const std::string& value, ChromaUpsampling& upsampling) {
+    if (value == "nearest") {
+        upsampling = UPSAMPLE_NEAREST;
+    }
+    else if (value == "fancy") {
+        upsampling = UPSAMPLE_FANCY;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+// parse the raw pixel formats of a --format= option value
+bool parsePixelFormat(const std::string& value, PixelFormat& format) {
+    if (value == "rgb") {
+        format = PIXEL_RGB;
+    }
+    else if (value == "bgr") {
+        format = PIXEL_BGR;
+    }
+    else if (value == "rgba") {
+        format = PIXEL_RGBA;
+    }
+    else if (value == "bgra") {
+        format = PIXEL_BGRA;
+    }
+    else if (value == "gray") {
+        format = PIXEL_GRAY;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+// parse a --scale= option value
+bool parseScale(const std::string& value, byte& scale) {
+    if (value == "1/1" || value == "1") {
+        scale = 1;
+    }
+    else if (value == "1/2") {
+        scale = 2;
+    }
+    else if (value == "1/4") {
+        scale = 4;
+    }
+    else if (value == "1/8") {
+        scale = 8;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+// parse a --crop= option value in the form WxH+X+Y
+bool parseCrop(const std::string& value, Region& crop) {
+    char end = 0;
+    if (std::sscanf(value.c_str(), "%ux%u+%u+%u%c", &crop.width, &crop.height, &crop.x, &crop.y, &end) != 4) {
+        return false;
+    }
+    return crop.width != 0 && crop.height != 0;
+}
+
+// parse a --threads= option value, 0 meaning one per core
+bool parseThreads(const std::string& value, uint& threads) {
+    char end = 0;
+    return std::sscanf(value.c_str(), "%u%c", &threads, &end) == 1;
+}
+
+// what each decoded file is written as, chosen on the command line
+struct OutputOptions {
+    std::string extension = "bmp";
+    bool raw = false;
+    PixelFormat rawFormat = PIXEL_RGB;
+    bool planar = false;
+    bool stream = false;
+
+    // print each file as it is read and written
+    bool log = true;
+};
+
+// a decoder and the buffers it reuses from one file to the next
+//   in batch mode each worker thread has its own
+struct DecodeWorker {
+    Decoder decoder;
+    std::vector<byte> data;
+    std::vector<byte> pixels;
+    std::vector<byte> planes[3];
+    ImageInfo info;
+};
+
+// write a file held in memory, or queue it on the batch's writer when there is one
+//   a queued file only counts as written once the writer is finished
+bool writeOutput(std::vector<byte>& contents, const std::string& filename, const bool log,
+                 BatchIO* const io, const std::size_t index) {
+    if (io != nullptr) {
+        io->write(index, filename, contents);
+        return true;
+    }
+    return writeFile(contents, filename, log);
+}
+
+// decode the worker's data and write it out, recording the stage that failed, if any, in the result
+//   io, if set, is the batch's writer and index the position of the file in the batch
+//   scanlines from --stream are always written as they are decoded
+bool decodeData(DecodeWorker& worker, const std::string& outFilename, const DecodeOptions& options,
+                const OutputOptions& output, BatchIO* const io, const std::size_t index, BatchResult& result) {
+    result.output = outFilename;
+    const std::vector<byte>& data = worker.data;
+    ImageInfo& info = worker.info;
+
+    bool decoded = false;
+    bool written = false;
+    // decode and write one row of pixels at a time
+    //   planes are written one after another, so need the whole image
+    if (output.stream && !output.planar) {
+        if (output.raw) {
+            RawScanlineWriter writer(outFilename, output.rawFormat, output.log);
+            written = worker.decoder.decodeScanlines(data.data(), data.size(), options, writer);
+            decoded = written || writer.writeFailed();
+        }
+        else {
+            BMPScanlineWriter writer(outFilename, output.log);
+            written = worker.decoder.decodeScanlines(data.data(), data.size(), options, writer);
+            decoded = written || writer.writeFailed();
+        }
+        // rows written before the data turned out invalid are no image at all
+        if (!decoded) {
+            std::remove(outFilename.c_str());
+        }
+        // sinks are only told the output size as it is decoded, so probe for it again
+        decoded = decoded && worker.decoder.probe(data.data(), data.size(), options, info);
+    }
+    // planar output skips upsampling and color conversion
+    else if (output.planar) {
+        decoded = worker.decoder.decodePlanes(data.data(), data.size(), options, worker.planes, info);
+        written = decoded && putYUV(worker.planes, info, output.extension == "y4m", worker.pixels) &&
+                  writeOutput(worker.pixels, outFilename, output.log, io, index);
+    }
+    else if (output.raw) {
+        decoded = worker.decoder.decode(data.data(), data.size(), options, output.rawFormat, worker.pixels, info);
+        written = decoded && writeOutput(worker.pixels, outFilename, output.log, io, index);
+    }
+    else {
+        decoded = decodeBMP(worker.decoder, data, options, worker.pixels, info);
+        written = decoded && writeOutput(worker.pixels, outFilename, output.log, io, index);
+    }
+
+    if (!decoded) {
+        result.status = "decode";
+        return false;
+    }
+    result.width = info.width;
+    result.height = info.height;
+    if (!written) {
+        result.status = "write";
+        return false;
+    }
+    return true;
+}
+
+// read one file, decode it and write it out, recording the stage that failed, if any, in the result
+bool decodeFile(DecodeWorker& worker, const std::string& filename, const std::string& outFilename,
+                const DecodeOptions& options, const OutputOptions& output, BatchResult& result) {
+    result.output = outFilename;
+    if (!readFile(filename, worker.data, output.log)) {
+        result.status = "read";
+        return false;
+    }
+    return decodeData(worker, outFilename, options, output, nullptr, 0, result);
+}
+
+int main(int argc, char** argv) {
+    DecodeOptions options;
+    OutputOptions output;
+    bool benchmark = false;
+    bool probe = false;
+    std::string batchInput;
+    std::string outDir;
+    uint jobs = 0;
+    bool affinity = false;
+    uint prefetch = 0;
+    uint ioMemory = 256;
+    bool useUring = true;
+    bool threadsGiven = false;
+    std::vector<std::string> filenames;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        if (arg.compare(0, 6, "--dct=") == 0) {
+            if (!parseDCTMethod(arg.substr(6), options.dctMethod)) {
+                std::cout << "Error - Invalid DCT method: " << arg.substr(6) << '\n';
+                return 1;
+            }
+        }
+        else if (arg.compare(0, 8, "--scale=") == 0) {
+            if (!parseScale(arg.substr(8), options.scale)) {
+                std::cout << "Error - Invalid scale: " << arg.substr(8) << '\n';
+                return 1;
+            }
+        }
+        else if (arg.compare(0, 7, "--crop=") == 0) {
+            if (!parseCrop(arg.substr(7), options.crop)) {
+                std::cout << "Error - Invalid crop region: " << arg.substr(7) << '\n';
+                return 1;
+            }
+        }
+        else if (arg.compare(0, 11, "--upsample=") == 0) {
+            if (!parseUpsampling(arg.substr(11), options.upsampling)) {
+                std::cout << "Error - Invalid upsampling method: " << arg.substr(11) << '\n';
+                return 1;
+            }
+        }
+        else if (arg.compare(0, 9, "--format=") == 0) {
+            output.extension = arg.substr(9);
+            output.planar = output.extension == "y4m" || output.extension == "yuv";
+            output.raw = output.extension != "bmp" && !output.planar;
+            if (output.raw && !parsePixelFormat(output.extension, output.rawFormat)) {
+                std::cout << "Error - Invalid output format: " << output.extension << '\n';
+                return 1;
+            }
+        }
+        else if (arg.compare(0, 10, "--threads=") == 0) {
+            if (!parseThreads(arg.substr(10), options.threads)) {
+                std::cout << "Error - Invalid number of threads: " << arg.substr(10) << '\n';
+                return 1;
+            }
+            threadsGiven = true;
+        }
+        else if (arg.compare(0, 8, "--batch=") == 0) {
+            batchInput = arg.substr(8);
+        }
+        else if (arg.compare(0, 6, "--out=") == 0) {
+            outDir = arg.substr(6);
+        }
+        else if (arg.compare(0, 7, "--jobs=") == 0) {
+            if (!parseThreads(arg.substr(7), jobs)) {
+                std::cout << "Error - Invalid number of jobs: " << arg.substr(7) << '\n';
+                return 1;
+            }
+        }
+        else if (arg.compare(0, 11, "--prefetch=") == 0) {
+            if (!parseThreads(arg.substr(11), prefetch)) {
+                std::cout << "Error - Invalid number of files to prefetch: " << arg.substr(11) << '\n';
+                return 1;
+            }
+        }
+        else if (arg.compare(0, 12, "--io-memory=") == 0) {
+            if (!parseThreads(arg.substr(12), ioMemory) || ioMemory == 0) {
+                std::cout << "Error - Invalid I/O memory: " << arg.substr(12) << '\n';
+                return 1;
+            }
+        }
+        else if (arg.compare(0, 5, "--io=") == 0) {
+            if (arg.substr(5) != "uring" && arg.substr(5) != "threads") {
+                std::cout << "Error - Invalid I/O backend: " << arg.substr(5) << '\n';
+                return 1;
+            }
+            useUring = arg.substr(5) == "uring";
+        }
+        else if (arg == "--luma") {
+            options.lumaOnly = true;
+        }
+        else if (arg == "--stream") {
+            output.stream = true;
+        }
+        else if (arg == "--affinity") {
+            affinity = true;
+        }
+        else if (arg == "--benchmark") {
+            benchmark = true;
+        }
+        else if (arg == "--probe") {
+            probe = true;
+        }
+        else if (arg == "--verbose") {
+            options.verbose = true;
+        }
+        else if (arg.compare(0, 2, "--") == 0) {
+            std::cout << "Error - Unknown option: " << arg << '\n';
+            return 1;
+        }
+        else {
+            filenames.push_back(arg);
+        }
+    }
+
+    // validate arguments
+    //   a batch takes its files from --batch= and writes them to --out=
+    if (batchInput.empty() ? (filenames.empty() || !outDir.empty()) :
+                             (!filenames.empty() || outDir.empty() || probe || benchmark)) {
+        std::cout << "Error - Invalid arguments\n";
+        return 1;
+    }
+
+    // decode every file of the batch on a pool of workers, without printing each file read and written
+    if (!batchInput.empty()) {
+        std::vector<std::string> files;
+        if (!listBatchFiles(batchInput, { "jpg", "jpeg" }, files) || !makeOutputDirectory(outDir)) {
+            return 1;
+        }
+        output.log = false;
+        // images are split into subtasks for the workers left idle, unless told otherwise
+        Scheduler scheduler(jobs, affinity);
+        options.scheduler = &scheduler;
+        if (!threadsGiven) {
+            options.threads = 0;
+        }
+        // inputs are read ahead, and outputs written behind, the workers in the background,
+        //   except for --stream, whose scanlines are written as they are decoded
+        BatchIO io(files, (prefetch > 0) ? prefetch : std::max(4 * scheduler.size(), 1u),
+                   (std::size_t)ioMemory << 20, useUring);
+        std::vector<BatchResult> results(files.size());
+        setBatchOutputPaths(outDir, files, output.extension, results);
+        runBatch<DecodeWorker>(scheduler, io, files.size(), results,
+            [&](DecodeWorker& worker, const std::size_t index, BatchResult& result) {
+                decodeData(worker, result.output, options, output, output.stream ? nullptr : &io, index, result);
+            });
+        const bool written = writeBatchSummary(batchOutputPath(outDir, "summary", "tsv"), files, results);
+        std::cout << "Files read and written with " << io.backend() << '\n';
+        printWorkerStats(scheduler);
+        return written ? 0 : 1;
+    }
+
+    // one decoder, and its buffers, serves every file
+    //   the exit status is 1 if any file could not be read, decoded or written
+    DecodeWorker worker;
+    BatchResult result;
+    bool failed = false;
+
+    for (const std::string& filename : filenames) {
+        const std::size_t pos = filename.find_last_of('.');
+        const std::string outFilename = (pos == std::string::npos) ?
+            (filename + "." + output.extension) :
+            (filename.substr(0, pos + 1) + output.extension);
+
+        if (probe) {
+            if (!readFile(filename, worker.data, output.log) || !printProbe(worker.decoder, worker.data, options)) {
+                failed = true;
+            }
+        }
+        else if (benchmark) {
+            if (!readFile(filename, worker.data, output.log) ||
+                !worker.decoder.benchmark(worker.data.data(), worker.data.size(), options)) {
+                failed = true;
+            }
+        }
+        else if (!decodeFile(worker, filename, outFilename, options, output, result)) {
+            failed = true;
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -1,137 +1,97 @@
 #include <iostream>
-#include <fstream>
 #include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "jpg.h"
 
-// helper function to read a 4-byte integer in little-endian
-uint getInt(std::ifstream& inFile) {
-    return (inFile.get() <<  0)
-         + (inFile.get() <<  8)
-         + (inFile.get() << 16)
-         + (inFile.get() << 24);
-}
-
-// helper function to read a 2-byte short integer in little-endian
-uint getShort(std::ifstream& inFile) {
-    return (inFile.get() << 0)
-         + (inFile.get() << 8);
-}
-
-BMPImage readBMP(const std::string& filename) {
-    BMPImage image;
-
-    // open file
-    std::cout << "Reading " << filename << "...\n";
-    std::ifstream inFile(filename, std::ios::in | std::ios::binary);
-    if (!inFile.is_open()) {
-        std::cout << "Error - Error opening input file\n";
-        return image;
-    }
-
-    if (inFile.get() != 'B' || inFile.get() != 'M') {
-        std::cout << "Error - Invalid BMP file\n";
-        inFile.close();
-        return image;
-    }
-
-    getInt(inFile); // size
-    getInt(inFile); // nothing
-    if (getInt(inFile) != 0x1A) {
-        std::cout << "Error - Invalid offset\n";
-        inFile.close();
-        return image;
-    }
-    if (getInt(inFile) != 12) {
-        std::cout << "Error - Invalid DIB size\n";
-        inFile.close();
-        return image;
-    }
-    image.width = getShort(inFile);
-    image.height = getShort(inFile);
-    if (getShort(inFile) != 1) {
-        std::cout << "Error - Invalid number of planes\n";
-        inFile.close();
-        return image;
-    }
-    if (getShort(inFile) != 24) {
-        std::cout << "Error - Invalid bit depth\n";
-        inFile.close();
-        return image;
-    }
-
-    if (image.height == 0 || image.width == 0) {
-        std::cout << "Error - Invalid dimensions\n";
-        inFile.close();
-        return image;
-    }
+namespace {
 
-    image.blockHeight = (image.height + 7) / 8;
-    image.blockWidth = (image.width + 7) / 8;
-
-    image.blocks = new (std::nothrow) Block[image.blockHeight * image.blockWidth];
-    if (image.blocks == nullptr) {
-        std::cout << "Error - Memory error\n";
-        inFile.close();
-        return image;
-    }
-
-    const uint paddingSize = image.width % 4;
-
-    for (uint y = image.height - 1; y < image.height; --y) {
+// copy packed pixels into the RGB samples of the image's blocks
+//   blocks past the right and bottom edges are left black
+void fillBlocks(const BMPImage& image, const byte* const pixels, const int stride, const PixelFormat format) {
+    const uint pixelSize = pixelSizes[format];
+    const bool bgr = format == PIXEL_BGR || format == PIXEL_BGRA;
+    for (uint y = 0; y < image.height; ++y) {
+        const byte* const row = pixels + (std::ptrdiff_t)y * stride;
         const uint blockRow = y / 8;
         const uint pixelRow = y % 8;
         for (uint x = 0; x < image.width; ++x) {
-            const uint blockColumn = x / 8;
-            const uint pixelColumn = x % 8;
-            const uint blockIndex = blockRow * image.blockWidth + blockColumn;
-            const uint pixelIndex = pixelRow * 8 + pixelColumn;
-            image.blocks[blockIndex].b[pixelIndex] = inFile.get();
-            image.blocks[blockIndex].g[pixelIndex] = inFile.get();
-            image.blocks[blockIndex].r[pixelIndex] = inFile.get();
-        }
-        for (uint i = 0; i < paddingSize; ++i) {
-            inFile.get();
+            Block& block = image.blocks[blockRow * image.blockWidth + x / 8];
+            const uint pixelIndex = pixelRow * 8 + x % 8;
+            const byte* const pixel = row + x * pixelSize;
+            if (format == PIXEL_GRAY) {
+                block.r[pixelIndex] = pixel[0];
+                block.g[pixelIndex] = pixel[0];
+                block.b[pixelIndex] = pixel[0];
+            }
+            else {
+                block.r[pixelIndex] = pixel[bgr ? 2 : 0];
+                block.g[pixelIndex] = pixel[1];
+                block.b[pixelIndex] = pixel[bgr ? 0 : 2];
+            }
         }
     }
+}
 
-    inFile.close();
-    return image;
+// copy planes of 8-bit samples into the level shifted YCbCr samples of the image's blocks
+//   the chroma of an MCU is stored in its top-left block
+void fillPlanes(const BMPImage& image, const byte* const planes[3], const int strides[3], const uint numPlanes) {
+    const uint vSamp = image.verticalSamplingFactor;
+    const uint hSamp = image.horizontalSamplingFactor;
+    for (uint i = 0; i < numPlanes; ++i) {
+        const uint planeHeight = (i == 0) ? image.height : (image.height + vSamp - 1) / vSamp;
+        const uint planeWidth = (i == 0) ? image.width : (image.width + hSamp - 1) / hSamp;
+        const uint blockStepY = (i == 0) ? 1 : vSamp;
+        const uint blockStepX = (i == 0) ? 1 : hSamp;
+        for (uint y = 0; y < planeHeight; ++y) {
+            const byte* const row = planes[i] + (std::ptrdiff_t)y * strides[i];
+            const uint blockRow = y / 8 * blockStepY;
+            const uint pixelRow = y % 8;
+            for (uint x = 0; x < planeWidth; ++x) {
+                const uint blockIndex = blockRow * image.blockWidth + x / 8 * blockStepX;
+                image.blocks[blockIndex][i][pixelRow * 8 + x % 8] = row[x] - 128;
+            }
+        }
+    }
 }
 
 // convert all pixels in a block from RGB color space to YCbCr
 void RGBToYCbCrBlock(Block& block) {
-    for (uint y = 0; y < 8; ++y) {
-        for (uint x = 0; x < 8; ++x) {
-            const uint pixel = y * 8 + x;
-            int y  =  0.2990 * block.r[pixel] + 0.5870 * block.g[pixel] + 0.1140 * block.b[pixel] - 128;
-            int cb = -0.1687 * block.r[pixel] - 0.3313 * block.g[pixel] + 0.5000 * block.b[pixel];
-            int cr =  0.5000 * block.r[pixel] - 0.4187 * block.g[pixel] - 0.0813 * block.b[pixel];
-            if (y  < -128) y  = -128;
-            if (y  >  127) y  =  127;
-            if (cb < -128) cb = -128;
-            if (cb >  127) cb =  127;
-            if (cr < -128) cr = -128;
-            if (cr >  127) cr =  127;
-            block.y[pixel]  = y;
-            block.cb[pixel] = cb;
-            block.cr[pixel] = cr;
-        }
+    // the tables keep every result within -128..127, so no clamping is needed
+    for (uint pixel = 0; pixel < 64; ++pixel) {
+        const uint r = block.r[pixel];
+        const uint g = block.g[pixel];
+        const uint b = block.b[pixel];
+        block.y[pixel]  = ((rToY[r]  + gToY[g]  + bToY[b])  >> rgbConstBits) - 128;
+        block.cb[pixel] =  (rToCb[r] + gToCb[g] + bToCb[b]) >> rgbConstBits;
+        block.cr[pixel] =  (rToCr[r] + gToCr[g] + bToCr[b]) >> rgbConstBits;
     }
 }
 
-// convert all pixels from RGB color space to YCbCr
-void RGBToYCbCr(const BMPImage& image) {
-    for (uint y = 0; y < image.blockHeight; ++y) {
+// convert the pixels of block rows [top, bottom) from RGB color space to YCbCr
+void RGBToYCbCr(const BMPImage& image, const uint top, const uint bottom) {
+    for (uint y = top; y < bottom; ++y) {
         for (uint x = 0; x < image.blockWidth; ++x) {
             RGBToYCbCrBlock(image.blocks[y * image.blockWidth + x]);
         }
     }
 }
 
+// convert all pixels from RGB color space to YCbCr
+void RGBToYCbCr(const BMPImage& image) {
+    RGBToYCbCr(image, 0, image.blockHeight);
+}
+
 // perform 1-D FDCT on all columns and rows of a block component
-//   resulting in 2-D FDCT
-void forwardDCTBlockComponent(int* const component) {
+//   in single precision throughout, resulting in 2-D FDCT with all outputs scaled up by 8
+//   and rounded to nearest, stored in zigzag order
+void forwardDCTBlockComponentFloat(int* const component) {
+    float intermediate[64];
+
     for (uint i = 0; i < 8; ++i) {
         const float a0 = component[0 * 8 + i];
         const float a1 = component[1 * 8 + i];
@@ -198,24 +158,24 @@ void forwardDCTBlockComponent(int* const component) {
         const float g6 = f5 - f6;
         const float g7 = f7 - f4;
 
-        component[0 * 8 + i] = g0 * s0;
-        component[4 * 8 + i] = g1 * s4;
-        component[2 * 8 + i] = g2 * s2;
-        component[6 * 8 + i] = g3 * s6;
-        component[5 * 8 + i] = g4 * s5;
-        component[1 * 8 + i] = g5 * s1;
-        component[7 * 8 + i] = g6 * s7;
-        component[3 * 8 + i] = g7 * s3;
+        intermediate[0 * 8 + i] = g0 * s0;
+        intermediate[4 * 8 + i] = g1 * s4;
+        intermediate[2 * 8 + i] = g2 * s2;
+        intermediate[6 * 8 + i] = g3 * s6;
+        intermediate[5 * 8 + i] = g4 * s5;
+        intermediate[1 * 8 + i] = g5 * s1;
+        intermediate[7 * 8 + i] = g6 * s7;
+        intermediate[3 * 8 + i] = g7 * s3;
     }
     for (uint i = 0; i < 8; ++i) {
-        const float a0 = component[i * 8 + 0];
-        const float a1 = component[i * 8 + 1];
-        const float a2 = component[i * 8 + 2];
-        const float a3 = component[i * 8 + 3];
-        const float a4 = component[i * 8 + 4];
-        const float a5 = component[i * 8 + 5];
-        const float a6 = component[i * 8 + 6];
-        const float a7 = component[i * 8 + 7];
+        const float a0 = intermediate[i * 8 + 0];
+        const float a1 = intermediate[i * 8 + 1];
+        const float a2 = intermediate[i * 8 + 2];
+        const float a3 = intermediate[i * 8 + 3];
+        const float a4 = intermediate[i * 8 + 4];
+        const float a5 = intermediate[i * 8 + 5];
+        const float a6 = intermediate[i * 8 + 6];
+        const float a7 = intermediate[i * 8 + 7];
 
         const float b0 = a0 + a7;
         const float b1 = a1 + a6;
@@ -273,54 +233,402 @@ void forwardDCTBlockComponent(int* const component) {
         const float g6 = f5 - f6;
         const float g7 = f7 - f4;
 
-        component[i * 8 + 0] = g0 * s0;
-        component[i * 8 + 4] = g1 * s4;
-        component[i * 8 + 2] = g2 * s2;
-        component[i * 8 + 6] = g3 * s6;
-        component[i * 8 + 5] = g4 * s5;
-        component[i * 8 + 1] = g5 * s1;
-        component[i * 8 + 7] = g6 * s7;
-        component[i * 8 + 3] = g7 * s3;
+        component[inverseZigZagMap[i * 8 + 0]] = roundDCTOutput(g0 * s0 * 8.0f);
+        component[inverseZigZagMap[i * 8 + 4]] = roundDCTOutput(g1 * s4 * 8.0f);
+        component[inverseZigZagMap[i * 8 + 2]] = roundDCTOutput(g2 * s2 * 8.0f);
+        component[inverseZigZagMap[i * 8 + 6]] = roundDCTOutput(g3 * s6 * 8.0f);
+        component[inverseZigZagMap[i * 8 + 5]] = roundDCTOutput(g4 * s5 * 8.0f);
+        component[inverseZigZagMap[i * 8 + 1]] = roundDCTOutput(g5 * s1 * 8.0f);
+        component[inverseZigZagMap[i * 8 + 7]] = roundDCTOutput(g6 * s7 * 8.0f);
+        component[inverseZigZagMap[i * 8 + 3]] = roundDCTOutput(g7 * s3 * 8.0f);
     }
 }
 
-// perform FDCT on all MCUs
-void forwardDCT(const BMPImage& image) {
-    for (uint y = 0; y < image.blockHeight; ++y) {
-        for (uint x = 0; x < image.blockWidth; ++x) {
+// shift right with rounding
+inline int descale(const int x, const uint n) {
+    return (x + (1 << (n - 1))) >> n;
+}
+
+// perform 1-D FDCT on all rows and columns of a block component
+//   using 32-bit integer math with 13-bit constants (LL&M)
+//   resulting in 2-D FDCT with all outputs scaled up by 8, stored in zigzag order
+void forwardDCTBlockComponentAccurate(int* const component) {
+    const uint pass1Shift = dctAccurateConstBits - dctAccuratePass1Bits;
+    const uint pass2Shift = dctAccurateConstBits + dctAccuratePass1Bits;
+
+    int intermediate[64];
+
+    for (uint i = 0; i < 8; ++i) {
+        const int* const row = component + i * 8;
+
+        int tmp0 = row[0] + row[7];
+        int tmp7 = row[0] - row[7];
+        int tmp1 = row[1] + row[6];
+        int tmp6 = row[1] - row[6];
+        int tmp2 = row[2] + row[5];
+        int tmp5 = row[2] - row[5];
+        int tmp3 = row[3] + row[4];
+        int tmp4 = row[3] - row[4];
+
+        // even part
+        const int tmp10 = tmp0 + tmp3;
+        const int tmp13 = tmp0 - tmp3;
+        const int tmp11 = tmp1 + tmp2;
+        const int tmp12 = tmp1 - tmp2;
+
+        intermediate[i * 8 + 0] = (tmp10 + tmp11) * (1 << dctAccuratePass1Bits);
+        intermediate[i * 8 + 4] = (tmp10 - tmp11) * (1 << dctAccuratePass1Bits);
+
+        int z1 = (tmp12 + tmp13) * FIX_0_541196100;
+        intermediate[i * 8 + 2] = descale(z1 + tmp13 * FIX_0_765366865, pass1Shift);
+        intermediate[i * 8 + 6] = descale(z1 - tmp12 * FIX_1_847759065, pass1Shift);
+
+        // odd part
+        z1 = tmp4 + tmp7;
+        int z2 = tmp5 + tmp6;
+        int z3 = tmp4 + tmp6;
+        int z4 = tmp5 + tmp7;
+        const int z5 = (z3 + z4) * FIX_1_175875602;
+
+        tmp4 *= FIX_0_298631336;
+        tmp5 *= FIX_2_053119869;
+        tmp6 *= FIX_3_072711026;
+        tmp7 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 *= -FIX_1_961570560;
+        z4 *= -FIX_0_390180644;
+
+        z3 += z5;
+        z4 += z5;
+
+        intermediate[i * 8 + 7] = descale(tmp4 + z1 + z3, pass1Shift);
+        intermediate[i * 8 + 5] = descale(tmp5 + z2 + z4, pass1Shift);
+        intermediate[i * 8 + 3] = descale(tmp6 + z2 + z3, pass1Shift);
+        intermediate[i * 8 + 1] = descale(tmp7 + z1 + z4, pass1Shift);
+    }
+    for (uint i = 0; i < 8; ++i) {
+        int tmp0 = intermediate[0 * 8 + i] + intermediate[7 * 8 + i];
+        int tmp7 = intermediate[0 * 8 + i] - intermediate[7 * 8 + i];
+        int tmp1 = intermediate[1 * 8 + i] + intermediate[6 * 8 + i];
+        int tmp6 = intermediate[1 * 8 + i] - intermediate[6 * 8 + i];
+        int tmp2 = intermediate[2 * 8 + i] + intermediate[5 * 8 + i];
+        int tmp5 = intermediate[2 * 8 + i] - intermediate[5 * 8 + i];
+        int tmp3 = intermediate[3 * 8 + i] + intermediate[4 * 8 + i];
+        int tmp4 = intermediate[3 * 8 + i] - intermediate[4 * 8 + i];
+
+        // even part
+        const int tmp10 = tmp0 + tmp3;
+        const int tmp13 = tmp0 - tmp3;
+        const int tmp11 = tmp1 + tmp2;
+        const int tmp12 = tmp1 - tmp2;
+
+        component[inverseZigZagMap[0 * 8 + i]] = descale(tmp10 + tmp11, dctAccuratePass1Bits);
+        component[inverseZigZagMap[4 * 8 + i]] = descale(tmp10 - tmp11, dctAccuratePass1Bits);
+
+        int z1 = (tmp12 + tmp13) * FIX_0_541196100;
+        component[inverseZigZagMap[2 * 8 + i]] = descale(z1 + tmp13 * FIX_0_765366865, pass2Shift);
+        component[inverseZigZagMap[6 * 8 + i]] = descale(z1 - tmp12 * FIX_1_847759065, pass2Shift);
+
+        // odd part
+        z1 = tmp4 + tmp7;
+        int z2 = tmp5 + tmp6;
+        int z3 = tmp4 + tmp6;
+        int z4 = tmp5 + tmp7;
+        const int z5 = (z3 + z4) * FIX_1_175875602;
+
+        tmp4 *= FIX_0_298631336;
+        tmp5 *= FIX_2_053119869;
+        tmp6 *= FIX_3_072711026;
+        tmp7 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 *= -FIX_1_961570560;
+        z4 *= -FIX_0_390180644;
+
+        z3 += z5;
+        z4 += z5;
+
+        component[inverseZigZagMap[7 * 8 + i]] = descale(tmp4 + z1 + z3, pass2Shift);
+        component[inverseZigZagMap[5 * 8 + i]] = descale(tmp5 + z2 + z4, pass2Shift);
+        component[inverseZigZagMap[3 * 8 + i]] = descale(tmp6 + z2 + z3, pass2Shift);
+        component[inverseZigZagMap[1 * 8 + i]] = descale(tmp7 + z1 + z4, pass2Shift);
+    }
+}
+
+// multiply by an 8-bit fixed point constant, truncating
+inline int multiplyFast(const int x, const int c) {
+    return (x * c) >> dctFastConstBits;
+}
+
+// perform 1-D FDCT on all rows and columns of a block component
+//   using integer math with 8-bit constants (AAN)
+//   resulting in 2-D FDCT with all outputs scaled up by 8 * aanScales,
+//   stored in zigzag order
+void forwardDCTBlockComponentFast(int* const component) {
+    int intermediate[64];
+
+    for (uint i = 0; i < 8; ++i) {
+        const int* const row = component + i * 8;
+
+        const int tmp0 = row[0] + row[7];
+        const int tmp7 = row[0] - row[7];
+        const int tmp1 = row[1] + row[6];
+        const int tmp6 = row[1] - row[6];
+        const int tmp2 = row[2] + row[5];
+        const int tmp5 = row[2] - row[5];
+        const int tmp3 = row[3] + row[4];
+        const int tmp4 = row[3] - row[4];
+
+        // even part
+        int tmp10 = tmp0 + tmp3;
+        const int tmp13 = tmp0 - tmp3;
+        int tmp11 = tmp1 + tmp2;
+        int tmp12 = tmp1 - tmp2;
+
+        intermediate[i * 8 + 0] = tmp10 + tmp11;
+        intermediate[i * 8 + 4] = tmp10 - tmp11;
+
+        const int z1 = multiplyFast(tmp12 + tmp13, FAST_0_707106781);
+        intermediate[i * 8 + 2] = tmp13 + z1;
+        intermediate[i * 8 + 6] = tmp13 - z1;
+
+        // odd part
+        tmp10 = tmp4 + tmp5;
+        tmp11 = tmp5 + tmp6;
+        tmp12 = tmp6 + tmp7;
+
+        const int z5 = multiplyFast(tmp10 - tmp12, FAST_0_382683433);
+        const int z2 = multiplyFast(tmp10, FAST_0_541196100) + z5;
+        const int z4 = multiplyFast(tmp12, FAST_1_306562965) + z5;
+        const int z3 = multiplyFast(tmp11, FAST_0_707106781);
+
+        const int z11 = tmp7 + z3;
+        const int z13 = tmp7 - z3;
+
+        intermediate[i * 8 + 5] = z13 + z2;
+        intermediate[i * 8 + 3] = z13 - z2;
+        intermediate[i * 8 + 1] = z11 + z4;
+        intermediate[i * 8 + 7] = z11 - z4;
+    }
+    for (uint i = 0; i < 8; ++i) {
+        const int tmp0 = intermediate[0 * 8 + i] + intermediate[7 * 8 + i];
+        const int tmp7 = intermediate[0 * 8 + i] - intermediate[7 * 8 + i];
+        const int tmp1 = intermediate[1 * 8 + i] + intermediate[6 * 8 + i];
+        const int tmp6 = intermediate[1 * 8 + i] - intermediate[6 * 8 + i];
+        const int tmp2 = intermediate[2 * 8 + i] + intermediate[5 * 8 + i];
+        const int tmp5 = intermediate[2 * 8 + i] - intermediate[5 * 8 + i];
+        const int tmp3 = intermediate[3 * 8 + i] + intermediate[4 * 8 + i];
+        const int tmp4 = intermediate[3 * 8 + i] - intermediate[4 * 8 + i];
+
+        // even part
+        int tmp10 = tmp0 + tmp3;
+        const int tmp13 = tmp0 - tmp3;
+        int tmp11 = tmp1 + tmp2;
+        int tmp12 = tmp1 - tmp2;
+
+        component[inverseZigZagMap[0 * 8 + i]] = tmp10 + tmp11;
+        component[inverseZigZagMap[4 * 8 + i]] = tmp10 - tmp11;
+
+        const int z1 = multiplyFast(tmp12 + tmp13, FAST_0_707106781);
+        component[inverseZigZagMap[2 * 8 + i]] = tmp13 + z1;
+        component[inverseZigZagMap[6 * 8 + i]] = tmp13 - z1;
+
+        // odd part
+        tmp10 = tmp4 + tmp5;
+        tmp11 = tmp5 + tmp6;
+        tmp12 = tmp6 + tmp7;
+
+        const int z5 = multiplyFast(tmp10 - tmp12, FAST_0_382683433);
+        const int z2 = multiplyFast(tmp10, FAST_0_541196100) + z5;
+        const int z4 = multiplyFast(tmp12, FAST_1_306562965) + z5;
+        const int z3 = multiplyFast(tmp11, FAST_0_707106781);
+
+        const int z11 = tmp7 + z3;
+        const int z13 = tmp7 - z3;
+
+        component[inverseZigZagMap[5 * 8 + i]] = z13 + z2;
+        component[inverseZigZagMap[3 * 8 + i]] = z13 - z2;
+        component[inverseZigZagMap[1 * 8 + i]] = z11 + z4;
+        component[inverseZigZagMap[7 * 8 + i]] = z11 - z4;
+    }
+}
+
+// perform FDCT on the MCUs in block rows [top, bottom)
+void forwardDCT(const BMPImage& image, const uint top, const uint bottom) {
+    void (*forwardDCTBlockComponent)(int* const) = forwardDCTBlockComponentFloat;
+    if (image.dctMethod == DCT_FAST) {
+        forwardDCTBlockComponent = forwardDCTBlockComponentFast;
+    }
+    else if (image.dctMethod == DCT_ACCURATE) {
+        forwardDCTBlockComponent = forwardDCTBlockComponentAccurate;
+    }
+
+    for (uint y = top; y < bottom; y += image.verticalSamplingFactor) {
+        for (uint x = 0; x < image.blockWidth; x += image.horizontalSamplingFactor) {
             for (uint i = 0; i < 3; ++i) {
-                forwardDCTBlockComponent(image.blocks[y * image.blockWidth + x][i]);
+                const uint vMax = (i == 0) ? image.verticalSamplingFactor : 1;
+                const uint hMax = (i == 0) ? image.horizontalSamplingFactor : 1;
+                for (uint v = 0; v < vMax; ++v) {
+                    for (uint h = 0; h < hMax; ++h) {
+                        forwardDCTBlockComponent(image.blocks[(y + v) * image.blockWidth + (x + h)][i]);
+                    }
+                }
             }
         }
     }
 }
 
-// quantize a block component based on a quantization table
+// perform FDCT on all MCUs
+void forwardDCT(const BMPImage& image) {
+    forwardDCT(image, 0, image.blockHeight);
+}
+
+// quantize a block component based on a table of divisors with quantizationFractionBits of fraction
 void quantizeBlockComponent(const QuantizationTable& qTable, int* const component) {
     for (uint i = 0; i < 64; ++i) {
-        component[i] /= (signed)qTable.table[i];
+        component[i] = component[i] * (1 << quantizationFractionBits) / (signed)qTable.table[i];
+    }
+}
+
+// quantize the MCUs in block rows [top, bottom)
+void quantize(const BMPImage& image, const uint top, const uint bottom) {
+    // the divisors have the scale of the integer FDCTs folded in
+    const QuantizationTable* const qTables[3] = {
+        &qDivisorsY100[image.dctMethod],
+        &qDivisorsCbCr100[image.dctMethod],
+        &qDivisorsCbCr100[image.dctMethod]
+    };
+
+    for (uint y = top; y < bottom; y += image.verticalSamplingFactor) {
+        for (uint x = 0; x < image.blockWidth; x += image.horizontalSamplingFactor) {
+            for (uint i = 0; i < 3; ++i) {
+                const uint vMax = (i == 0) ? image.verticalSamplingFactor : 1;
+                const uint hMax = (i == 0) ? image.horizontalSamplingFactor : 1;
+                for (uint v = 0; v < vMax; ++v) {
+                    for (uint h = 0; h < hMax; ++h) {
+                        quantizeBlockComponent(*qTables[i], image.blocks[(y + v) * image.blockWidth + (x + h)][i]);
+                    }
+                }
+            }
+        }
     }
 }
 
 // quantize all MCUs
 void quantize(const BMPImage& image) {
-    for (uint y = 0; y < image.blockHeight; ++y) {
-        for (uint x = 0; x < image.blockWidth; ++x) {
-            for (uint i = 0; i < 3; ++i) {
-                quantizeBlockComponent(*qTables100[i], image.blocks[y * image.blockWidth + x][i]);
+    quantize(image, 0, image.blockHeight);
+}
+
+// perform a direct 2-D IDCT in double precision on a block component
+//   whose coefficients are in zigzag order
+//   used to reconstruct the image when measuring the accuracy of the FDCTs
+void inverseDCTBlockComponentReference(int* const component) {
+    // filled in once, even when several threads get here at the same time
+    static const struct Cosines {
+        double values[8][8];
+        Cosines() {
+            for (uint x = 0; x < 8; ++x) {
+                for (uint u = 0; u < 8; ++u) {
+                    const double scale = (u == 0) ? (1.0 / std::sqrt(2.0)) : 1.0;
+                    values[x][u] = scale * std::cos((2.0 * x + 1.0) * u * M_PI / 16.0) / 2.0;
+                }
+            }
+        }
+    } cosines;
+
+    double intermediate[64];
+    for (uint v = 0; v < 8; ++v) {
+        for (uint x = 0; x < 8; ++x) {
+            double sum = 0.0;
+            for (uint u = 0; u < 8; ++u) {
+                sum += cosines.values[x][u] * component[inverseZigZagMap[v * 8 + u]];
             }
+            intermediate[v * 8 + x] = sum;
+        }
+    }
+    for (uint y = 0; y < 8; ++y) {
+        for (uint x = 0; x < 8; ++x) {
+            double sum = 0.0;
+            for (uint v = 0; v < 8; ++v) {
+                sum += cosines.values[y][v] * intermediate[v * 8 + x];
+            }
+            component[y * 8 + x] = (int)std::floor(sum + 0.5);
         }
     }
 }
 
+// time FDCT and quantization with every DCT method and measure the accuracy
+//   of each by reconstructing the image with a double precision IDCT
+void benchmarkDCT(BMPImage& image) {
+    const uint numBlocks = image.blockHeight * image.blockWidth;
+    Block* const samples = image.blocks;
+    Block* const output = new (std::nothrow) Block[numBlocks];
+    if (output == nullptr) {
+        std::cout << "Error - Memory error\n";
+        return;
+    }
+
+    const DCTMethod dctMethod = image.dctMethod;
+    const uint iterations = 5;
+    const DCTMethod methods[] = { DCT_FAST, DCT_ACCURATE, DCT_FLOAT };
+    const char* const names[] = { "fast", "accurate", "float" };
+
+    if (!image.planar) {
+        RGBToYCbCr(image);
+    }
+
+    std::cout << "DCT benchmark (FDCT + quantize, best of " << iterations << " runs)\n";
+    image.blocks = output;
+    for (uint m = 0; m < 3; ++m) {
+        image.dctMethod = methods[m];
+        double best = INFINITY;
+        for (uint i = 0; i < iterations; ++i) {
+            std::copy(samples, samples + numBlocks, output);
+            const auto start = std::chrono::steady_clock::now();
+            forwardDCT(image);
+            quantize(image);
+            const auto end = std::chrono::steady_clock::now();
+            best = std::min(best, std::chrono::duration<double, std::milli>(end - start).count());
+        }
+
+        double squaredError = 0.0;
+        for (uint i = 0; i < numBlocks; ++i) {
+            for (uint j = 0; j < 3; ++j) {
+                int* const component = output[i][j];
+                for (uint k = 0; k < 64; ++k) {
+                    component[k] *= qTables100[j]->table[zigZagMap[k]];
+                }
+                inverseDCTBlockComponentReference(component);
+                for (uint k = 0; k < 64; ++k) {
+                    const int sample = std::min(std::max(component[k], -128), 127);
+                    squaredError += (sample - samples[i][j][k]) * (sample - samples[i][j][k]);
+                }
+            }
+        }
+        const double mse = squaredError / (numBlocks * 3 * 64.0);
+        const double psnr = (mse == 0.0) ? INFINITY : 10.0 * std::log10(255.0 * 255.0 / mse);
+        std::cout << names[m] << ":\t" << best << " ms\tPSNR " << psnr << " dB\n";
+    }
+
+    image.blocks = samples;
+    image.dctMethod = dctMethod;
+    delete[] output;
+}
+
+// helper class to append bits, most significant first, to a byte vector
+//   without stuffing, no 0x00 is written after 0xFF bytes,
+//   so the bits can later be spliced into a stuffed stream at any bit position
 class BitWriter {
 private:
     byte nextBit = 0;
     std::vector<byte>& data;
+    const bool stuffing;
 
 public:
-    BitWriter(std::vector<byte>& d) :
-    data(d)
+    BitWriter(std::vector<byte>& d, const bool s = true) :
+    data(d),
+    stuffing(s)
     {}
 
     void writeBit(uint bit) {
@@ -329,7 +637,7 @@ public:
         }
         data.back() |= (bit & 1) << (7 - nextBit);
         nextBit = (nextBit + 1) % 8;
-        if (nextBit == 0 && data.back() == 0xFF) {
+        if (stuffing && nextBit == 0 && data.back() == 0xFF) {
             data.push_back(0);
         }
     }
@@ -339,19 +647,38 @@ public:
             writeBit(bits >> (length - i));
         }
     }
-};
 
-// generate all Huffman codes based on symbols from a Huffman table
-void generateCodes(HuffmanTable& hTable) {
-    uint code = 0;
-    for (uint i = 0; i < 16; ++i) {
-        for (uint j = hTable.offsets[i]; j < hTable.offsets[i + 1]; ++j) {
-            hTable.codes[j] = code;
-            code += 1;
+    // write 8 bits at once, shifted across the byte being filled
+    void writeByte(const byte bits) {
+        if (nextBit == 0) {
+            data.push_back(bits);
+            if (stuffing && bits == 0xFF) {
+                data.push_back(0);
+            }
+            return;
+        }
+        data.back() |= bits >> nextBit;
+        if (stuffing && data.back() == 0xFF) {
+            data.push_back(0);
         }
-        code <<= 1;
+        data.push_back((byte)(bits << (8 - nextBit)));
     }
-}
+
+    // write the first count bits written to source by another BitWriter without stuffing
+    void writeSplice(const std::vector<byte>& source, const std::size_t count) {
+        for (std::size_t i = 0; i < count / 8; ++i) {
+            writeByte(source[i]);
+        }
+        if (count % 8 != 0) {
+            writeBits(source[count / 8] >> (8 - count % 8), count % 8);
+        }
+    }
+
+    // bits written so far, excluding any stuffing
+    std::size_t bitCount() const {
+        return data.size() * 8 - (nextBit == 0 ? 0 : 8 - nextBit);
+    }
+};
 
 uint bitLength(int v) {
     uint length = 0;
@@ -362,25 +689,19 @@ uint bitLength(int v) {
     return length;
 }
 
-bool getCode(const HuffmanTable& hTable, byte symbol, uint& code, uint& codeLength) {
-    for (uint i = 0; i < 16; ++i) {
-        for (uint j = hTable.offsets[i]; j < hTable.offsets[i + 1]; ++j) {
-            if (symbol == hTable.symbols[j]) {
-                code = hTable.codes[j];
-                codeLength = i + 1;
-                return true;
-            }
-        }
-    }
-    return false;
+// look up the code of a symbol, failing if the table has none
+bool getCode(const HuffmanCodeTable& codeTable, byte symbol, uint& code, uint& codeLength) {
+    code = codeTable.codes[symbol];
+    codeLength = codeTable.lengths[symbol];
+    return codeLength != 0;
 }
 
 bool encodeBlockComponent(
     BitWriter& bitWriter,
     int* const component,
     int& previousDC,
-    const HuffmanTable& dcTable,
-    const HuffmanTable& acTable
+    const HuffmanCodeTable& dcTable,
+    const HuffmanCodeTable& acTable
 ) {
     // encode DC value
     int coeff = component[0] - previousDC;
@@ -408,7 +729,7 @@ bool encodeBlockComponent(
     for (uint i = 1; i < 64; ++i) {
         // find zero run length
         byte numZeroes = 0;
-        while (i < 64 && component[zigZagMap[i]] == 0) {
+        while (i < 64 && component[i] == 0) {
             numZeroes += 1;
             i += 1;
         }
@@ -432,7 +753,7 @@ bool encodeBlockComponent(
         }
 
         // find coeff length
-        coeff = component[zigZagMap[i]];
+        coeff = component[i];
         coeffLength = bitLength(std::abs(coeff));
         if (coeffLength > 10) {
             std::cout << "Error - AC coefficient length greater than 10\n";
@@ -455,201 +776,474 @@ bool encodeBlockComponent(
     return true;
 }
 
-// encode all the Huffman data from all MCUs
-std::vector<byte> encodeHuffmanData(const BMPImage& image) {
-    std::vector<byte> huffmanData;
-    BitWriter bitWriter(huffmanData);
+// encode the Huffman data of the MCUs in block rows [top, bottom),
+//   each block's DC value predicted from the previous one of its component
+bool encodeMCURows(BitWriter& bitWriter, const BMPImage& image, const uint top, const uint bottom,
+                   int (&previousDCs)[3]) {
+    for (uint y = top; y < bottom; y += image.verticalSamplingFactor) {
+        for (uint x = 0; x < image.blockWidth; x += image.horizontalSamplingFactor) {
+            for (uint i = 0; i < 3; ++i) {
+                const uint vMax = (i == 0) ? image.verticalSamplingFactor : 1;
+                const uint hMax = (i == 0) ? image.horizontalSamplingFactor : 1;
+                for (uint v = 0; v < vMax; ++v) {
+                    for (uint h = 0; h < hMax; ++h) {
+                        if (!encodeBlockComponent(
+                                bitWriter,
+                                image.blocks[(y + v) * image.blockWidth + (x + h)][i],
+                                previousDCs[i],
+                                *dcCodeTables[i],
+                                *acCodeTables[i])) {
+                            return false;
+                        }
+                    }
+                }
+            }
+        }
+    }
 
-    int previousDCs[3] = { 0 };
+    return true;
+}
 
-    for (uint i = 0; i < 3; ++i) {
-        if (!dcTables[i]->set) {
-            generateCodes(*dcTables[i]);
-            dcTables[i]->set = true;
+// the DC values the MCU starting block row top is predicted from,
+//   those of the last MCU of the row above, read from its quantized blocks
+void previousDCsAt(const BMPImage& image, const uint top, int (&previousDCs)[3]) {
+    if (top == 0) {
+        previousDCs[0] = previousDCs[1] = previousDCs[2] = 0;
+        return;
+    }
+    const uint mcuTop = top - image.verticalSamplingFactor;
+    const uint mcuLeft = image.blockWidth - image.horizontalSamplingFactor;
+    // luminance is last coded in the bottom-right block of the MCU, chroma in its top-left block
+    previousDCs[0] = image.blocks[(top - 1) * image.blockWidth + (image.blockWidth - 1)][0][0];
+    previousDCs[1] = image.blocks[mcuTop * image.blockWidth + mcuLeft][1][0];
+    previousDCs[2] = image.blocks[mcuTop * image.blockWidth + mcuLeft][2][0];
+}
+
+// Huffman data of a run of MCU rows, coded without stuffing to be spliced into the scan
+struct HuffmanChunk {
+    uint top = 0; // block rows [top, bottom)
+    uint bottom = 0;
+    std::vector<byte> bits;
+    std::size_t bitCount = 0;
+};
+
+// chunks of an image shared between the threads that transform and Huffman code them
+//   and the thread that splices them into the scan, in order, as they become ready
+class EncodeProgress {
+private:
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<bool> transformed; // chunks color converted, transformed and quantized
+    std::vector<bool> encoded;     // chunks Huffman coded
+    uint nextChunk = 0;
+    bool cancelled = false;
+
+public:
+    explicit EncodeProgress(const uint chunks) :
+    transformed(chunks, false),
+    encoded(chunks, false)
+    {}
+
+    void setTransformed(const uint chunk) {
+        std::lock_guard<std::mutex> lock(mutex);
+        transformed[chunk] = true;
+        changed.notify_all();
+    }
+
+    void setEncoded(const uint chunk) {
+        std::lock_guard<std::mutex> lock(mutex);
+        encoded[chunk] = true;
+        changed.notify_all();
+    }
+
+    // stop handing out chunks, as the image could not be encoded
+    void cancel() {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancelled = true;
+        changed.notify_all();
+    }
+
+    // take the next chunk, return false once there are none left or encoding was cancelled
+    bool nextChunkOf(uint& chunk) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (cancelled || nextChunk >= encoded.size()) {
+            return false;
         }
-        if (!acTables[i]->set) {
-            generateCodes(*acTables[i]);
-            acTables[i]->set = true;
+        chunk = nextChunk++;
+        return true;
+    }
+
+    // take the next chunk as long as it is not after last,
+    //   so a thread that needs chunk last codes it itself rather than wait for a thread that may never start
+    bool nextChunkUpTo(const uint last, uint& chunk) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (cancelled || nextChunk > last) {
+            return false;
         }
+        chunk = nextChunk++;
+        return true;
     }
 
-    for (uint y = 0; y < image.blockHeight; ++y) {
-        for (uint x = 0; x < image.blockWidth; ++x) {
-            for (uint i = 0; i < 3; ++i) {
-                if (!encodeBlockComponent(
-                        bitWriter,
-                        image.blocks[y * image.blockWidth + x][i],
-                        previousDCs[i],
-                        *dcTables[i],
-                        *acTables[i])) {
-                    return std::vector<byte>();
-                }
+    // wait until a chunk is transformed, return false if cancelled
+    bool waitTransformed(const uint chunk) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() { return cancelled || transformed[chunk]; });
+        return !cancelled;
+    }
+
+    // wait until a chunk is Huffman coded, return false if cancelled
+    bool waitEncoded(const uint chunk) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() { return cancelled || encoded[chunk]; });
+        return !cancelled;
+    }
+};
+
+// an image Huffman coded in chunks on several threads
+//   code transforms and Huffman codes one chunk
+struct ChunkedScan {
+    std::vector<HuffmanChunk> chunks;
+    EncodeProgress progress;
+    std::function<void(uint)> code;
+
+    explicit ChunkedScan(const uint numChunks) :
+    chunks(numChunks),
+    progress(numChunks)
+    {}
+};
+
+// encode all the Huffman data from all MCUs, appending it to data
+//   a chunked scan, if given, is instead spliced in chunk by chunk as each is coded
+bool encodeHuffmanData(const BMPImage& image, std::vector<byte>& data, ChunkedScan* const scan) {
+    BitWriter bitWriter(data);
+
+    if (scan != nullptr) {
+        for (uint c = 0; c < scan->chunks.size(); ++c) {
+            uint next = 0;
+            while (scan->progress.nextChunkUpTo(c, next)) {
+                scan->code(next);
             }
+            if (!scan->progress.waitEncoded(c)) {
+                return false;
+            }
+            bitWriter.writeSplice(scan->chunks[c].bits, scan->chunks[c].bitCount);
         }
+        return true;
     }
 
-    return huffmanData;
+    int previousDCs[3] = { 0 };
+    return encodeMCURows(bitWriter, image, 0, image.blockHeight, previousDCs);
 }
 
 // helper function to write a 2-byte short integer in big-endian
-void putShort(std::ofstream& outFile, const uint v) {
-    outFile.put((v >> 8) & 0xFF);
-    outFile.put((v >> 0) & 0xFF);
+void putShort(std::vector<byte>& jpg, const uint v) {
+    jpg.push_back((v >> 8) & 0xFF);
+    jpg.push_back((v >> 0) & 0xFF);
 }
 
-void writeQuantizationTable(std::ofstream& outFile, byte tableID, const QuantizationTable& qTable) {
-    outFile.put(0xFF);
-    outFile.put(DQT);
-    putShort(outFile, 67);
-    outFile.put(tableID);
+void writeQuantizationTable(std::vector<byte>& jpg, byte tableID, const QuantizationTable& qTable) {
+    jpg.push_back(0xFF);
+    jpg.push_back(DQT);
+    putShort(jpg, 67);
+    jpg.push_back(tableID);
     for (uint i = 0; i < 64; ++i) {
-        outFile.put(qTable.table[zigZagMap[i]]);
+        jpg.push_back(qTable.table[zigZagMap[i]]);
     }
 }
 
-void writeStartOfFrame(std::ofstream& outFile, const BMPImage& image) {
-    outFile.put(0xFF);
-    outFile.put(SOF0);
-    putShort(outFile, 17);
-    outFile.put(8);
-    putShort(outFile, image.height);
-    putShort(outFile, image.width);
-    outFile.put(3);
+void writeStartOfFrame(std::vector<byte>& jpg, const BMPImage& image) {
+    jpg.push_back(0xFF);
+    jpg.push_back(SOF0);
+    putShort(jpg, 17);
+    jpg.push_back(8);
+    putShort(jpg, image.height);
+    putShort(jpg, image.width);
+    jpg.push_back(3);
     for (uint i = 1; i <= 3; ++i) {
-        outFile.put(i);
-        outFile.put(0x11);
-        outFile.put(i == 1 ? 0 : 1);
+        jpg.push_back(i);
+        jpg.push_back(i == 1 ? (image.horizontalSamplingFactor << 4 | image.verticalSamplingFactor) : 0x11);
+        jpg.push_back(i == 1 ? 0 : 1);
     }
 }
 
-void writeHuffmanTable(std::ofstream& outFile, byte acdc, byte tableID, const HuffmanTable& hTable) {
-    outFile.put(0xFF);
-    outFile.put(DHT);
-    putShort(outFile, 19 + hTable.offsets[16]);
-    outFile.put(acdc << 4 | tableID);
+void writeHuffmanTable(std::vector<byte>& jpg, byte acdc, byte tableID, const HuffmanTable& hTable) {
+    jpg.push_back(0xFF);
+    jpg.push_back(DHT);
+    putShort(jpg, 19 + hTable.offsets[16]);
+    jpg.push_back(acdc << 4 | tableID);
     for (uint i = 0; i < 16; ++i) {
-        outFile.put(hTable.offsets[i + 1] - hTable.offsets[i]);
+        jpg.push_back(hTable.offsets[i + 1] - hTable.offsets[i]);
     }
     for (uint i = 0; i < 16; ++i) {
         for (uint j = hTable.offsets[i]; j < hTable.offsets[i + 1]; ++j) {
-            outFile.put(hTable.symbols[j]);
+            jpg.push_back(hTable.symbols[j]);
         }
     }
 }
 
-void writeStartOfScan(std::ofstream& outFile) {
-    outFile.put(0xFF);
-    outFile.put(SOS);
-    putShort(outFile, 12);
-    outFile.put(3);
+void writeStartOfScan(std::vector<byte>& jpg) {
+    jpg.push_back(0xFF);
+    jpg.push_back(SOS);
+    putShort(jpg, 12);
+    jpg.push_back(3);
     for (uint i = 1; i <= 3; ++i) {
-        outFile.put(i);
-        outFile.put(i == 1 ? 0x00 : 0x11);
-    }
-    outFile.put(0);
-    outFile.put(63);
-    outFile.put(0);
-}
-
-void writeAPP0(std::ofstream& outFile) {
-    outFile.put(0xFF);
-    outFile.put(APP0);
-    putShort(outFile, 16);
-    outFile.put('J');
-    outFile.put('F');
-    outFile.put('I');
-    outFile.put('F');
-    outFile.put(0);
-    outFile.put(1);
-    outFile.put(2);
-    outFile.put(0);
-    putShort(outFile, 100);
-    putShort(outFile, 100);
-    outFile.put(0);
-    outFile.put(0);
-}
-
-void writeJPG(const BMPImage& image, const std::string& filename) {
-    std::vector<byte> huffmanData = encodeHuffmanData(image);
-    if (huffmanData.size() == 0) {
-        return;
+        jpg.push_back(i);
+        jpg.push_back(i == 1 ? 0x00 : 0x11);
     }
+    jpg.push_back(0);
+    jpg.push_back(63);
+    jpg.push_back(0);
+}
 
-    // open file
-    std::cout << "Writing " << filename << "...\n";
-    std::ofstream outFile(filename, std::ios::out | std::ios::binary);
-    if (!outFile.is_open()) {
-        std::cout << "Error - Error opening output file\n";
-        return;
-    }
+void writeAPP0(std::vector<byte>& jpg) {
+    jpg.push_back(0xFF);
+    jpg.push_back(APP0);
+    putShort(jpg, 16);
+    jpg.push_back('J');
+    jpg.push_back('F');
+    jpg.push_back('I');
+    jpg.push_back('F');
+    jpg.push_back(0);
+    jpg.push_back(1);
+    jpg.push_back(2);
+    jpg.push_back(0);
+    putShort(jpg, 100);
+    putShort(jpg, 100);
+    jpg.push_back(0);
+    jpg.push_back(0);
+}
+
+// write a whole JPG to memory
+//   the Huffman data is encoded straight after the headers
+//   a chunked scan, if given, is spliced in as its chunks are coded on other threads
+bool writeJPG(const BMPImage& image, std::vector<byte>& jpg, ChunkedScan* const scan) {
+    jpg.clear();
 
     // SOI
-    outFile.put(0xFF);
-    outFile.put(SOI);
+    jpg.push_back(0xFF);
+    jpg.push_back(SOI);
 
     // APP0
-    writeAPP0(outFile);
+    writeAPP0(jpg);
 
     // DQT
-    writeQuantizationTable(outFile, 0, qTableY100);
-    writeQuantizationTable(outFile, 1, qTableCbCr100);
+    writeQuantizationTable(jpg, 0, qTableY100);
+    writeQuantizationTable(jpg, 1, qTableCbCr100);
 
     // SOF
-    writeStartOfFrame(outFile, image);
+    writeStartOfFrame(jpg, image);
 
     // DHT
-    writeHuffmanTable(outFile, 0, 0, hDCTableY);
-    writeHuffmanTable(outFile, 0, 1, hDCTableCbCr);
-    writeHuffmanTable(outFile, 1, 0, hACTableY);
-    writeHuffmanTable(outFile, 1, 1, hACTableCbCr);
+    writeHuffmanTable(jpg, 0, 0, hDCTableY);
+    writeHuffmanTable(jpg, 0, 1, hDCTableCbCr);
+    writeHuffmanTable(jpg, 1, 0, hACTableY);
+    writeHuffmanTable(jpg, 1, 1, hACTableCbCr);
 
     // SOS
-    writeStartOfScan(outFile);
+    writeStartOfScan(jpg);
 
     // ECS
-    outFile.write((char*)&huffmanData[0], huffmanData.size());
+    if (!encodeHuffmanData(image, jpg, scan)) {
+        jpg.clear();
+        return false;
+    }
 
     // EOI
-    outFile.put(0xFF);
-    outFile.put(EOI);
+    jpg.push_back(0xFF);
+    jpg.push_back(EOI);
 
-    outFile.close();
+    return true;
 }
 
-int main(int argc, char** argv) {
-    // validate arguments
-    if (argc < 2) {
-        std::cout << "Error - Invalid arguments\n";
-        return 1;
+// color convert, transform and quantize the MCUs in block rows [top, bottom)
+void transformRows(const BMPImage& image, const uint top, const uint bottom) {
+    // color conversion, planar input is already YCbCr
+    if (!image.planar) {
+        RGBToYCbCr(image, top, bottom);
     }
+    forwardDCT(image, top, bottom);
+    quantize(image, top, bottom);
+}
 
-    for (int i = 1; i < argc; ++i) {
-        const std::string filename(argv[i]);
+// color convert, transform, quantize and Huffman code chunks of MCU rows on up to image.threads - 1 threads
+//   while the calling thread writes the headers and splices each chunk into the scan, in order,
+//   as soon as it is coded, and codes any chunk it reaches that no thread has taken yet itself
+//   a chunk's first DC values are predicted from the last MCU of the chunk before it,
+//   so it only waits for that chunk to be transformed, which was handed out earlier
+//   the spliced scan is byte for byte the one encodeHuffmanData writes on its own
+bool encodeImagePipelined(BMPImage& image, std::vector<byte>& jpg) {
+    const uint mcuHeight = image.verticalSamplingFactor;
+    const uint mcuRows = image.blockHeight / mcuHeight;
+    // a few chunks per thread, so that threads finishing early can take more
+    const uint rowsPerChunk = std::max(mcuRows / (image.threads * 4), 1u);
+    ChunkedScan scan((mcuRows + rowsPerChunk - 1) / rowsPerChunk);
+    for (uint c = 0; c < scan.chunks.size(); ++c) {
+        scan.chunks[c].top = c * rowsPerChunk * mcuHeight;
+        scan.chunks[c].bottom = std::min((c + 1) * rowsPerChunk, mcuRows) * mcuHeight;
+    }
 
-        // read image
-        BMPImage image = readBMP(filename);
-        // validate image
-        if (image.blocks == nullptr) {
-            continue;
+    scan.code = [&](const uint c) {
+        HuffmanChunk& chunk = scan.chunks[c];
+        transformRows(image, chunk.top, chunk.bottom);
+        scan.progress.setTransformed(c);
+        if (c > 0 && !scan.progress.waitTransformed(c - 1)) {
+            return;
         }
 
-        // color conversion
+        int previousDCs[3];
+        previousDCsAt(image, chunk.top, previousDCs);
+        chunk.bits.clear();
+        BitWriter bitWriter(chunk.bits, false);
+        if (!encodeMCURows(bitWriter, image, chunk.top, chunk.bottom, previousDCs)) {
+            scan.progress.cancel();
+            return;
+        }
+        chunk.bitCount = bitWriter.bitCount();
+        scan.progress.setEncoded(c);
+    };
+    auto work = [&]() {
+        uint c = 0;
+        while (scan.progress.nextChunkOf(c)) {
+            scan.code(c);
+        }
+    };
+
+    Helpers helpers(image.scheduler);
+    helpers.start(image.threads - 1, work);
+
+    const bool encoded = writeJPG(image, jpg, &scan);
+    if (!encoded) {
+        scan.progress.cancel();
+    }
+    helpers.wait();
+    return encoded;
+}
+
+// color convert, transform, quantize and write a whole image
+bool encodeImage(BMPImage& image, std::vector<byte>& jpg) {
+    if (image.threads > 1) {
+        return encodeImagePipelined(image, jpg);
+    }
+
+    // color conversion, planar input is already YCbCr
+    if (!image.planar) {
         RGBToYCbCr(image);
+    }
+
+    // Forward Discrete Cosine Transform
+    forwardDCT(image);
+
+    // quantize DCT coefficients
+    quantize(image);
 
-        // Forward Discrete Cosine Transform
-        forwardDCT(image);
+    return writeJPG(image, jpg, nullptr);
+}
 
-        // quantize DCT coefficients
-        quantize(image);
+}
 
-        // write JPG file
-        const std::size_t pos = filename.find_last_of('.');
-        const std::string outFilename = (pos == std::string::npos) ?
-            (filename + ".jpg") :
-            (filename.substr(0, pos) + ".jpg");
-        writeJPG(image, outFilename);
+// state kept by an Encoder between images
+struct jed::Encoder::Context {
+    BlockBuffer blocks;
 
-        delete[] image.blocks;
+    // size the image and give it zeroed blocks padded to whole MCUs
+    bool start(BMPImage& image, const uint width, const uint height, const byte hSamp, const byte vSamp,
+               const EncodeOptions& options) {
+        if (height == 0 || width == 0 || height > 65535 || width > 65535) {
+            std::cout << "Error - Invalid dimensions\n";
+            return false;
+        }
+        if (hSamp < 1 || hSamp > 2 || vSamp < 1 || vSamp > 2) {
+            std::cout << "Error - Invalid sampling factors\n";
+            return false;
+        }
+
+        image.width = width;
+        image.height = height;
+        image.horizontalSamplingFactor = hSamp;
+        image.verticalSamplingFactor = vSamp;
+        image.blockHeight = ((height + 7) / 8 + vSamp - 1) / vSamp * vSamp;
+        image.blockWidth = ((width + 7) / 8 + hSamp - 1) / hSamp * hSamp;
+        image.dctMethod = options.dctMethod;
+        image.scheduler = options.scheduler;
+        image.threads = options.threads;
+        if (image.threads == 0) {
+            image.threads = (options.scheduler != nullptr) ? std::max(options.scheduler->size(), 1u) :
+                                                             std::max(std::thread::hardware_concurrency(), 1u);
+        }
+
+        image.blocks = blocks.get(image.blockHeight * image.blockWidth);
+        if (image.blocks == nullptr) {
+            std::cout << "Error - Memory error\n";
+            return false;
+        }
+        return true;
     }
-    return 0;
+};
+
+jed::Encoder::Encoder() :
+context(new (std::nothrow) Context)
+{}
+
+jed::Encoder::~Encoder() {
+    delete context;
+}
+
+bool jed::Encoder::encode(const byte* pixels, uint width, uint height, int stride, PixelFormat format,
+                          const EncodeOptions& options, std::vector<byte>& jpg) {
+    if (context == nullptr) {
+        std::cout << "Error - Memory error\n";
+        return false;
+    }
+    BMPImage image;
+    if (!context->start(image, width, height, 1, 1, options)) {
+        return false;
+    }
+    fillBlocks(image, pixels, stride, format);
+    return encodeImage(image, jpg);
+}
+
+bool jed::Encoder::encodePlanes(const byte* const planes[3], const int strides[3], uint width, uint height,
+                                byte hSamp, byte vSamp, uint numPlanes, const EncodeOptions& options, std::vector<byte>& jpg) {
+    if (context == nullptr) {
+        std::cout << "Error - Memory error\n";
+        return false;
+    }
+    BMPImage image;
+    if (!context->start(image, width, height, hSamp, vSamp, options)) {
+        return false;
+    }
+    image.planar = true;
+    fillPlanes(image, planes, strides, std::min(numPlanes, 3u));
+    return encodeImage(image, jpg);
+}
+
+bool jed::Encoder::benchmark(const byte* pixels, uint width, uint height, int stride, PixelFormat format,
+                             const EncodeOptions& options) {
+    if (context == nullptr) {
+        std::cout << "Error - Memory error\n";
+        return false;
+    }
+    BMPImage image;
+    if (!context->start(image, width, height, 1, 1, options)) {
+        return false;
+    }
+    fillBlocks(image, pixels, stride, format);
+    benchmarkDCT(image);
+    return true;
+}
+
+bool jed::Encoder::benchmarkPlanes(const byte* const planes[3], const int strides[3], uint width, uint height,
+                                   byte hSamp, byte vSamp, uint numPlanes, const EncodeOptions& options) {
+    if (context == nullptr) {
+        std::cout << "Error - Memory error\n";
+        return false;
+    }
+    BMPImage image;
+    if (!context->start(image, width, height, hSamp, vSamp, options)) {
+        return false;
+    }
+    image.planar = true;
+    fillPlanes(image, planes, strides, std::min(numPlanes, 3u));
+    benchmarkDCT(image);
+    return true;
 }
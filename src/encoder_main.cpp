@@ -0,0 +1,485 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <streambuf>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+
+#include "jed.h"
+#include "batch.h"
+#include "batch_io.h"
+
+using namespace jed;
+
+// an uncompressed image read from a file,
+//   either packed BGR pixels or planes of YCbCr samples
+struct InputImage {
+    uint width = 0;
+    uint height = 0;
+
+    std::vector<byte> pixels;
+    int stride = 0;
+
+    bool planar = false;
+    std::vector<byte> planes[3];
+    uint numPlanes = 0;
+    byte horizontalSamplingFactor = 1;
+    byte verticalSamplingFactor = 1;
+
+    // forget the layout of the previous image, keeping its buffers for the next
+    void reset() {
+        width = 0;
+        height = 0;
+        stride = 0;
+        planar = false;
+        numPlanes = 0;
+        horizontalSamplingFactor = 1;
+        verticalSamplingFactor = 1;
+    }
+};
+
+// helper function to read a 4-byte integer in little-endian
+uint getInt(std::istream& inFile) {
+    return (inFile.get() <<  0)
+         + (inFile.get() <<  8)
+         + (inFile.get() << 16)
+         + (inFile.get() << 24);
+}
+
+// helper function to read a 2-byte short integer in little-endian
+uint getShort(std::istream& inFile) {
+    return (inFile.get() << 0)
+         + (inFile.get() << 8);
+}
+
+// read a 24-bit or 8-bit paletted BMP as BGR pixels
+bool readBMP(std::istream& inFile, InputImage& image) {
+    if (inFile.get() != 'B' || inFile.get() != 'M') {
+        std::cout << "Error - Invalid BMP file\n";
+        return false;
+    }
+
+    getInt(inFile); // size
+    getInt(inFile); // nothing
+    const uint offset = getInt(inFile);
+    if (getInt(inFile) != 12) {
+        std::cout << "Error - Invalid DIB size\n";
+        return false;
+    }
+    image.width = getShort(inFile);
+    image.height = getShort(inFile);
+    if (getShort(inFile) != 1) {
+        std::cout << "Error - Invalid number of planes\n";
+        return false;
+    }
+    const uint bitDepth = getShort(inFile);
+    if (bitDepth != 24 && bitDepth != 8) {
+        std::cout << "Error - Invalid bit depth\n";
+        return false;
+    }
+
+    // 8-bit BMPs are followed by a palette of 256 BGR colors
+    byte palette[256][3] = { { 0 } };
+    if (bitDepth == 8) {
+        inFile.read((char*)palette, sizeof(palette));
+    }
+    if (offset != 0x1A + (bitDepth == 8 ? sizeof(palette) : 0)) {
+        std::cout << "Error - Invalid offset\n";
+        return false;
+    }
+
+    if (image.height == 0 || image.width == 0) {
+        std::cout << "Error - Invalid dimensions\n";
+        return false;
+    }
+
+    // BMP rows are stored bottom-up, so the pixels are read as they are
+    //   and handed to the encoder with a negative stride
+    const uint rowSize = image.width * 3;
+    const uint paddingSize = (4 - image.width * bitDepth / 8 % 4) % 4;
+    image.pixels.resize((std::size_t)image.height * rowSize);
+    std::vector<byte> row(image.width * bitDepth / 8 + paddingSize);
+    for (uint y = 0; y < image.height; ++y) {
+        inFile.read((char*)row.data(), row.size());
+        byte* const out = image.pixels.data() + (std::size_t)y * rowSize;
+        for (uint x = 0; x < image.width; ++x) {
+            const byte* const color = (bitDepth == 8) ? palette[row[x]] : &row[x * 3];
+            out[x * 3 + 0] = color[0];
+            out[x * 3 + 1] = color[1];
+            out[x * 3 + 2] = color[2];
+        }
+    }
+    if (!inFile) {
+        std::cout << "Error - File ended prematurely\n";
+        return false;
+    }
+    image.stride = -(int)rowSize;
+    return true;
+}
+
+// parse the digits of a Y4M W or H parameter, which must fit a JPG dimension
+bool parseY4MDimension(const std::string& digits, uint& dimension) {
+    if (digits.empty() || digits[0] < '0' || digits[0] > '9') {
+        return false;
+    }
+    char* end = nullptr;
+    errno = 0;
+    const unsigned long value = std::strtoul(digits.c_str(), &end, 10);
+    if (errno == ERANGE || *end != '\0' || value == 0 || value > 65535) {
+        return false;
+    }
+    dimension = (uint)value;
+    return true;
+}
+
+// read the first frame of a YUV4MPEG2 (Y4M) file
+//   8-bit 420, 422 and 444 chroma are kept at their native subsampling,
+//   mono input gets neutral chroma, and higher bit depths are rejected
+bool readY4M(std::istream& inFile, InputImage& image) {
+    std::string header;
+    std::getline(inFile, header);
+    if (header.compare(0, 10, "YUV4MPEG2 ") != 0) {
+        std::cout << "Error - Invalid Y4M file\n";
+        return false;
+    }
+
+    // parameters are space separated, each tagged by its first letter
+    std::string chroma = "420jpeg";
+    std::size_t pos = 9;
+    while (pos != std::string::npos && pos + 1 < header.size()) {
+        const std::size_t end = header.find(' ', pos + 1);
+        const std::string parameter = header.substr(pos + 1, end - pos - 1);
+        if (!parameter.empty()) {
+            if ((parameter[0] == 'W' && !parseY4MDimension(parameter.substr(1), image.width)) ||
+                (parameter[0] == 'H' && !parseY4MDimension(parameter.substr(1), image.height))) {
+                std::cout << "Error - Invalid dimensions\n";
+                return false;
+            }
+            else if (parameter[0] == 'C') {
+                chroma = parameter.substr(1);
+            }
+        }
+        pos = end;
+    }
+
+    image.planar = true;
+    image.numPlanes = 3;
+    if (chroma == "420" || chroma == "420jpeg" || chroma == "420mpeg2" || chroma == "420paldv") {
+        image.horizontalSamplingFactor = 2;
+        image.verticalSamplingFactor = 2;
+    }
+    else if (chroma == "422") {
+        image.horizontalSamplingFactor = 2;
+    }
+    else if (chroma == "mono") {
+        image.numPlanes = 1;
+    }
+    else if (chroma != "444") {
+        std::cout << "Error - Unsupported Y4M chroma: " << chroma << '\n';
+        return false;
+    }
+
+    if (image.height == 0 || image.width == 0 || image.height > 65535 || image.width > 65535) {
+        std::cout << "Error - Invalid dimensions\n";
+        return false;
+    }
+
+    std::string frame;
+    std::getline(inFile, frame);
+    if (frame.compare(0, 5, "FRAME") != 0) {
+        std::cout << "Error - Invalid Y4M frame\n";
+        return false;
+    }
+
+    const uint vSamp = image.verticalSamplingFactor;
+    const uint hSamp = image.horizontalSamplingFactor;
+    for (uint i = 0; i < image.numPlanes; ++i) {
+        const uint planeHeight = (i == 0) ? image.height : (image.height + vSamp - 1) / vSamp;
+        const uint planeWidth = (i == 0) ? image.width : (image.width + hSamp - 1) / hSamp;
+        image.planes[i].resize((std::size_t)planeHeight * planeWidth);
+        inFile.read((char*)image.planes[i].data(), image.planes[i].size());
+    }
+    if (!inFile) {
+        std::cout << "Error - File ended prematurely\n";
+        return false;
+    }
+    return true;
+}
+
+// a stream buffer reading a file already held in memory
+class MemoryStreamBuffer : public std::streambuf {
+public:
+    explicit MemoryStreamBuffer(std::vector<byte>& data) {
+        char* const begin = (char*)data.data();
+        setg(begin, begin, begin + data.size());
+    }
+};
+
+// write a JPG held in memory to a file
+bool writeFile(const std::vector<byte>& jpg, const std::string& filename, const bool log) {
+    if (log) {
+        std::cout << "Writing " << filename << "...\n";
+    }
+    std::ofstream outFile(filename, std::ios::out | std::ios::binary);
+    if (!outFile.is_open()) {
+        std::cout << "Error - Error opening output file\n";
+        return false;
+    }
+    outFile.write((const char*)jpg.data(), jpg.size());
+    outFile.close();
+    if (!outFile) {
+        std::cout << "Error - Error writing output file\n";
+        return false;
+    }
+    return true;
+}
+
+// parse a --dct= option value
+bool parseDCTMethod(const std::string& value, DCTMethod& dctMethod) {
+    if (value == "fast") {
+        dctMethod = DCT_FAST;
+    }
+    else if (value == "accurate") {
+        dctMethod = DCT_ACCURATE;
+    }
+    else if (value == "float") {
+        dctMethod = DCT_FLOAT;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+// parse a --threads= option value, 0 meaning one per core
+bool parseThreads(const std::string& value, uint& threads) {
+    char end = 0;
+    return std::sscanf(value.c_str(), "%u%c", &threads, &end) == 1;
+}
+
+// an encoder and the buffers it reuses from one file to the next
+//   in batch mode each worker thread has its own
+struct EncodeWorker {
+    Encoder encoder;
+    InputImage image;
+    std::vector<byte> jpg;
+
+    // the contents of the file, when read ahead in batch mode
+    std::vector<byte> data;
+};
+
+// read a BMP or Y4M image, depending on the extension of its filename, into the worker's image
+bool readImage(EncodeWorker& worker, const std::string& filename, std::istream& inFile) {
+    worker.image.reset();
+    return hasExtension(filename, { "y4m" }) ?
+        readY4M(inFile, worker.image) :
+        readBMP(inFile, worker.image);
+}
+
+// read one BMP or Y4M file into the worker's image
+bool readImage(EncodeWorker& worker, const std::string& filename, const bool log) {
+    // open file
+    if (log) {
+        std::cout << "Reading " << filename << "...\n";
+    }
+    std::ifstream inFile(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open()) {
+        std::cout << "Error - Error opening input file\n";
+        return false;
+    }
+    return readImage(worker, filename, inFile);
+}
+
+// encode the worker's image and write it out, recording the stage that failed, if any, in the result
+//   benchmark times the DCT stage instead of writing anything
+//   io, if set, is the batch's writer and index the position of the file in the batch
+bool encodeImage(EncodeWorker& worker, const std::string& outFilename, const EncodeOptions& options,
+                 const bool benchmark, const bool log, BatchIO* const io, const std::size_t index,
+                 BatchResult& result) {
+    result.output = outFilename;
+    const InputImage& image = worker.image;
+    result.width = image.width;
+    result.height = image.height;
+
+    const byte* const planes[3] = { image.planes[0].data(), image.planes[1].data(), image.planes[2].data() };
+    const uint vSamp = image.verticalSamplingFactor;
+    const uint hSamp = image.horizontalSamplingFactor;
+    const int strides[3] = {
+        (int)image.width,
+        (int)((image.width + hSamp - 1) / hSamp),
+        (int)((image.width + hSamp - 1) / hSamp)
+    };
+    // the rows of a BMP are stored bottom-up, so start from the last one
+    const byte* const topRow = image.planar ? nullptr :
+        image.pixels.data() + (std::size_t)(image.height - 1) * -image.stride;
+
+    if (benchmark) {
+        return image.planar ?
+            worker.encoder.benchmarkPlanes(planes, strides, image.width, image.height, hSamp, vSamp, image.numPlanes, options) :
+            worker.encoder.benchmark(topRow, image.width, image.height, image.stride, PIXEL_BGR, options);
+    }
+
+    const bool encoded = image.planar ?
+        worker.encoder.encodePlanes(planes, strides, image.width, image.height, hSamp, vSamp, image.numPlanes, options, worker.jpg) :
+        worker.encoder.encode(topRow, image.width, image.height, image.stride, PIXEL_BGR, options, worker.jpg);
+    if (!encoded) {
+        result.status = "encode";
+        return false;
+    }
+
+    // write JPG file, or queue it on the batch's writer, where it only counts as written once the writer is finished
+    if (io != nullptr) {
+        io->write(index, outFilename, worker.jpg);
+    }
+    else if (!writeFile(worker.jpg, outFilename, log)) {
+        result.status = "write";
+        return false;
+    }
+    return true;
+}
+
+// read one file, encode it and write it out, recording the stage that failed, if any, in the result
+bool encodeFile(EncodeWorker& worker, const std::string& filename, const std::string& outFilename,
+                const EncodeOptions& options, const bool benchmark, const bool log, BatchResult& result) {
+    result.output = outFilename;
+    if (!readImage(worker, filename, log)) {
+        result.status = "read";
+        return false;
+    }
+    return encodeImage(worker, outFilename, options, benchmark, log, nullptr, 0, result);
+}
+
+int main(int argc, char** argv) {
+    EncodeOptions options;
+    bool benchmark = false;
+    std::string batchInput;
+    std::string outDir;
+    uint jobs = 0;
+    bool affinity = false;
+    uint prefetch = 0;
+    uint ioMemory = 256;
+    bool useUring = true;
+    bool threadsGiven = false;
+    std::vector<std::string> filenames;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        if (arg.compare(0, 6, "--dct=") == 0) {
+            if (!parseDCTMethod(arg.substr(6), options.dctMethod)) {
+                std::cout << "Error - Invalid DCT method: " << arg.substr(6) << '\n';
+                return 1;
+            }
+        }
+        else if (arg.compare(0, 10, "--threads=") == 0) {
+            if (!parseThreads(arg.substr(10), options.threads)) {
+                std::cout << "Error - Invalid number of threads: " << arg.substr(10) << '\n';
+                return 1;
+            }
+            threadsGiven = true;
+        }
+        else if (arg.compare(0, 8, "--batch=") == 0) {
+            batchInput = arg.substr(8);
+        }
+        else if (arg.compare(0, 6, "--out=") == 0) {
+            outDir = arg.substr(6);
+        }
+        else if (arg.compare(0, 7, "--jobs=") == 0) {
+            if (!parseThreads(arg.substr(7), jobs)) {
+                std::cout << "Error - Invalid number of jobs: " << arg.substr(7) << '\n';
+                return 1;
+            }
+        }
+        else if (arg.compare(0, 11, "--prefetch=") == 0) {
+            if (!parseThreads(arg.substr(11), prefetch)) {
+                std::cout << "Error - Invalid number of files to prefetch: " << arg.substr(11) << '\n';
+                return 1;
+            }
+        }
+        else if (arg.compare(0, 12, "--io-memory=") == 0) {
+            if (!parseThreads(arg.substr(12), ioMemory) || ioMemory == 0) {
+                std::cout << "Error - Invalid I/O memory: " << arg.substr(12) << '\n';
+                return 1;
+            }
+        }
+        else if (arg.compare(0, 5, "--io=") == 0) {
+            if (arg.substr(5) != "uring" && arg.substr(5) != "threads") {
+                std::cout << "Error - Invalid I/O backend: " << arg.substr(5) << '\n';
+                return 1;
+            }
+            useUring = arg.substr(5) == "uring";
+        }
+        else if (arg == "--affinity") {
+            affinity = true;
+        }
+        else if (arg == "--benchmark") {
+            benchmark = true;
+        }
+        else if (arg.compare(0, 2, "--") == 0) {
+            std::cout << "Error - Unknown option: " << arg << '\n';
+            return 1;
+        }
+        else {
+            filenames.push_back(arg);
+        }
+    }
+
+    // validate arguments
+    //   a batch takes its files from --batch= and writes them to --out=
+    if (batchInput.empty() ? (filenames.empty() || !outDir.empty()) :
+                             (!filenames.empty() || outDir.empty() || benchmark)) {
+        std::cout << "Error - Invalid arguments\n";
+        return 1;
+    }
+
+    // encode every file of the batch on a pool of workers, without printing each file read and written
+    if (!batchInput.empty()) {
+        std::vector<std::string> files;
+        if (!listBatchFiles(batchInput, { "bmp", "y4m" }, files) || !makeOutputDirectory(outDir)) {
+            return 1;
+        }
+        // images are split into subtasks for the workers left idle, unless told otherwise
+        Scheduler scheduler(jobs, affinity);
+        options.scheduler = &scheduler;
+        if (!threadsGiven) {
+            options.threads = 0;
+        }
+        // inputs are read ahead, and outputs written behind, the workers in the background
+        BatchIO io(files, (prefetch > 0) ? prefetch : std::max(4 * scheduler.size(), 1u),
+                   (std::size_t)ioMemory << 20, useUring);
+        std::vector<BatchResult> results(files.size());
+        setBatchOutputPaths(outDir, files, "jpg", results);
+        runBatch<EncodeWorker>(scheduler, io, files.size(), results,
+            [&](EncodeWorker& worker, const std::size_t index, BatchResult& result) {
+                MemoryStreamBuffer buffer(worker.data);
+                std::istream inFile(&buffer);
+                if (!readImage(worker, files[index], inFile)) {
+                    result.status = "read";
+                    return;
+                }
+                encodeImage(worker, result.output, options, false, false, &io, index, result);
+            });
+        const bool written = writeBatchSummary(batchOutputPath(outDir, "summary", "tsv"), files, results);
+        std::cout << "Files read and written with " << io.backend() << '\n';
+        printWorkerStats(scheduler);
+        return written ? 0 : 1;
+    }
+
+    // one encoder, and its buffers, serves every file
+    //   the exit status is 1 if any file could not be read, encoded or written
+    EncodeWorker worker;
+    BatchResult result;
+    bool failed = false;
+
+    for (const std::string& filename : filenames) {
+        const std::size_t pos = filename.find_last_of('.');
+        const std::string outFilename = (pos == std::string::npos) ?
+            (filename + ".jpg") :
+            (filename.substr(0, pos) + ".jpg");
+        if (!encodeFile(worker, filename, outFilename, options, benchmark, true, result)) {
+            failed = true;
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,281 @@
+#ifndef JED_H
+#define JED_H
+
+#include <cstddef>
+#include <vector>
+#include <functional>
+
+// public interface of the jed library
+//   JPGs are decoded from and encoded to memory,
+//   file formats are left to the caller
+
+namespace jed {
+
+typedef unsigned char byte;
+typedef unsigned int uint;
+
+// DCT implementations, selected with --dct=
+enum DCTMethod {
+    DCT_FAST,     // integer AAN, 8-bit constants, low accuracy
+    DCT_ACCURATE, // integer LL&M, 13-bit constants, reproducible on all machines
+    DCT_FLOAT     // floating point AAN
+};
+
+// packed pixel layouts for decoded output and encoder input
+enum PixelFormat {
+    PIXEL_RGB,
+    PIXEL_BGR,
+    PIXEL_RGBA, // alpha is always 255
+    PIXEL_BGRA,
+    PIXEL_GRAY  // luma only
+};
+
+// bytes per pixel of each PixelFormat
+const uint pixelSizes[5] = { 3, 3, 4, 4, 1 };
+
+// chroma upsampling methods, selected with --upsample=
+enum ChromaUpsampling {
+    UPSAMPLE_NEAREST, // replicate each chroma sample
+    UPSAMPLE_FANCY    // triangular filter, blends in the nearest neighbouring chroma samples
+};
+
+// rectangle of pixels, used to decode only part of an image
+struct Region {
+    uint x = 0;
+    uint y = 0;
+    uint width = 0;  // 0 means the whole image
+    uint height = 0;
+};
+
+class Scheduler;
+
+// decoding options chosen by the caller
+struct DecodeOptions {
+    DCTMethod dctMethod = DCT_FLOAT;
+    byte scale = 1;
+    Region crop;
+    ChromaUpsampling upsampling = UPSAMPLE_NEAREST;
+    bool lumaOnly = false;
+
+    // threads used to decode, 0 for one per core
+    //   scans of progressive JPGs that do not depend on each other are entropy decoded at the same time,
+    //   MCU rows of baseline JPGs are reconstructed while the rest of the scan is entropy decoded,
+    //   and large baseline scans without restart markers are entropy decoded in chunks at the same time
+    uint threads = 1;
+
+    // if set, the other threads are subtasks on the scheduler's workers instead of threads of their own,
+    //   and 0 threads means one per worker
+    Scheduler* scheduler = nullptr;
+
+    // print each marker and the frame and scan headers as they are read
+    //   errors are always printed
+    bool verbose = false;
+};
+
+// encoding options chosen by the caller
+struct EncodeOptions {
+    DCTMethod dctMethod = DCT_FLOAT;
+
+    // threads used to encode, 0 for one per core
+    //   chunks of MCU rows are color converted, transformed, quantized and Huffman coded
+    //   by the other threads while the calling thread splices the chunks before them into the scan
+    //   the JPG is byte for byte the same as with one thread
+    uint threads = 1;
+
+    // if set, the other threads are subtasks on the scheduler's workers instead of threads of their own,
+    //   and 0 threads means one per worker
+    Scheduler* scheduler = nullptr;
+};
+
+// layout of a decoded image
+struct ImageInfo {
+    // output size after cropping and scaling
+    uint width = 0;
+    uint height = 0;
+
+    // size of the whole frame, before cropping and scaling
+    uint frameWidth = 0;
+    uint frameHeight = 0;
+
+    // SOF marker of the frame, 0xC0 for baseline and 0xC2 for progressive
+    byte frameType = 0;
+
+    // components in the frame, 1 for grayscale and 3 for color
+    uint frameComponents = 0;
+
+    // MCUs between restart markers at the first scan, 0 if there are none
+    uint restartInterval = 0;
+
+    // scans in the JPG, always 1 for baseline
+    uint numScans = 0;
+
+    // 1 for grayscale or luma-only output, otherwise 3
+    uint numComponents = 0;
+
+    // luminance sampling factors, chroma is never subsampled further
+    byte horizontalSamplingFactor = 1;
+    byte verticalSamplingFactor = 1;
+
+    // size of each plane at its own, possibly subsampled, resolution
+    uint planeWidths[3] = { 0 };
+    uint planeHeights[3] = { 0 };
+};
+
+// receives the rows of pixels produced by Decoder::decodeScanlines
+class ScanlineSink {
+public:
+    virtual ~ScanlineSink() {}
+
+    // called once the output dimensions are known, before any scanline
+    //   gray is set when the output has only luminance
+    virtual bool begin(const uint width, const uint height, const bool gray) = 0;
+
+    // called with each row of pixels, top to bottom, in the sink's pixel format
+    virtual bool writeScanline(const uint row, const byte* const pixels) = 0;
+
+    virtual PixelFormat pixelFormat() const {
+        return PIXEL_RGB;
+    }
+};
+
+// decodes JPGs held in memory
+//   one Decoder can decode any number of images, one at a time,
+//   and keeps its block buffer and the tables of the previous image between them
+//   like libjpeg, tables defined by an earlier image are used by
+//   later ones that leave them out
+class Decoder {
+public:
+    Decoder();
+    ~Decoder();
+
+    // read only the headers and fill in the layout the options would decode to
+    //   nothing is allocated and no entropy-coded data is decoded,
+    //   the scans of progressive JPGs are counted by searching it for markers
+    bool probe(const byte* data, std::size_t size, const DecodeOptions& options, ImageInfo& info);
+
+    // decode into packed pixels in the caller's memory, rows start stride bytes apart
+    //   info is the layout the memory was allocated for, from probe() with the same options
+    //   a negative stride stores the rows bottom-up
+    bool decode(const byte* data, std::size_t size, const DecodeOptions& options, PixelFormat format,
+                const ImageInfo& info, byte* pixels, int stride);
+
+    // decode into packed pixels of the given format, top row first
+    bool decode(const byte* data, std::size_t size, const DecodeOptions& options, PixelFormat format,
+                std::vector<byte>& pixels, ImageInfo& info);
+
+    // decode into Y, Cb and Cr planes in the caller's memory, each with its own row stride
+    //   info is the layout the memory was allocated for, from probe() with the same options
+    bool decodePlanes(const byte* data, std::size_t size, const DecodeOptions& options,
+                      const ImageInfo& info, byte* const planes[3], const int strides[3]);
+
+    // decode into Y, Cb and Cr planes at their native subsampling,
+    //   without upsampling or color conversion
+    //   only the first info.numComponents planes are filled
+    bool decodePlanes(const byte* data, std::size_t size, const DecodeOptions& options,
+                      std::vector<byte> (&planes)[3], ImageInfo& info);
+
+    // decode and pass the pixels to the sink one row at a time
+    //   baseline JPGs only hold one MCU row of blocks in memory
+    bool decodeScanlines(const byte* data, std::size_t size, const DecodeOptions& options, ScanlineSink& sink);
+
+    // time the DCT stage with every method instead of producing output
+    bool benchmark(const byte* data, std::size_t size, const DecodeOptions& options);
+
+private:
+    struct Context;
+    Context* context;
+
+    Decoder(const Decoder&) = delete;
+    Decoder& operator=(const Decoder&) = delete;
+};
+
+// encodes images as baseline JPGs in memory
+//   one Encoder can encode any number of images, one at a time,
+//   and keeps its block buffer between them
+//   the standard tables are compile-time constants and Encoders share no other state,
+//   so any number of threads can encode at once, each with its own Encoder
+class Encoder {
+public:
+    Encoder();
+    ~Encoder();
+
+    // encode packed pixels, rows start stride bytes apart
+    //   a negative stride reads the rows bottom-up
+    bool encode(const byte* pixels, uint width, uint height, int stride, PixelFormat format,
+                const EncodeOptions& options, std::vector<byte>& jpg);
+
+    // encode Y, Cb and Cr planes as they are, keeping their chroma subsampling
+    //   chroma planes are (width / hSamp) x (height / vSamp), rounded up
+    //   with only 1 plane the chroma is neutral
+    bool encodePlanes(const byte* const planes[3], const int strides[3], uint width, uint height,
+                      byte hSamp, byte vSamp, uint numPlanes, const EncodeOptions& options, std::vector<byte>& jpg);
+
+    // time the DCT stage with every method instead of producing output
+    bool benchmark(const byte* pixels, uint width, uint height, int stride, PixelFormat format,
+                   const EncodeOptions& options);
+    bool benchmarkPlanes(const byte* const planes[3], const int strides[3], uint width, uint height,
+                         byte hSamp, byte vSamp, uint numPlanes, const EncodeOptions& options);
+
+private:
+    struct Context;
+    Context* context;
+
+    Encoder(const Encoder&) = delete;
+    Encoder& operator=(const Encoder&) = delete;
+};
+
+// time a worker of a Scheduler has spent running tasks
+struct WorkerStats {
+    // time spent running tasks, including any time they spend waiting on each other,
+    //   out of the time since the worker started
+    double busySeconds = 0;
+    double elapsedSeconds = 0;
+
+    // tasks run, and how many of them were stolen from the queues of other workers
+    std::size_t tasks = 0;
+    std::size_t stolen = 0;
+};
+
+// a pool of worker threads shared by any number of Decoders and Encoders
+//   every worker has its own queue of tasks: it runs the newest task on its own queue,
+//   and once that is empty steals the oldest task on another worker's
+//   whole images are submitted as root tasks, and the scans, chunks and MCU rows of an image
+//   decoded or encoded with the scheduler in its options are submitted by the worker running it as subtasks,
+//   so idle workers take other images first, and help with the images still running once none are left
+//   a task that waits on a subtask only waits for one that has started, and never runs other tasks meanwhile
+class Scheduler {
+public:
+    // threads workers, 0 for one per core
+    //   with pinned set, each worker is bound to its own core, in turn from those the process may run on,
+    //   where the system allows it
+    explicit Scheduler(uint threads = 0, bool pinned = false);
+
+    // waits for every task to finish
+    ~Scheduler();
+
+    // number of workers, 0 if none could be started and tasks are run as they are submitted
+    uint size() const;
+
+    // queue a task, on the calling worker's own queue when called from a worker
+    void submit(const std::function<void()>& task);
+
+    // wait until every task submitted so far has finished
+    void wait();
+
+    // index of the worker calling, or size() from any other thread
+    uint workerIndex() const;
+
+    // the time each worker has spent running tasks so far
+    void getStats(std::vector<WorkerStats>& stats) const;
+
+private:
+    struct Context;
+    Context* context;
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+};
+
+}
+
+#endif
@@ -0,0 +1,176 @@
+#include <new>
+
+#include "jed.h"
+#include "jed_c.h"
+
+// every entry point that can allocate catches any exception, std::bad_alloc from a std::vector in the library
+//   above all, and fails instead, as an exception must not unwind into the C caller
+struct jed_decoder {
+    jed::Decoder decoder;
+    std::vector<jed::byte> pixels;
+};
+
+struct jed_encoder {
+    jed::Encoder encoder;
+    std::vector<jed::byte> data;
+};
+
+// accept only values that name a member of the enum
+static bool validFormat(const int format) {
+    return format >= JED_PIXEL_RGB && format <= JED_PIXEL_GRAY;
+}
+
+static bool validDCTMethod(const int dctMethod) {
+    return dctMethod >= JED_DCT_FAST && dctMethod <= JED_DCT_FLOAT;
+}
+
+// convert C decoding options, NULL meaning the defaults
+static bool toDecodeOptions(const jed_decode_options* options, jed::DecodeOptions& decodeOptions) {
+    if (options == nullptr) {
+        return true;
+    }
+    if (!validDCTMethod(options->dct_method) ||
+        (options->scale != 1 && options->scale != 2 && options->scale != 4 && options->scale != 8) ||
+        options->threads < 0) {
+        return false;
+    }
+    decodeOptions.dctMethod = (jed::DCTMethod)options->dct_method;
+    decodeOptions.scale = options->scale;
+    decodeOptions.crop.x = options->crop_x;
+    decodeOptions.crop.y = options->crop_y;
+    decodeOptions.crop.width = options->crop_width;
+    decodeOptions.crop.height = options->crop_height;
+    decodeOptions.upsampling = options->fancy_upsampling ? jed::UPSAMPLE_FANCY : jed::UPSAMPLE_NEAREST;
+    decodeOptions.lumaOnly = options->luma_only != 0;
+    decodeOptions.threads = options->threads;
+    return true;
+}
+
+void jed_decode_options_init(jed_decode_options* options) {
+    options->dct_method = JED_DCT_FLOAT;
+    options->scale = 1;
+    options->crop_x = 0;
+    options->crop_y = 0;
+    options->crop_width = 0;
+    options->crop_height = 0;
+    options->fancy_upsampling = 0;
+    options->luma_only = 0;
+    options->threads = 1;
+}
+
+jed_decoder* jed_decoder_create(void) {
+    try {
+        return new (std::nothrow) jed_decoder;
+    }
+    catch (...) {
+        return nullptr;
+    }
+}
+
+void jed_decoder_destroy(jed_decoder* decoder) {
+    delete decoder;
+}
+
+int jed_probe(jed_decoder* decoder, const unsigned char* data, size_t size, const jed_decode_options* options,
+              unsigned int* width, unsigned int* height, unsigned int* components) {
+    try {
+        jed::DecodeOptions decodeOptions;
+        if (decoder == nullptr || data == nullptr || !toDecodeOptions(options, decodeOptions)) {
+            return 0;
+        }
+
+        jed::ImageInfo info;
+        if (!decoder->decoder.probe(data, size, decodeOptions, info)) {
+            return 0;
+        }
+        *width = info.width;
+        *height = info.height;
+        *components = info.numComponents;
+        return 1;
+    }
+    catch (...) {
+        return 0;
+    }
+}
+
+int jed_decode_into(jed_decoder* decoder, const unsigned char* data, size_t size, const jed_decode_options* options,
+                    int format, unsigned char* pixels, unsigned int width, unsigned int height, int stride) {
+    try {
+        jed::DecodeOptions decodeOptions;
+        if (decoder == nullptr || data == nullptr || pixels == nullptr || !validFormat(format) ||
+            !toDecodeOptions(options, decodeOptions)) {
+            return 0;
+        }
+
+        // the layout is probed again, as C callers only keep its size
+        jed::ImageInfo info;
+        if (!decoder->decoder.probe(data, size, decodeOptions, info) || info.width != width || info.height != height) {
+            return 0;
+        }
+        return decoder->decoder.decode(data, size, decodeOptions, (jed::PixelFormat)format, info,
+                                       pixels, stride) ? 1 : 0;
+    }
+    catch (...) {
+        return 0;
+    }
+}
+
+int jed_decode(jed_decoder* decoder, const unsigned char* data, size_t size, const jed_decode_options* options,
+               int format, const unsigned char** pixels, unsigned int* width, unsigned int* height) {
+    try {
+        if (decoder == nullptr || data == nullptr || !validFormat(format)) {
+            return 0;
+        }
+
+        jed::DecodeOptions decodeOptions;
+        if (!toDecodeOptions(options, decodeOptions)) {
+            return 0;
+        }
+
+        jed::ImageInfo info;
+        if (!decoder->decoder.decode(data, size, decodeOptions, (jed::PixelFormat)format, decoder->pixels, info)) {
+            return 0;
+        }
+        *pixels = decoder->pixels.data();
+        *width = info.width;
+        *height = info.height;
+        return 1;
+    }
+    catch (...) {
+        return 0;
+    }
+}
+
+jed_encoder* jed_encoder_create(void) {
+    try {
+        return new (std::nothrow) jed_encoder;
+    }
+    catch (...) {
+        return nullptr;
+    }
+}
+
+void jed_encoder_destroy(jed_encoder* encoder) {
+    delete encoder;
+}
+
+int jed_encode(jed_encoder* encoder, const unsigned char* pixels, unsigned int width, unsigned int height,
+               int stride, int format, int dct_method, const unsigned char** data, size_t* size) {
+    try {
+        if (encoder == nullptr || pixels == nullptr || !validFormat(format) || !validDCTMethod(dct_method)) {
+            return 0;
+        }
+
+        jed::EncodeOptions options;
+        options.dctMethod = (jed::DCTMethod)dct_method;
+        if (!encoder->encoder.encode(pixels, width, height, stride, (jed::PixelFormat)format, options, encoder->data)) {
+            return 0;
+        }
+        *data = encoder->data.data();
+        *size = encoder->data.size();
+        return 1;
+    }
+    catch (...) {
+        return 0;
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef JED_C_H
+#define JED_C_H
+
+#include <stddef.h>
+
+// C interface to the jed library
+//   functions returning int return 1 on success and 0 on failure, running out of memory included,
+//   and no C++ exception reaches the caller
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct jed_decoder jed_decoder;
+typedef struct jed_encoder jed_encoder;
+
+// packed pixel layouts, as jed::PixelFormat
+enum {
+    JED_PIXEL_RGB,
+    JED_PIXEL_BGR,
+    JED_PIXEL_RGBA,
+    JED_PIXEL_BGRA,
+    JED_PIXEL_GRAY
+};
+
+// DCT implementations, as jed::DCTMethod
+enum {
+    JED_DCT_FAST,
+    JED_DCT_ACCURATE,
+    JED_DCT_FLOAT
+};
+
+// as jed::DecodeOptions, fill in with jed_decode_options_init first
+typedef struct {
+    int dct_method;
+    int scale; // 1, 2, 4 or 8
+    unsigned int crop_x;
+    unsigned int crop_y;
+    unsigned int crop_width; // 0 means the whole image
+    unsigned int crop_height;
+    int fancy_upsampling;
+    int luma_only;
+    int threads; // 0 for one per core
+} jed_decode_options;
+
+void jed_decode_options_init(jed_decode_options* options);
+
+// a decoder keeps its buffers and tables from one image to the next
+jed_decoder* jed_decoder_create(void);
+void jed_decoder_destroy(jed_decoder* decoder);
+
+// read only the headers and give the output size the options would decode to
+//   components is 1 for grayscale or luma-only output, otherwise 3
+int jed_probe(jed_decoder* decoder, const unsigned char* data, size_t size, const jed_decode_options* options,
+              unsigned int* width, unsigned int* height, unsigned int* components);
+
+// decode into packed pixels in the caller's memory, rows start stride bytes apart
+//   width and height are the size the memory was allocated for, from jed_probe with the same options
+int jed_decode_into(jed_decoder* decoder, const unsigned char* data, size_t size, const jed_decode_options* options,
+                    int format, unsigned char* pixels, unsigned int width, unsigned int height, int stride);
+
+// decode a JPG held in memory into packed pixels, top row first
+//   options may be NULL for the defaults
+//   the pixels belong to the decoder and stay valid until its next call
+int jed_decode(jed_decoder* decoder, const unsigned char* data, size_t size, const jed_decode_options* options,
+               int format, const unsigned char** pixels, unsigned int* width, unsigned int* height);
+
+// an encoder keeps its buffers from one image to the next
+jed_encoder* jed_encoder_create(void);
+void jed_encoder_destroy(jed_encoder* encoder);
+
+// encode packed pixels as a baseline JPG, rows start stride bytes apart
+//   the JPG belongs to the encoder and stays valid until its next call
+int jed_encode(jed_encoder* encoder, const unsigned char* pixels, unsigned int width, unsigned int height,
+               int stride, int format, int dct_method, const unsigned char** data, size_t* size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,10 +3,15 @@
 
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include <algorithm>
+#include <new>
+#include <vector>
+#include <memory>
+#include <thread>
 
+#include "jed.h"
 
-typedef unsigned char byte;
-typedef unsigned int uint;
+using namespace jed;
 
 // Start of Frame markers, non-differential, Huffman coding
 const byte SOF0 = 0xC0; // Baseline DCT
@@ -106,6 +111,25 @@ struct HuffmanTable {
     bool set = false;
 };
 
+// Huffman codes up to this long are decoded with a single lookup
+const uint huffmanLookupBits = 12;
+
+// what the decoder reads for one value of the next huffmanLookupBits bits
+struct HuffmanLookupEntry {
+    // the magnitude bits following the code, as a sign-extended coefficient
+    short value;
+    byte symbol;
+    // 0 if the code is longer than huffmanLookupBits
+    byte codeLength : 4;
+    // code and magnitude bits together, 0 if they do not all fit
+    byte totalLength : 4;
+};
+
+// built by the decoder from a HuffmanTable
+struct HuffmanLookup {
+    HuffmanLookupEntry entries[1 << huffmanLookupBits] = {};
+};
+
 struct ColorComponent {
     byte horizontalSamplingFactor = 0;
     byte verticalSamplingFactor = 0;
@@ -141,12 +165,76 @@ struct Block {
                 return nullptr;
         }
     }
+    const int* operator[](uint i) const {
+        return const_cast<Block&>(*this)[i];
+    }
+};
+
+// blocks reused from one image to the next
+//   only reallocated when an image needs more blocks than any before it
+class BlockBuffer {
+private:
+    Block* blocks = nullptr;
+    std::size_t capacity = 0;
+
+public:
+    BlockBuffer() {}
+    BlockBuffer(const BlockBuffer&) = delete;
+    BlockBuffer& operator=(const BlockBuffer&) = delete;
+
+    ~BlockBuffer() {
+        delete[] blocks;
+    }
+
+    // return count zeroed blocks, or nullptr if out of memory
+    Block* get(const std::size_t count) {
+        if (count > capacity) {
+            delete[] blocks;
+            blocks = new (std::nothrow) Block[count];
+            capacity = (blocks == nullptr) ? 0 : count;
+            return blocks;
+        }
+        std::fill(blocks, blocks + count, Block());
+        return blocks;
+    }
+};
+
+// copies of a function run alongside the calling thread to share its work
+//   as subtasks that idle workers of the scheduler can steal when there is one,
+//   otherwise each on a thread of its own
+//   copies that have not started by the time wait is called never run,
+//   so the calling thread must be able to finish the work alone,
+//   and a copy must only ever wait for work that a running thread has taken
+class Helpers {
+private:
+    struct State;
+
+    Scheduler* const scheduler;
+    std::vector<std::thread> threads;
+    std::shared_ptr<State> state;
+
+public:
+    explicit Helpers(Scheduler* const s);
+    Helpers(const Helpers&) = delete;
+    Helpers& operator=(const Helpers&) = delete;
+
+    ~Helpers() {
+        wait();
+    }
+
+    // run count copies of work, stopping early if no more threads can be started
+    void start(const uint count, const std::function<void()>& work);
+
+    // wait for the copies that have started to return
+    void wait();
 };
 
 struct JPGImage {
     QuantizationTable quantizationTables[4];
     HuffmanTable huffmanDCTables[4];
     HuffmanTable huffmanACTables[4];
+    HuffmanLookup huffmanDCLookups[4];
+    HuffmanLookup huffmanACLookups[4];
     ColorComponent colorComponents[3];
 
     byte frameType = 0;
@@ -163,6 +251,9 @@ struct JPGImage {
 
     uint restartInterval = 0;
 
+    // scans read so far
+    uint numScans = 0;
+
     Block* blocks = nullptr;
 
     bool valid = true;
@@ -174,6 +265,34 @@ struct JPGImage {
 
     byte horizontalSamplingFactor = 0;
     byte verticalSamplingFactor = 0;
+
+    DCTMethod dctMethod = DCT_FLOAT;
+
+    // decode at 1/scale of the full size (1, 2, 4 or 8)
+    //   each block then holds a (8 / scale) x (8 / scale) corner of pixels
+    byte scale = 1;
+
+    // region of interest in pixels and the MCU-aligned blocks covering it
+    //   blocks outside of it are never dequantized, transformed, or converted
+    Region crop;
+    uint cropBlockTop = 0;
+    uint cropBlockLeft = 0;
+    uint cropBlockBottom = 0;
+    uint cropBlockRight = 0;
+
+    ChromaUpsampling upsampling = UPSAMPLE_NEAREST;
+
+    // only decode luminance, chroma is entropy decoded where it shares a scan with luminance
+    //   but never dequantized, transformed or output
+    bool lumaOnly = false;
+
+    // threads used to decode, at least 1
+    uint threads = 1;
+
+    // workers the other threads run on as subtasks, if set
+    Scheduler* scheduler = nullptr;
+    // print each marker and the frame and scan headers as they are read
+    bool verbose = false;
 };
 
 struct BMPImage {
@@ -182,11 +301,28 @@ struct BMPImage {
 
     Block* blocks = nullptr;
 
+    // padded to whole MCUs
     uint blockHeight = 0;
     uint blockWidth = 0;
+
+    // luminance sampling factors, chroma is never subsampled further
+    //   the chroma of an MCU is stored in its top-left block
+    byte horizontalSamplingFactor = 1;
+    byte verticalSamplingFactor = 1;
+
+    // samples were read as YCbCr planes rather than RGB
+    bool planar = false;
+
+    DCTMethod dctMethod = DCT_FLOAT;
+
+    // threads used to encode, at least 1
+    uint threads = 1;
+
+    // workers the other threads run on as subtasks, if set
+    Scheduler* scheduler = nullptr;
 };
 
-const byte zigZagMap[] = {
+constexpr byte zigZagMap[] = {
     0,   1,  8, 16,  9,  2,  3, 10,
     17, 24, 32, 25, 18, 11,  4,  5,
     12, 19, 26, 33, 40, 48, 41, 34,
@@ -197,26 +333,155 @@ const byte zigZagMap[] = {
     53, 60, 61, 54, 47, 55, 62, 63
 };
 
+// the inverse of zigZagMap, the zigzag position of each coefficient in natural order
+//   coefficients are kept in zigzag order between entropy coding and the DCTs,
+//   which read or write them through this table
+constexpr byte inverseZigZagMap[] = {
+     0,  1,  5,  6, 14, 15, 27, 28,
+     2,  4,  7, 13, 16, 26, 29, 42,
+     3,  8, 12, 17, 25, 30, 41, 43,
+     9, 11, 18, 24, 31, 40, 44, 53,
+    10, 19, 23, 32, 39, 45, 52, 54,
+    20, 22, 33, 38, 46, 51, 55, 60,
+    21, 34, 37, 47, 50, 56, 59, 61,
+    35, 36, 48, 49, 57, 58, 62, 63
+};
+
 // IDCT scaling factors
-const float m0 = 2.0 * std::cos(1.0 / 16.0 * 2.0 * M_PI);
-const float m1 = 2.0 * std::cos(2.0 / 16.0 * 2.0 * M_PI);
-const float m3 = 2.0 * std::cos(2.0 / 16.0 * 2.0 * M_PI);
-const float m5 = 2.0 * std::cos(3.0 / 16.0 * 2.0 * M_PI);
-const float m2 = m0 - m5;
-const float m4 = m0 + m5;
-
-const float s0 = std::cos(0.0 / 16.0 * M_PI) / std::sqrt(8);
-const float s1 = std::cos(1.0 / 16.0 * M_PI) / 2.0;
-const float s2 = std::cos(2.0 / 16.0 * M_PI) / 2.0;
-const float s3 = std::cos(3.0 / 16.0 * M_PI) / 2.0;
-const float s4 = std::cos(4.0 / 16.0 * M_PI) / 2.0;
-const float s5 = std::cos(5.0 / 16.0 * M_PI) / 2.0;
-const float s6 = std::cos(6.0 / 16.0 * M_PI) / 2.0;
-const float s7 = std::cos(7.0 / 16.0 * M_PI) / 2.0;
+//   precomputed so that no static initialization is needed
+constexpr float m0 = 1.84775901f;  // 2.0 * cos(1.0 / 16.0 * 2.0 * pi)
+constexpr float m1 = 1.41421354f;  // 2.0 * cos(2.0 / 16.0 * 2.0 * pi)
+constexpr float m3 = 1.41421354f;  // 2.0 * cos(2.0 / 16.0 * 2.0 * pi)
+constexpr float m5 = 0.765366852f; // 2.0 * cos(3.0 / 16.0 * 2.0 * pi)
+constexpr float m2 = m0 - m5;
+constexpr float m4 = m0 + m5;
+
+constexpr float s0 = 0.353553385f;  // cos(0.0 / 16.0 * pi) / sqrt(8)
+constexpr float s1 = 0.490392625f;  // cos(1.0 / 16.0 * pi) / 2.0
+constexpr float s2 = 0.461939752f;  // cos(2.0 / 16.0 * pi) / 2.0
+constexpr float s3 = 0.415734798f;  // cos(3.0 / 16.0 * pi) / 2.0
+constexpr float s4 = 0.353553385f;  // cos(4.0 / 16.0 * pi) / 2.0
+constexpr float s5 = 0.277785122f;  // cos(5.0 / 16.0 * pi) / 2.0
+constexpr float s6 = 0.191341713f;  // cos(6.0 / 16.0 * pi) / 2.0
+constexpr float s7 = 0.0975451618f; // cos(7.0 / 16.0 * pi) / 2.0
+
+// round the output of a float DCT to the nearest integer, halves up, as floor(x + 0.5) would
+//   the bias makes any x above -2^24 positive, so truncating the sum floors it,
+//   and a double holds the sum exactly
+inline int roundDCTOutput(const float x) {
+    return (int)((double)x + 16777216.5) - 16777216;
+}
+
+// fixed point constants for the accurate integer DCT
+//   FIX(x) = x * 2^13 rounded
+const int dctAccurateConstBits = 13;
+const int dctAccuratePass1Bits = 2;
+const int FIX_0_298631336 = 2446;
+const int FIX_0_390180644 = 3196;
+const int FIX_0_541196100 = 4433;
+const int FIX_0_765366865 = 6270;
+const int FIX_0_899976223 = 7373;
+const int FIX_1_175875602 = 9633;
+const int FIX_1_501321110 = 12299;
+const int FIX_1_847759065 = 15137;
+const int FIX_1_961570560 = 16069;
+const int FIX_2_053119869 = 16819;
+const int FIX_2_562915447 = 20995;
+const int FIX_3_072711026 = 25172;
+
+// fixed point constants for the fast integer DCT
+//   FIX(x) = x * 2^8 rounded
+const int dctFastConstBits = 8;
+const int dctFastPass1Bits = 2;
+const int FAST_0_382683433 = 98;
+const int FAST_0_541196100 = 139;
+const int FAST_0_707106781 = 181;
+const int FAST_1_082392200 = 277;
+const int FAST_1_306562965 = 334;
+const int FAST_1_414213562 = 362;
+const int FAST_1_847759065 = 473;
+const int FAST_2_613125930 = 669;
+
+// AAN scale factors for the fast integer DCT, folded into the quantization tables
+//   aanScales[v * 8 + u] = a[u] * a[v] * 2^14
+//   a[0] = 1, a[k] = cos(k * pi / 16) * sqrt(2)
+constexpr int aanScaleBits = 14;
+constexpr uint aanScales[64] = {
+    16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520,
+    22725, 31521, 29692, 26722, 22725, 17855, 12299,  6270,
+    21407, 29692, 27969, 25172, 21407, 16819, 11585,  5906,
+    19266, 26722, 25172, 22654, 19266, 15137, 10426,  5315,
+    16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520,
+    12873, 17855, 16819, 15137, 12873, 10114,  6967,  3552,
+     8867, 12299, 11585, 10426,  8867,  6967,  4799,  2446,
+     4520,  6270,  5906,  5315,  4520,  3552,  2446,  1247
+};
+
+// fixed point constants for YCbCr to RGB conversion
+//   FIX(x) = x * 2^14 rounded, small enough for 16-bit SIMD multiplies
+const int colorConstBits = 14;
+const int FIX_CR_TO_R = 22970; // 1.40200
+const int FIX_CB_TO_G = 5638;  // 0.34414
+const int FIX_CR_TO_G = 11700; // 0.71414
+const int FIX_CB_TO_B = 29032; // 1.77200
+
+// fixed point constants for RGB to YCbCr conversion
+//   FIX(x) = x * 2^16 rounded
+const int rgbConstBits = 16;
+const int FIX_R_TO_Y = 19595;  // 0.29900
+const int FIX_G_TO_Y = 38470;  // 0.58700
+const int FIX_B_TO_Y = 7471;   // 0.11400
+const int FIX_R_TO_CB = 11059; // 0.16874
+const int FIX_G_TO_CB = 21709; // 0.33126
+const int FIX_B_TO_CB = 32768; // 0.50000
+const int FIX_R_TO_CR = 32768; // 0.50000
+const int FIX_G_TO_CR = 27439; // 0.41869
+const int FIX_B_TO_CR = 5329;  // 0.08131
+
+// lookup table of a per-channel color conversion product, one entry per 8-bit sample
+struct ColorTable {
+    int values[256];
+
+    constexpr int operator[](const uint i) const {
+        return values[i];
+    }
+};
+
+// values[i] = (multiplier * (i - offset) + rounding) >> shift
+constexpr ColorTable makeColorTable(const int multiplier, const int offset, const int rounding, const int shift) {
+    ColorTable table = {};
+    for (int i = 0; i < 256; ++i) {
+        table.values[i] = (multiplier * (i - offset) + rounding) >> shift;
+    }
+    return table;
+}
+
+// YCbCr to RGB tables, as in libjpeg's jdcolor
+//   indexed by a chroma sample + 128
+//   r = y + crToR[cr]
+//   g = y + ((cbToG[cb] + crToG[cr]) >> colorConstBits)
+//   b = y + cbToB[cb]
+constexpr ColorTable crToR = makeColorTable(FIX_CR_TO_R, 128, 1 << (colorConstBits - 1), colorConstBits);
+constexpr ColorTable cbToG = makeColorTable(-FIX_CB_TO_G, 128, 1 << (colorConstBits - 1), 0);
+constexpr ColorTable crToG = makeColorTable(-FIX_CR_TO_G, 128, 0, 0);
+constexpr ColorTable cbToB = makeColorTable(FIX_CB_TO_B, 128, 1 << (colorConstBits - 1), colorConstBits);
+
+// RGB to YCbCr tables, as in libjpeg's jccolor
+//   indexed by an 8-bit r, g or b sample, the sum of three entries is shifted down by rgbConstBits
+//   the rounding of cb and cr is just under one half, so that they never reach 128
+constexpr ColorTable rToY = makeColorTable(FIX_R_TO_Y, 0, 0, 0);
+constexpr ColorTable gToY = makeColorTable(FIX_G_TO_Y, 0, 0, 0);
+constexpr ColorTable bToY = makeColorTable(FIX_B_TO_Y, 0, 1 << (rgbConstBits - 1), 0);
+constexpr ColorTable rToCb = makeColorTable(-FIX_R_TO_CB, 0, 0, 0);
+constexpr ColorTable gToCb = makeColorTable(-FIX_G_TO_CB, 0, 0, 0);
+constexpr ColorTable bToCb = makeColorTable(FIX_B_TO_CB, 0, (1 << (rgbConstBits - 1)) - 1, 0);
+constexpr ColorTable rToCr = makeColorTable(FIX_R_TO_CR, 0, (1 << (rgbConstBits - 1)) - 1, 0);
+constexpr ColorTable gToCr = makeColorTable(-FIX_G_TO_CR, 0, 0, 0);
+constexpr ColorTable bToCr = makeColorTable(-FIX_B_TO_CR, 0, 0, 0);
 
 // standard tables
 
-const QuantizationTable qTableY50 = {
+constexpr QuantizationTable qTableY50 = {
     {
         16,  11,  10,  16,  24,  40,  51,  61,
         12,  12,  14,  19,  26,  58,  60,  55,
@@ -230,7 +495,7 @@ const QuantizationTable qTableY50 = {
     true
 };
 
-const QuantizationTable qTableCbCr50 = {
+constexpr QuantizationTable qTableCbCr50 = {
     {
         17, 18, 24, 47, 99, 99, 99, 99,
         18, 21, 26, 66, 99, 99, 99, 99,
@@ -244,7 +509,7 @@ const QuantizationTable qTableCbCr50 = {
     true
 };
 
-const QuantizationTable qTableY75 = {
+constexpr QuantizationTable qTableY75 = {
     {
         16/2,  11/2,  10/2,  16/2,  24/2,  40/2,  51/2,  61/2,
         12/2,  12/2,  14/2,  19/2,  26/2,  58/2,  60/2,  55/2,
@@ -258,7 +523,7 @@ const QuantizationTable qTableY75 = {
     true
 };
 
-const QuantizationTable qTableCbCr75 = {
+constexpr QuantizationTable qTableCbCr75 = {
     {
         17/2, 18/2, 24/2, 47/2, 99/2, 99/2, 99/2, 99/2,
         18/2, 21/2, 26/2, 66/2, 99/2, 99/2, 99/2, 99/2,
@@ -272,7 +537,7 @@ const QuantizationTable qTableCbCr75 = {
     true
 };
 
-const QuantizationTable qTableY100 = {
+constexpr QuantizationTable qTableY100 = {
     {
         1, 1, 1, 1, 1, 1, 1, 1,
         1, 1, 1, 1, 1, 1, 1, 1,
@@ -286,7 +551,7 @@ const QuantizationTable qTableY100 = {
     true
 };
 
-const QuantizationTable qTableCbCr100 = {
+constexpr QuantizationTable qTableCbCr100 = {
     {
         1, 1, 1, 1, 1, 1, 1, 1,
         1, 1, 1, 1, 1, 1, 1, 1,
@@ -300,25 +565,26 @@ const QuantizationTable qTableCbCr100 = {
     true
 };
 
-const QuantizationTable* const qTables50[]  = {  &qTableY50,  &qTableCbCr50,  &qTableCbCr50 };
-const QuantizationTable* const qTables75[]  = {  &qTableY75,  &qTableCbCr75,  &qTableCbCr75 };
-const QuantizationTable* const qTables100[] = { &qTableY100, &qTableCbCr100, &qTableCbCr100 };
+constexpr const QuantizationTable* qTables50[]  = {  &qTableY50,  &qTableCbCr50,  &qTableCbCr50 };
+constexpr const QuantizationTable* qTables75[]  = {  &qTableY75,  &qTableCbCr75,  &qTableCbCr75 };
+constexpr const QuantizationTable* qTables100[] = { &qTableY100, &qTableCbCr100, &qTableCbCr100 };
 
-HuffmanTable hDCTableY = {
+// standard Huffman tables from Annex K of the JPEG specification, used by the encoder
+constexpr HuffmanTable hDCTableY = {
     { 0, 0, 1, 6, 7, 8, 9, 10, 11, 12, 12, 12, 12, 12, 12, 12, 12 },
     { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b },
     {},
     false
 };
 
-HuffmanTable hDCTableCbCr = {
+constexpr HuffmanTable hDCTableCbCr = {
     { 0, 0, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 12, 12, 12, 12, 12 },
     { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b },
     {},
     false
 };
 
-HuffmanTable hACTableY = {
+constexpr HuffmanTable hACTableY = {
     { 0, 0, 2, 3, 6, 9, 11, 15, 18, 23, 28, 32, 36, 36, 36, 37, 162 },
     {
         0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
@@ -347,7 +613,7 @@ HuffmanTable hACTableY = {
     false
 };
 
-HuffmanTable hACTableCbCr = {
+constexpr HuffmanTable hACTableCbCr = {
     { 0, 0, 2, 3, 5, 9, 13, 16, 20, 27, 32, 36, 40, 40, 41, 43, 162 },
     {
         0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
@@ -376,7 +642,75 @@ HuffmanTable hACTableCbCr = {
     false
 };
 
-HuffmanTable* const dcTables[] = { &hDCTableY, &hDCTableCbCr, &hDCTableCbCr };
-HuffmanTable* const acTables[] = { &hACTableY, &hACTableCbCr, &hACTableCbCr };
+constexpr const HuffmanTable* dcTables[] = { &hDCTableY, &hDCTableCbCr, &hDCTableCbCr };
+constexpr const HuffmanTable* acTables[] = { &hACTableY, &hACTableCbCr, &hACTableCbCr };
+
+// the code and code length of every symbol of a Huffman table, for encoding
+//   symbols not in the table have a length of 0
+struct HuffmanCodeTable {
+    uint codes[256] = { 0 };
+    byte lengths[256] = { 0 };
+};
+
+// generate the codes of a Huffman table at compile time
+//   codes of each length follow on from the shorter ones, as in generateCodes
+constexpr HuffmanCodeTable makeHuffmanCodeTable(const HuffmanTable& hTable) {
+    HuffmanCodeTable codeTable;
+    uint code = 0;
+    for (uint i = 0; i < 16; ++i) {
+        for (uint j = hTable.offsets[i]; j < hTable.offsets[i + 1]; ++j) {
+            codeTable.codes[hTable.symbols[j]] = code;
+            codeTable.lengths[hTable.symbols[j]] = i + 1;
+            code += 1;
+        }
+        code <<= 1;
+    }
+    return codeTable;
+}
+
+constexpr HuffmanCodeTable hDCCodesY = makeHuffmanCodeTable(hDCTableY);
+constexpr HuffmanCodeTable hDCCodesCbCr = makeHuffmanCodeTable(hDCTableCbCr);
+constexpr HuffmanCodeTable hACCodesY = makeHuffmanCodeTable(hACTableY);
+constexpr HuffmanCodeTable hACCodesCbCr = makeHuffmanCodeTable(hACTableCbCr);
+
+constexpr const HuffmanCodeTable* dcCodeTables[] = { &hDCCodesY, &hDCCodesCbCr, &hDCCodesCbCr };
+constexpr const HuffmanCodeTable* acCodeTables[] = { &hACCodesY, &hACCodesCbCr, &hACCodesCbCr };
+
+// fraction bits of the encoder's quantization divisors
+//   coefficients are scaled up by as much before they are divided
+const int quantizationFractionBits = 8;
+
+// the divisors the encoder quantizes with for a DCTMethod, in zigzag order
+//   with quantizationFractionBits of fraction
+//   the FDCTs leave their output scaled up, by 8 or by the AAN scales of the fast one,
+//   so that scale is folded into the quantization table
+//   the fast FDCT's AAN scales are not whole, so rounding its divisors to whole numbers
+//   would quantize some coefficients far more finely, and others more coarsely, than the table
+constexpr QuantizationTable makeQuantizationDivisors(const QuantizationTable& qTable, const DCTMethod dctMethod) {
+    QuantizationTable divisors = qTable;
+    for (uint i = 0; i < 64; ++i) {
+        divisors.table[i] = qTable.table[zigZagMap[i]];
+        if (dctMethod == DCT_FAST) {
+            const uint shift = aanScaleBits - 3 - quantizationFractionBits;
+            divisors.table[i] = (divisors.table[i] * aanScales[zigZagMap[i]] + (1 << (shift - 1))) >> shift;
+        }
+        else {
+            divisors.table[i] <<= 3 + quantizationFractionBits;
+        }
+    }
+    return divisors;
+}
+
+// indexed by DCTMethod
+constexpr QuantizationTable qDivisorsY100[3] = {
+    makeQuantizationDivisors(qTableY100, DCT_FAST),
+    makeQuantizationDivisors(qTableY100, DCT_ACCURATE),
+    makeQuantizationDivisors(qTableY100, DCT_FLOAT)
+};
+constexpr QuantizationTable qDivisorsCbCr100[3] = {
+    makeQuantizationDivisors(qTableCbCr100, DCT_FAST),
+    makeQuantizationDivisors(qTableCbCr100, DCT_ACCURATE),
+    makeQuantizationDivisors(qTableCbCr100, DCT_FLOAT)
+};
 
 #endif
@@ -0,0 +1,303 @@
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <system_error>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "jpg.h"
+
+// state shared by a Scheduler's workers
+struct jed::Scheduler::Context {
+    struct Worker {
+        // guards tasks and stats
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+        WorkerStats stats;
+        std::thread thread;
+    };
+
+    // workers are only ever the first numWorkers, those whose threads could be started
+    std::vector<Worker> workers;
+    uint numWorkers = 0;
+    const std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+    // guards the counts, which idle workers and wait sleep on
+    //   and is only ever locked after, not before, the mutex of a worker
+    std::mutex mutex;
+    std::condition_variable queuedChanged;
+    std::condition_variable unfinishedChanged;
+    std::size_t queued = 0;     // tasks on the queues
+    std::size_t unfinished = 0; // tasks submitted and not yet finished
+    bool stopping = false;
+
+    // queue that the next task submitted from outside the workers goes on
+    uint nextQueue = 0;
+
+    explicit Context(const uint threads) :
+    workers(threads)
+    {}
+
+    // take the newest task of the worker's own queue, or else the oldest of another worker's
+    bool take(const uint index, std::function<void()>& task, bool& stolen) {
+        for (uint i = 0; i < numWorkers; ++i) {
+            Worker& worker = workers[(index + i) % numWorkers];
+            std::lock_guard<std::mutex> workerLock(worker.mutex);
+            if (!worker.tasks.empty()) {
+                stolen = i != 0;
+                if (stolen) {
+                    task = std::move(worker.tasks.front());
+                    worker.tasks.pop_front();
+                }
+                else {
+                    task = std::move(worker.tasks.back());
+                    worker.tasks.pop_back();
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                queued -= 1;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // run tasks until the scheduler is destroyed, sleeping while every queue is empty
+    void work(const uint index);
+
+    // the scheduler whose worker is the calling thread, and its index
+    static thread_local const Context* currentContext;
+    static thread_local uint currentWorker;
+};
+
+thread_local const jed::Scheduler::Context* jed::Scheduler::Context::currentContext = nullptr;
+thread_local uint jed::Scheduler::Context::currentWorker = 0;
+
+void jed::Scheduler::Context::work(const uint index) {
+    currentContext = this;
+    currentWorker = index;
+    Worker& worker = workers[index];
+    while (true) {
+        // sleep until there is a task, which also keeps workers from looking at the queues
+        //   before the constructor has counted them
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            queuedChanged.wait(lock, [&]() { return stopping || queued > 0; });
+            if (stopping && queued == 0) {
+                return;
+            }
+        }
+
+        // another worker may have taken the task first
+        std::function<void()> task;
+        bool stolen = false;
+        if (!take(index, task, stolen)) {
+            continue;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        task();
+        const std::chrono::duration<double> busy = std::chrono::steady_clock::now() - start;
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.stats.busySeconds += busy.count();
+            worker.stats.tasks += 1;
+            worker.stats.stolen += stolen ? 1 : 0;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        unfinished -= 1;
+        if (unfinished == 0) {
+            unfinishedChanged.notify_all();
+        }
+    }
+}
+
+jed::Scheduler::Scheduler(uint threads, const bool pinned) :
+context(nullptr)
+{
+    const uint cores = std::max(std::thread::hardware_concurrency(), 1u);
+    if (threads == 0) {
+        threads = cores;
+    }
+    context = new (std::nothrow) Context(threads);
+    if (context == nullptr) {
+        std::cout << "Error - Memory error\n";
+        return;
+    }
+
+#if defined(__linux__)
+    // workers are bound in turn to the CPUs this process may run on, which need not be numbered from 0
+    //   if those cannot be read, workers are left unbound
+    std::vector<int> allowed;
+    if (pinned) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &cpus)) {
+                    allowed.push_back(cpu);
+                }
+            }
+        }
+    }
+#else
+    (void)pinned;
+#endif
+
+    for (uint i = 0; i < threads; ++i) {
+        try {
+            context->workers[i].thread = std::thread([this, i]() { context->work(i); });
+        }
+        catch (const std::system_error&) {
+            break;
+        }
+        context->numWorkers = i + 1;
+#if defined(__linux__)
+        if (!allowed.empty()) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(allowed[i % allowed.size()], &cpus);
+            pthread_setaffinity_np(context->workers[i].thread.native_handle(), sizeof(cpus), &cpus);
+        }
+#endif
+    }
+}
+
+jed::Scheduler::~Scheduler() {
+    if (context == nullptr) {
+        return;
+    }
+    wait();
+    {
+        std::lock_guard<std::mutex> lock(context->mutex);
+        context->stopping = true;
+        context->queuedChanged.notify_all();
+    }
+    for (uint i = 0; i < context->numWorkers; ++i) {
+        context->workers[i].thread.join();
+    }
+    delete context;
+}
+
+uint jed::Scheduler::size() const {
+    return (context == nullptr) ? 0 : context->numWorkers;
+}
+
+void jed::Scheduler::submit(const std::function<void()>& task) {
+    // without workers, the calling thread is the only one there is
+    if (size() == 0) {
+        task();
+        return;
+    }
+
+    uint index = 0;
+    {
+        std::lock_guard<std::mutex> lock(context->mutex);
+        if (Context::currentContext == context) {
+            index = Context::currentWorker;
+        }
+        else {
+            index = context->nextQueue;
+            context->nextQueue = (context->nextQueue + 1) % context->numWorkers;
+        }
+    }
+
+    // the task is counted before it can be taken, so the count never drops below 0
+    Context::Worker& worker = context->workers[index];
+    std::lock_guard<std::mutex> workerLock(worker.mutex);
+    worker.tasks.push_back(task);
+    std::lock_guard<std::mutex> lock(context->mutex);
+    context->queued += 1;
+    context->unfinished += 1;
+    context->queuedChanged.notify_one();
+}
+
+void jed::Scheduler::wait() {
+    if (size() == 0) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(context->mutex);
+    context->unfinishedChanged.wait(lock, [&]() { return context->unfinished == 0; });
+}
+
+uint jed::Scheduler::workerIndex() const {
+    return (context != nullptr && Context::currentContext == context) ? Context::currentWorker : size();
+}
+
+void jed::Scheduler::getStats(std::vector<WorkerStats>& stats) const {
+    stats.resize(size());
+    if (context == nullptr) {
+        return;
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - context->started;
+    for (uint i = 0; i < stats.size(); ++i) {
+        Context::Worker& worker = context->workers[i];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        stats[i] = worker.stats;
+        stats[i].elapsedSeconds = elapsed.count();
+    }
+}
+
+// whether the scheduler's subtasks may still start, and how many are running
+struct Helpers::State {
+    std::mutex mutex;
+    std::condition_variable finished;
+    uint running = 0;
+    bool closed = false;
+};
+
+Helpers::Helpers(Scheduler* const s) :
+scheduler(s)
+{}
+
+void Helpers::start(const uint count, const std::function<void()>& work) {
+    if (scheduler != nullptr && scheduler->size() > 0) {
+        if (state == nullptr) {
+            state = std::make_shared<State>();
+        }
+        // each subtask keeps the state alive, as it may be taken long after the helpers are done with
+        const std::shared_ptr<State> shared = state;
+        for (uint i = 0; i < count; ++i) {
+            scheduler->submit([shared, work]() {
+                {
+                    std::lock_guard<std::mutex> lock(shared->mutex);
+                    if (shared->closed) {
+                        return;
+                    }
+                    shared->running += 1;
+                }
+                work();
+                std::lock_guard<std::mutex> lock(shared->mutex);
+                shared->running -= 1;
+                shared->finished.notify_all();
+            });
+        }
+        return;
+    }
+
+    for (uint i = 0; i < count; ++i) {
+        try {
+            threads.emplace_back(work);
+        }
+        catch (const std::system_error&) {
+            break;
+        }
+    }
+}
+
+void Helpers::wait() {
+    if (state != nullptr) {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->closed = true;
+        state->finished.wait(lock, [&]() { return state->running == 0; });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    threads.clear();
+}
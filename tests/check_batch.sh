@@ -0,0 +1,48 @@
+#!/bin/sh
+# check the decoder's batch mode against decoding each sample on its own with one thread
+#   every sample in the tests directory must come out the same, on either I/O backend,
+#   and every sample in tests/corrupt must fail with the status decode and leave no output
+#   two inputs of a list with the same name must both be written, the second with _2 appended
+#   usage: check_batch.sh DECODER TESTS_DIR
+set -e
+decoder=$1
+tests=$2
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+mkdir "$work/in" "$work/single"
+cp "$tests"/*.jpg "$tests"/corrupt/*.jpg "$work/in/"
+for sample in "$tests"/*.jpg; do
+    cp "$sample" "$work/single/"
+    "$decoder" --threads=1 "$work/single/$(basename "$sample")" > /dev/null
+done
+
+failed=0
+for io in uring threads; do
+    rm -rf "$work/out"
+    "$decoder" --batch="$work/in" --out="$work/out" --jobs=3 --threads=2 --io=$io > /dev/null
+    for input in "$work"/in/*.jpg; do
+        name=$(basename "$input" .jpg)
+        status=$(awk -F '\t' -v input="$input" '$1 == input { print $3 }' "$work/out/summary.tsv")
+        if [ -f "$tests/corrupt/$name.jpg" ]; then
+            if [ "$status" != decode ] || [ -f "$work/out/$name.bmp" ]; then
+                echo "Error - $name.jpg: expected to fail with decode on $io, got $status"
+                failed=1
+            fi
+        elif [ "$status" != ok ] || ! cmp -s "$work/single/$name.bmp" "$work/out/$name.bmp"; then
+            echo "Error - $name.jpg: batch output on $io differs from decoding it alone ($status)"
+            failed=1
+        fi
+    done
+done
+mkdir "$work/a" "$work/b"
+cp "$tests/cat.jpg" "$work/a/x.jpg"
+cp "$tests/cat_progressive.jpg" "$work/b/x.jpg"
+printf '%s\n' "$work/a/x.jpg" "$work/b/x.jpg" > "$work/list.txt"
+"$decoder" --batch="$work/list.txt" --out="$work/same" > /dev/null
+if ! cmp -s "$work/single/cat.bmp" "$work/same/x.bmp" ||
+   ! cmp -s "$work/single/cat_progressive.bmp" "$work/same/x_2.bmp"; then
+    echo "Error - inputs of a list with the same name did not get outputs of their own"
+    failed=1
+fi
+exit $failed
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jed_c.h"
+
+// regression check of the C interface, compiled as C
+//   each sample is probed, decoded into memory bottom-up with a negative stride and into the decoder's own,
+//   and the two must be the same rows in reverse order
+//   the pixels are encoded again, and the JPG must decode to the same size
+//   an unknown pixel format or DCT method, a scale of 3 and a negative thread count must all fail
+//   usage: check_c_api sample.jpg...
+
+static unsigned char* readFile(const char* filename, size_t* size) {
+    FILE* const file = fopen(filename, "rb");
+    if (file == NULL) {
+        printf("Error - Error opening %s\n", filename);
+        return NULL;
+    }
+    unsigned char* data = NULL;
+    long length = -1;
+    if (fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0) {
+        data = (unsigned char*)malloc((size_t)length);
+    }
+    if (data != NULL && fread(data, 1, (size_t)length, file) != (size_t)length) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    if (data == NULL) {
+        printf("Error - Error reading %s\n", filename);
+        return NULL;
+    }
+    *size = (size_t)length;
+    return data;
+}
+
+// decode a sample every way the C interface allows, and encode it again
+static int checkSample(const char* name, const unsigned char* jpg, size_t size,
+                       jed_decoder* decoder, jed_encoder* encoder) {
+    jed_decode_options options;
+    jed_decode_options_init(&options);
+
+    unsigned int width = 0;
+    unsigned int height = 0;
+    unsigned int components = 0;
+    if (!jed_probe(decoder, jpg, size, &options, &width, &height, &components) ||
+        width == 0 || height == 0 || (components != 1 && components != 3)) {
+        printf("Error - %s: jed_probe failed\n", name);
+        return 0;
+    }
+
+    // the top row goes at the end of the memory, and each row after it one row before
+    const size_t rowSize = (size_t)width * 3;
+    unsigned char* const bottomUp = (unsigned char*)malloc(rowSize * height);
+    if (bottomUp == NULL) {
+        printf("Error - Out of memory\n");
+        return 0;
+    }
+    int matched = 1;
+    const unsigned char* pixels = NULL;
+    unsigned int decodedWidth = 0;
+    unsigned int decodedHeight = 0;
+    if (!jed_decode_into(decoder, jpg, size, &options, JED_PIXEL_RGB, bottomUp + rowSize * (height - 1),
+                         width, height, -(int)rowSize) ||
+        !jed_decode(decoder, jpg, size, &options, JED_PIXEL_RGB, &pixels, &decodedWidth, &decodedHeight) ||
+        decodedWidth != width || decodedHeight != height) {
+        printf("Error - %s: jed_decode_into or jed_decode failed, or gave a size other than jed_probe\n", name);
+        matched = 0;
+    }
+    for (unsigned int y = 0; matched && y < height; ++y) {
+        if (memcmp(pixels + rowSize * y, bottomUp + rowSize * (height - 1 - y), rowSize) != 0) {
+            printf("Error - %s: jed_decode_into with a negative stride differs from jed_decode\n", name);
+            matched = 0;
+        }
+    }
+    free(bottomUp);
+    if (!matched) {
+        return 0;
+    }
+
+    const unsigned char* encoded = NULL;
+    size_t encodedSize = 0;
+    if (!jed_encode(encoder, pixels, width, height, (int)rowSize, JED_PIXEL_RGB, JED_DCT_FLOAT,
+                    &encoded, &encodedSize) ||
+        !jed_probe(decoder, encoded, encodedSize, NULL, &decodedWidth, &decodedHeight, &components) ||
+        decodedWidth != width || decodedHeight != height) {
+        printf("Error - %s: jed_encode failed, or its JPG does not decode to the same size\n", name);
+        return 0;
+    }
+
+    // every one of these must be refused
+    int refused = 1;
+    jed_decode_options badScale = options;
+    badScale.scale = 3;
+    jed_decode_options badThreads = options;
+    badThreads.threads = -1;
+    refused = !jed_decode(decoder, jpg, size, &options, 99, &pixels, &decodedWidth, &decodedHeight) && refused;
+    refused = !jed_encode(encoder, pixels, width, height, (int)rowSize, 99, JED_DCT_FLOAT,
+                          &encoded, &encodedSize) && refused;
+    refused = !jed_encode(encoder, pixels, width, height, (int)rowSize, JED_PIXEL_RGB, 99,
+                          &encoded, &encodedSize) && refused;
+    refused = !jed_probe(decoder, jpg, size, &badScale, &width, &height, &components) && refused;
+    refused = !jed_decode(decoder, jpg, size, &badScale, JED_PIXEL_RGB, &pixels, &decodedWidth,
+                          &decodedHeight) && refused;
+    refused = !jed_decode(decoder, jpg, size, &badThreads, JED_PIXEL_RGB, &pixels, &decodedWidth,
+                          &decodedHeight) && refused;
+    if (!refused) {
+        printf("Error - %s: an invalid format, DCT method, scale or thread count was accepted\n", name);
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printf("Error - Invalid arguments\n");
+        return 1;
+    }
+
+    jed_decoder* const decoder = jed_decoder_create();
+    jed_encoder* const encoder = jed_encoder_create();
+    if (decoder == NULL || encoder == NULL) {
+        printf("Error - Out of memory\n");
+        return 1;
+    }
+
+    int matched = 1;
+    for (int i = 1; i < argc; ++i) {
+        size_t size = 0;
+        unsigned char* const jpg = readFile(argv[i], &size);
+        if (jpg == NULL) {
+            return 1;
+        }
+        matched = checkSample(argv[i], jpg, size, decoder, encoder) && matched;
+        free(jpg);
+    }
+    jed_encoder_destroy(encoder);
+    jed_decoder_destroy(decoder);
+
+    if (matched) {
+        printf("The C interface matched its description\n");
+    }
+    return matched ? 0 : 1;
+}
@@ -0,0 +1,269 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cmath>
+
+#include "jed.h"
+
+using namespace jed;
+
+// regression check of the decoding options against a plain decode of the same sample
+//   each region cropped must be exactly that region of the whole image,
+//   whether or not the restart intervals around it are skipped
+//   each scaled image must be close to the whole image averaged down,
+//   and a region cropped from it exactly that region of the scaled image
+//   planes encoded again as they are must decode to planes of the same layout, close to the first
+//   gray output, with or without luma-only decoding, must be exactly the luma plane,
+//   and color output from luma only, or from a grayscale JPG, that luma in every channel
+//   usage: check_options sample.jpg...
+
+bool readFile(const std::string& filename, std::vector<byte>& data) {
+    std::ifstream inFile(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open()) {
+        std::cout << "Error - Error opening " << filename << '\n';
+        return false;
+    }
+    data.assign(std::istreambuf_iterator<char>(inFile), std::istreambuf_iterator<char>());
+    return true;
+}
+
+// decode regions of the image, with either upsampling, and compare them to the same pixels of the whole image
+bool checkCrop(const std::string& name, const std::vector<byte>& jpg) {
+    bool matched = true;
+    for (const ChromaUpsampling upsampling : { UPSAMPLE_NEAREST, UPSAMPLE_FANCY }) {
+        DecodeOptions options;
+        options.upsampling = upsampling;
+        Decoder decoder;
+        std::vector<byte> whole;
+        ImageInfo wholeInfo;
+        if (!decoder.decode(jpg.data(), jpg.size(), options, PIXEL_RGB, whole, wholeInfo)) {
+            std::cout << "Error - " << name << ": failed to decode\n";
+            return false;
+        }
+        const uint width = wholeInfo.width;
+        const uint height = wholeInfo.height;
+
+        // the middle, an odd region near the top-left, the bottom-right pixel,
+        //   a strip of whole rows, and a strip of columns along the right edge
+        Region regions[5];
+        regions[0] = { width / 4, height / 3, width / 2, height / 3 };
+        regions[1] = { 3, 5, 17, 9 };
+        regions[2] = { width - 1, height - 1, 1, 1 };
+        regions[3] = { 0, height / 2, width, 16 };
+        regions[4] = { width - 21, 0, 21, height };
+        for (const Region& region : regions) {
+            options.crop = region;
+            std::vector<byte> pixels;
+            ImageInfo info;
+            bool same = decoder.decode(jpg.data(), jpg.size(), options, PIXEL_RGB, pixels, info) &&
+                        info.width == region.width && info.height == region.height;
+            for (uint y = 0; same && y < region.height; ++y) {
+                const byte* const row = whole.data() + ((std::size_t)(region.y + y) * width + region.x) * 3;
+                same = std::equal(row, row + region.width * 3, pixels.data() + (std::size_t)y * region.width * 3);
+            }
+            if (!same) {
+                std::cout << "Error - " << name << ": --crop=" << region.width << 'x' << region.height << '+'
+                          << region.x << '+' << region.y << " with --upsample="
+                          << ((upsampling == UPSAMPLE_FANCY) ? "fancy" : "nearest")
+                          << " differs from that region of the whole image\n";
+                matched = false;
+            }
+        }
+    }
+    return matched;
+}
+
+// peak signal to noise ratio of 8-bit samples against reference samples, in dB
+double PSNR(const std::vector<byte>& samples, const std::vector<byte>& reference) {
+    double squaredError = 0.0;
+    for (std::size_t i = 0; i < samples.size(); ++i) {
+        squaredError += (samples[i] - reference[i]) * (samples[i] - reference[i]);
+    }
+    const double mse = squaredError / samples.size();
+    return (mse == 0.0) ? INFINITY : 10.0 * std::log10(255.0 * 255.0 / mse);
+}
+
+// decode at each reduced scale and compare with the whole image averaged over scale x scale boxes,
+//   then crop the scaled image and compare with the same pixels of it uncropped
+bool checkScale(const std::string& name, const std::vector<byte>& jpg) {
+    DecodeOptions options;
+    Decoder decoder;
+    std::vector<byte> whole;
+    ImageInfo wholeInfo;
+    if (!decoder.decode(jpg.data(), jpg.size(), options, PIXEL_RGB, whole, wholeInfo)) {
+        std::cout << "Error - " << name << ": failed to decode\n";
+        return false;
+    }
+    const uint width = wholeInfo.width;
+    const uint height = wholeInfo.height;
+
+    bool matched = true;
+    for (const byte scale : { 2, 4, 8 }) {
+        options.scale = scale;
+        options.crop = Region();
+        std::vector<byte> scaled;
+        ImageInfo info;
+        const uint scaledWidth = (width + scale - 1) / scale;
+        const uint scaledHeight = (height + scale - 1) / scale;
+        if (!decoder.decode(jpg.data(), jpg.size(), options, PIXEL_RGB, scaled, info) ||
+            info.width != scaledWidth || info.height != scaledHeight) {
+            std::cout << "Error - " << name << ": --scale=1/" << (uint)scale << " failed, or gave the wrong size\n";
+            matched = false;
+            continue;
+        }
+
+        // the reduced IDCTs filter differently from averaging, but not by much
+        //   boxes cut by the right or bottom edge are left out,
+        //   as the scaled pixels there also take in the padding the encoder added
+        std::vector<byte> inside;
+        std::vector<byte> averaged;
+        for (uint y = 0; y < height / scale; ++y) {
+            for (uint x = 0; x < width / scale; ++x) {
+                for (uint c = 0; c < 3; ++c) {
+                    uint sum = 0;
+                    for (uint v = y * scale; v < (y + 1) * scale; ++v) {
+                        for (uint h = x * scale; h < (x + 1) * scale; ++h) {
+                            sum += whole[((std::size_t)v * width + h) * 3 + c];
+                        }
+                    }
+                    inside.push_back(scaled[((std::size_t)y * scaledWidth + x) * 3 + c]);
+                    averaged.push_back((sum + scale * scale / 2) / (scale * scale));
+                }
+            }
+        }
+        const double psnr = PSNR(inside, averaged);
+        if (psnr < 35.0) {
+            std::cout << "Error - " << name << ": --scale=1/" << (uint)scale << " is too far from the image averaged down, "
+                      << psnr << " dB\n";
+            matched = false;
+        }
+
+        // the crop is given in full size pixels, and covers the scaled pixels it touches
+        options.crop = { width / 4 + 1, height / 3 + 3, width / 2, height / 3 };
+        const Region& crop = options.crop;
+        const uint left = crop.x / scale;
+        const uint top = crop.y / scale;
+        const uint right = (crop.x + crop.width + scale - 1) / scale;
+        const uint bottom = (crop.y + crop.height + scale - 1) / scale;
+        std::vector<byte> pixels;
+        bool same = decoder.decode(jpg.data(), jpg.size(), options, PIXEL_RGB, pixels, info) &&
+                    info.width == right - left && info.height == bottom - top;
+        for (uint y = top; same && y < bottom; ++y) {
+            const byte* const row = scaled.data() + ((std::size_t)y * scaledWidth + left) * 3;
+            same = std::equal(row, row + (right - left) * 3, pixels.data() + (std::size_t)(y - top) * (right - left) * 3);
+        }
+        if (!same) {
+            std::cout << "Error - " << name << ": --scale=1/" << (uint)scale
+                      << " with --crop differs from that region of the scaled image\n";
+            matched = false;
+        }
+    }
+    return matched;
+}
+
+// decode the planes, encode them again at their subsampling, and decode those
+bool checkPlanes(const std::string& name, const std::vector<byte>& jpg) {
+    Decoder decoder;
+    std::vector<byte> planes[3];
+    ImageInfo info;
+    if (!decoder.decodePlanes(jpg.data(), jpg.size(), DecodeOptions(), planes, info)) {
+        std::cout << "Error - " << name << ": failed to decode planes\n";
+        return false;
+    }
+
+    Encoder encoder;
+    const byte* const planeData[3] = { planes[0].data(), planes[1].data(), planes[2].data() };
+    const int strides[3] = { (int)info.planeWidths[0], (int)info.planeWidths[1], (int)info.planeWidths[2] };
+    std::vector<byte> encoded;
+    std::vector<byte> again[3];
+    ImageInfo againInfo;
+    if (!encoder.encodePlanes(planeData, strides, info.width, info.height, info.horizontalSamplingFactor,
+                              info.verticalSamplingFactor, info.numComponents, EncodeOptions(), encoded) ||
+        !decoder.decodePlanes(encoded.data(), encoded.size(), DecodeOptions(), again, againInfo)) {
+        std::cout << "Error - " << name << ": failed to encode its planes and decode them again\n";
+        return false;
+    }
+
+    // a single plane is encoded with neutral chroma
+    bool matched = info.numComponents == 1 ||
+                   (againInfo.numComponents == info.numComponents &&
+                    againInfo.horizontalSamplingFactor == info.horizontalSamplingFactor &&
+                    againInfo.verticalSamplingFactor == info.verticalSamplingFactor);
+    for (uint i = 0; matched && i < info.numComponents; ++i) {
+        matched = againInfo.planeWidths[i] == info.planeWidths[i] &&
+                  againInfo.planeHeights[i] == info.planeHeights[i] && PSNR(again[i], planes[i]) >= 40.0;
+    }
+    if (!matched) {
+        std::cout << "Error - " << name << ": planes encoded again do not decode to the same layout, "
+                  << "or are too far from the first\n";
+    }
+    return matched;
+}
+
+// decode to gray and to color with and without luma-only decoding, and compare with the luma plane
+bool checkLuma(const std::string& name, const std::vector<byte>& jpg) {
+    Decoder decoder;
+    std::vector<byte> planes[3];
+    ImageInfo planesInfo;
+    if (!decoder.decodePlanes(jpg.data(), jpg.size(), DecodeOptions(), planes, planesInfo)) {
+        std::cout << "Error - " << name << ": failed to decode planes\n";
+        return false;
+    }
+    const std::vector<byte>& luma = planes[0];
+
+    bool matched = true;
+    for (const bool lumaOnly : { false, true }) {
+        DecodeOptions options;
+        options.lumaOnly = lumaOnly;
+        const char* const mode = lumaOnly ? " with --luma" : "";
+        std::vector<byte> gray;
+        ImageInfo info;
+        if (!decoder.decode(jpg.data(), jpg.size(), options, PIXEL_GRAY, gray, info) || gray != luma) {
+            std::cout << "Error - " << name << ": gray output" << mode << " differs from the luma plane\n";
+            matched = false;
+        }
+
+        // only luma can be repeated in every channel
+        if (!lumaOnly && planesInfo.numComponents != 1) {
+            continue;
+        }
+        std::vector<byte> pixels;
+        bool same = decoder.decode(jpg.data(), jpg.size(), options, PIXEL_RGBA, pixels, info) &&
+                    pixels.size() == luma.size() * 4;
+        for (std::size_t i = 0; same && i < luma.size(); ++i) {
+            same = pixels[i * 4 + 0] == luma[i] && pixels[i * 4 + 1] == luma[i] &&
+                   pixels[i * 4 + 2] == luma[i] && pixels[i * 4 + 3] == 255;
+        }
+        if (!same) {
+            std::cout << "Error - " << name << ": RGBA output" << mode << " is not the luma plane in every channel\n";
+            matched = false;
+        }
+    }
+    return matched;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cout << "Error - Invalid arguments\n";
+        return 1;
+    }
+
+    bool matched = true;
+    std::vector<byte> jpg;
+    for (int i = 1; i < argc; ++i) {
+        if (!readFile(argv[i], jpg)) {
+            return 1;
+        }
+        matched = checkCrop(argv[i], jpg) && matched;
+        matched = checkScale(argv[i], jpg) && matched;
+        matched = checkPlanes(argv[i], jpg) && matched;
+        matched = checkLuma(argv[i], jpg) && matched;
+    }
+
+    if (matched) {
+        std::cout << "Decoding options matched a plain decode\n";
+    }
+    return matched ? 0 : 1;
+}
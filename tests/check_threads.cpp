@@ -0,0 +1,209 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "jed.h"
+
+using namespace jed;
+
+// regression check that decoding and encoding on several threads, or as subtasks on a scheduler,
+//   gives exactly what one thread gives
+//   each sample is decoded as it is and cut short, and the image it decodes to is encoded again
+//   with every DCT method, and so is a large image tiled from the first sample,
+//   whose scan is long enough to be entropy decoded in speculative chunks
+//   corrupt samples, and a copy of the large image with corrupt bytes, must fail every time
+//   usage: check_threads sample.jpg... [--corrupt corrupt.jpg...]
+
+// a way of running the decoder and encoder, compared with one thread
+struct Setup {
+    const char* name;
+    uint threads;
+    Scheduler* scheduler;
+};
+
+// what one way of decoding a JPG gave
+struct Decoded {
+    bool valid = false;
+    ImageInfo info;
+    std::vector<byte> pixels;
+    std::vector<byte> planes[3];
+};
+
+bool readFile(const std::string& filename, std::vector<byte>& data) {
+    std::ifstream inFile(filename, std::ios::in | std::ios::binary);
+    if (!inFile.is_open()) {
+        std::cout << "Error - Error opening " << filename << '\n';
+        return false;
+    }
+    data.assign(std::istreambuf_iterator<char>(inFile), std::istreambuf_iterator<char>());
+    return true;
+}
+
+// decode a JPG into packed pixels and into planes
+void decode(const std::vector<byte>& jpg, const uint threads, Scheduler* const scheduler, Decoded& decoded) {
+    DecodeOptions options;
+    options.threads = threads;
+    options.scheduler = scheduler;
+    Decoder decoder;
+    ImageInfo planesInfo;
+    decoded.valid =
+        decoder.decode(jpg.data(), jpg.size(), options, PIXEL_RGB, decoded.pixels, decoded.info) &&
+        decoder.decodePlanes(jpg.data(), jpg.size(), options, decoded.planes, planesInfo);
+}
+
+// decode a JPG on one thread and every other way, and compare
+//   reference is what one thread decoded
+bool checkDecode(const std::string& name, const std::vector<byte>& jpg, const bool corrupt,
+                 const std::vector<Setup>& setups, Decoded& reference) {
+    decode(jpg, 1, nullptr, reference);
+    bool matched = true;
+    if (corrupt && reference.valid) {
+        std::cout << "Error - " << name << ": decoded on one thread, but is corrupt\n";
+        matched = false;
+    }
+
+    for (const Setup& setup : setups) {
+        Decoded decoded;
+        decode(jpg, setup.threads, setup.scheduler, decoded);
+        if (decoded.valid != reference.valid) {
+            std::cout << "Error - " << name << ": " << (decoded.valid ? "decoded" : "failed to decode")
+                      << " with " << setup.name << ", but not on one thread\n";
+            matched = false;
+        }
+        else if (decoded.valid &&
+                 (decoded.pixels != reference.pixels || decoded.planes[0] != reference.planes[0] ||
+                  decoded.planes[1] != reference.planes[1] || decoded.planes[2] != reference.planes[2])) {
+            std::cout << "Error - " << name << ": decoded with " << setup.name << " differs from one thread\n";
+            matched = false;
+        }
+    }
+    return matched;
+}
+
+// encode packed RGB pixels with every DCT method on one thread and every other way, and compare
+//   jpg is what one thread encoded with the last method
+bool checkEncode(const std::string& name, const std::vector<byte>& pixels, const uint width, const uint height,
+                 const std::vector<Setup>& setups, std::vector<byte>& jpg) {
+    const char* const methods[] = { "fast", "accurate", "float" };
+    bool matched = true;
+    for (uint method = DCT_FAST; method <= DCT_FLOAT; ++method) {
+        EncodeOptions options;
+        options.dctMethod = (DCTMethod)method;
+        Encoder encoder;
+        if (!encoder.encode(pixels.data(), width, height, width * 3, PIXEL_RGB, options, jpg)) {
+            std::cout << "Error - " << name << ": failed to encode with --dct=" << methods[method] << '\n';
+            matched = false;
+            continue;
+        }
+
+        for (const Setup& setup : setups) {
+            options.threads = setup.threads;
+            options.scheduler = setup.scheduler;
+            std::vector<byte> encoded;
+            if (!encoder.encode(pixels.data(), width, height, width * 3, PIXEL_RGB, options, encoded) ||
+                encoded != jpg) {
+                std::cout << "Error - " << name << ": encoded with --dct=" << methods[method] << " and "
+                          << setup.name << " differs from one thread\n";
+                matched = false;
+            }
+        }
+        options.threads = 1;
+        options.scheduler = nullptr;
+    }
+    return matched;
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string> samples;
+    std::vector<std::string> corruptSamples;
+    bool corrupt = false;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        if (arg == "--corrupt") {
+            corrupt = true;
+        }
+        else {
+            (corrupt ? corruptSamples : samples).push_back(arg);
+        }
+    }
+    if (samples.empty()) {
+        std::cout << "Error - Invalid arguments\n";
+        return 1;
+    }
+
+    Scheduler scheduler(4);
+    const std::vector<Setup> setups = {
+        { "2 threads", 2, nullptr },
+        { "4 threads", 4, nullptr },
+        { "a scheduler of 4 workers", 0, &scheduler }
+    };
+
+    bool matched = true;
+    std::vector<byte> jpg;
+    std::vector<byte> tiled;
+    uint tiledWidth = 0;
+    uint tiledHeight = 0;
+    for (const std::string& sample : samples) {
+        if (!readFile(sample, jpg)) {
+            return 1;
+        }
+        Decoded reference;
+        matched = checkDecode(sample, jpg, false, setups, reference) && matched;
+        if (!reference.valid) {
+            std::cout << "Error - " << sample << ": failed to decode\n";
+            matched = false;
+            continue;
+        }
+
+        // whether a JPG cut short fails, and with which error, must not depend on the threads either
+        const std::vector<byte> truncated(jpg.begin(), jpg.begin() + jpg.size() * 3 / 5);
+        Decoded truncatedReference;
+        matched = checkDecode(sample + " cut short", truncated, false, setups, truncatedReference) && matched;
+
+        std::vector<byte> encoded;
+        const uint width = reference.info.width;
+        const uint height = reference.info.height;
+        matched = checkEncode(sample, reference.pixels, width, height, setups, encoded) && matched;
+
+        // tile the first sample 5 x 5
+        if (tiled.empty()) {
+            tiledWidth = width * 5;
+            tiledHeight = height * 5;
+            tiled.resize((std::size_t)tiledWidth * tiledHeight * 3);
+            for (uint y = 0; y < tiledHeight; ++y) {
+                for (uint x = 0; x < 5; ++x) {
+                    const byte* const row = reference.pixels.data() + (std::size_t)(y % height) * width * 3;
+                    std::copy(row, row + width * 3, tiled.data() + ((std::size_t)y * tiledWidth + x * width) * 3);
+                }
+            }
+        }
+    }
+
+    for (const std::string& sample : corruptSamples) {
+        if (!readFile(sample, jpg)) {
+            return 1;
+        }
+        Decoded reference;
+        matched = checkDecode(sample, jpg, true, setups, reference) && matched;
+    }
+
+    // large enough for its scan, which has no restart markers, to be entropy decoded in chunks
+    //   halfway through the scan, stuffed 0xFF bytes give 64 bits of ones,
+    //   which no Huffman code starts with
+    const std::string name = "tiled image";
+    matched = checkEncode(name, tiled, tiledWidth, tiledHeight, setups, jpg) && matched;
+    Decoded reference;
+    matched = checkDecode(name, jpg, false, setups, reference) && matched;
+    for (std::size_t i = jpg.size() / 2; i < jpg.size() / 2 + 16; i += 2) {
+        jpg[i] = 0xFF;
+        jpg[i + 1] = 0x00;
+    }
+    matched = checkDecode(name + " with corrupt bytes", jpg, true, setups, reference) && matched;
+
+    if (matched) {
+        std::cout << "Decoding and encoding on several threads matched one thread\n";
+    }
+    return matched ? 0 : 1;
+}
@@ -0,0 +1,46 @@
+#!/bin/sh
+# check that Y4M output of the decoder encodes back to a JPG with the same layout
+#   each sample decoded to Y4M, encoded from it, and decoded again must give the same header and size,
+#   and the encoder must fail on Y4M files it cannot encode as they are
+#   usage: check_y4m.sh ENCODER DECODER TESTS_DIR
+set -e
+encoder=$1
+decoder=$2
+tests=$3
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+mkdir "$work/first" "$work/again"
+failed=0
+for sample in "$tests"/*.jpg; do
+    name=$(basename "$sample" .jpg)
+    cp "$sample" "$work/first/"
+    "$decoder" --format=y4m "$work/first/$name.jpg" > /dev/null
+    cp "$work/first/$name.y4m" "$work/again/"
+    # mono is encoded with neutral chroma, so only its luma is decoded again
+    luma=
+    case $(head -n 1 "$work/first/$name.y4m") in
+        *Cmono*) luma=--luma ;;
+    esac
+    if ! "$encoder" "$work/again/$name.y4m" > /dev/null ||
+       ! "$decoder" --format=y4m $luma "$work/again/$name.jpg" > /dev/null ||
+       [ "$(head -n 1 "$work/first/$name.y4m")" != "$(head -n 1 "$work/again/$name.y4m")" ] ||
+       [ "$(wc -c < "$work/first/$name.y4m")" != "$(wc -c < "$work/again/$name.y4m")" ]; then
+        echo "Error - $name.jpg: Y4M round trip changed its layout"
+        failed=1
+    fi
+done
+
+# a dimension too large to parse, and high bit depth chroma
+printf 'YUV4MPEG2 W99999999999999999999999 H16 C420jpeg\nFRAME\n' > "$work/huge.y4m"
+printf 'YUV4MPEG2 W16 H16 C420p10\nFRAME\n' > "$work/deep.y4m"
+head -c 768 /dev/zero >> "$work/deep.y4m"
+for name in huge deep; do
+    status=0
+    "$encoder" "$work/$name.y4m" > /dev/null 2>&1 || status=$?
+    if [ $status -ne 1 ] || [ -f "$work/$name.jpg" ]; then
+        echo "Error - $name.y4m: expected to be rejected with exit status 1, got $status"
+        failed=1
+    fi
+done
+exit $failed